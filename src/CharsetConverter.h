@@ -0,0 +1,31 @@
+#ifndef CharsetConverter_H
+#define CharsetConverter_H
+
+#ifdef ESP32
+
+#include <Arduino.h>
+
+#define CHARSET_UNSUPPORTED -1
+#define CHARSET_UTF8 0
+
+class CharsetConverter{
+
+    public:
+    CharsetConverter();
+    int getCharset(const char *name, size_t len);
+    size_t toUTF8(char *d, size_t dlen, const char *s, size_t slen, int charset);
+    size_t toUTF8InPlace(char *buf, size_t len, size_t size, int charset);
+
+
+    private:
+    uint16_t codePoint(uint8_t c, int charset);
+    size_t utf8Length(uint16_t cp);
+    size_t encodeUTF8(char *d, uint16_t cp);
+    bool charsetNameEqual(const char *name, size_t len, const char *ref);
+
+
+};
+
+#endif //ESP32
+
+#endif //CharsetConverter_H
@@ -57,7 +57,7 @@ public:
 class TLSTraits : public TransportTraits
 {
 public:
-    TLSTraits(const char *CAcert, const char *clicert = nullptr, const char *clikey = nullptr) : _cacert(CAcert), _clicert(clicert), _clikey(clikey) {}
+    TLSTraits(const char *CAcert, const char *clicert = nullptr, const char *clikey = nullptr, size_t CAcertLength = 0, ESP32MailTLSOptions options = ESP32MailTLSOptions()) : _cacert(CAcert), _clicert(clicert), _clikey(clikey), _cacertLen(CAcertLength), _options(options) {}
 
     std::unique_ptr<WiFiClient> create() override
     {
@@ -67,11 +67,19 @@ public:
     bool verify(WiFiClient &client, const char *host, bool starttls, DebugMsgCallback cb) override
     {
         WiFiClientSecureESP32 &wcs = static_cast<WiFiClientSecureESP32 &>(client);
-        wcs.setCACert(_cacert);
+        if (_cacertLen > 0)
+            wcs.setCACertDER((const uint8_t *)_cacert, _cacertLen);
+        else
+            wcs.setCACert(_cacert);
         wcs.setCertificate(_clicert);
         wcs.setPrivateKey(_clikey);
         wcs.setSTARTTLS(starttls);
         wcs.setDebugCB(cb);
+        wcs.setSessionCache(_options.sessionCache);
+        wcs.setMaxFragmentLength(_options.maxFragmentLength);
+        wcs.setIdleCallback(_options.idleCallback);
+        wcs.setSTARTTLSProtocol(_options.starttlsProtocol);
+        wcs.setCipherProfile(_options.cipherProfile);
         return true;
     }
 
@@ -79,31 +87,80 @@ protected:
     const char *_cacert;
     const char *_clicert;
     const char *_clikey;
+    size_t _cacertLen;
+    ESP32MailTLSOptions _options;
 };
 
+struct ESP32MailPoolEntry
+{
+    std::unique_ptr<WiFiClient> client;
+    int protocol;
+    bool starttls;
+    std::string host;
+    uint16_t port;
+    std::string login;
+    unsigned char passwordHash[32];
+    const char *cacert;
+    size_t cacertLen;
+    int cipherProfile;
+    unsigned long lastUsed;
+    uint8_t flags;
+};
+
+//Idle authenticated connections shared by all clients, the pool functions can be called from any task
+static std::vector<ESP32MailPoolEntry> mailPool;
+static size_t mailPoolSize = 0;
+static unsigned long mailPoolIdleTimeout = ESP32_MAIL_POOL_IDLE_TIMEOUT;
+static SemaphoreHandle_t mailPoolMutex = xSemaphoreCreateMutex();
+
+//only the password is compared by its SHA-256 digest, the other fields are compared as is
+static bool mailPoolMatch(const ESP32MailPoolEntry &a, const ESP32MailPoolEntry &b)
+{
+    return a.protocol == b.protocol && a.starttls == b.starttls && a.port == b.port && memcmp(a.passwordHash, b.passwordHash, sizeof(a.passwordHash)) == 0 &&
+           a.cacert == b.cacert && a.cacertLen == b.cacertLen && a.cipherProfile == b.cipherProfile && a.host == b.host && a.login == b.login;
+}
+
+//Close the connections idle for too long or closed by the server
+static void mailPoolPurge()
+{
+    for (size_t i = mailPool.size(); i > 0; i--)
+    {
+        ESP32MailPoolEntry &entry = mailPool[i - 1];
+        if (millis() - entry.lastUsed > mailPoolIdleTimeout || !entry.client->connected())
+        {
+            entry.client->stop();
+            mailPool.erase(mailPool.begin() + i - 1);
+        }
+    }
+}
+
 ESP32MailHTTPClient::ESP32MailHTTPClient() {}
 
 ESP32MailHTTPClient::~ESP32MailHTTPClient()
 {
     if (_client)
         _client->stop();
+    delete[] _rxBuf;
 }
 
-bool ESP32MailHTTPClient::begin(const char *host, uint16_t port, const char *uri, const char *CAcert)
+bool ESP32MailHTTPClient::begin(const char *host, uint16_t port, const char *uri, const char *CAcert, size_t CAcertLength)
 {
     transportTraits.reset(nullptr);
 
     _host = host;
     _port = port;
     _uri = uri;
-    transportTraits = TransportTraitsPtr(new TLSTraits(CAcert));
+    _cacert = CAcert;
+    _cacertLen = CAcertLength;
+    transportTraits = TransportTraitsPtr(new TLSTraits(CAcert, nullptr, nullptr, CAcertLength, _tlsOptions));
     return true;
 }
 
 bool ESP32MailHTTPClient::connected()
 {
+    //the unread span data is not counted by the client
     if (_client)
-        return ((_client->available() > 0) || _client->connected());
+        return ((_rxPos < _rxLen) || (_client->available() > 0) || _client->connected());
     return false;
 }
 
@@ -142,8 +199,7 @@ bool ESP32MailHTTPClient::connect(void)
 {
     if (connected())
     {
-        while (_client->available() > 0)
-            _client->read();
+        discardReceived();
         return true;
     }
 
@@ -168,8 +224,7 @@ bool ESP32MailHTTPClient::connect(bool starttls)
 {
     if (connected())
     {
-        while (_client->available() > 0)
-            _client->read();
+        discardReceived();
         return true;
     }
 
@@ -190,11 +245,284 @@ bool ESP32MailHTTPClient::connect(bool starttls)
     return connected();
 }
 
+int ESP32MailHTTPClient::connectAsync(bool starttls)
+{
+    if (connected())
+    {
+        discardReceived();
+        return 1;
+    }
+
+    if (!transportTraits)
+        return -1;
+
+    _client = transportTraits->create();
+
+    if (!transportTraits->verify(*_client, _host.c_str(), starttls, _debugCallback))
+    {
+        _client->stop();
+        return -1;
+    }
+
+    return static_cast<WiFiClientSecureESP32 *>(_client.get())->connectAsync(_host.c_str(), _port);
+}
+
+int ESP32MailHTTPClient::connectPoll()
+{
+    if (!_client)
+        return -1;
+    return static_cast<WiFiClientSecureESP32 *>(_client.get())->connectPoll();
+}
+
+void ESP32MailHTTPClient::setIdleCallback(ConnectIdleCallback cb)
+{
+    _tlsOptions.idleCallback = cb;
+}
+
+void ESP32MailHTTPClient::setSTARTTLSProtocol(int protocol)
+{
+    _tlsOptions.starttlsProtocol = protocol;
+}
+
+uint8_t ESP32MailHTTPClient::starttlsCapabilities()
+{
+    if (_client)
+        return static_cast<WiFiClientSecureESP32 *>(_client.get())->starttlsCapabilities();
+    return 0;
+}
+
+void ESP32MailHTTPClient::setCipherProfile(int profile)
+{
+    _tlsOptions.cipherProfile = profile;
+}
+
+const char *ESP32MailHTTPClient::ciphersuite()
+{
+    if (_client)
+        return static_cast<WiFiClientSecureESP32 *>(_client.get())->ciphersuite();
+    return NULL;
+}
+
+unsigned long ESP32MailHTTPClient::handshakeTime()
+{
+    if (_client)
+        return static_cast<WiFiClientSecureESP32 *>(_client.get())->handshakeTime();
+    return 0;
+}
+
+//Return the consumed record payload to mbedTLS
+void ESP32MailHTTPClient::releaseReceived()
+{
+    if (_rxSpan && _client)
+        static_cast<WiFiClientSecureESP32 *>(_client.get())->releaseSpan(_rxLen);
+    _rxSpan = false;
+    _rxData = nullptr;
+    _rxPos = 0;
+    _rxLen = 0;
+}
+
+//Make the received data available in _rxData, return the unread length
+int ESP32MailHTTPClient::fillReceived()
+{
+    if (_rxPos < _rxLen)
+        return _rxLen - _rxPos;
+
+    releaseReceived();
+
+    if (!_client)
+        return 0;
+
+    WiFiClientSecureESP32 *client = static_cast<WiFiClientSecureESP32 *>(_client.get());
+    const uint8_t *data = nullptr;
+
+    //the record payload is parsed where mbedTLS decrypted it
+    int res = client->receiveSpan(data);
+    if (res > 0)
+    {
+        _rxData = data;
+        _rxLen = res;
+        _rxSpan = true;
+        return res;
+    }
+
+    if (res != MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE)
+        return 0;
+
+    //the record is not accessible, copy the data
+    if (!_rxBuf)
+        _rxBuf = new uint8_t[ESP32_MAIL_RX_BUF_SIZE];
+
+    res = client->readAvailable(_rxBuf, ESP32_MAIL_RX_BUF_SIZE);
+    if (res <= 0)
+        return 0;
+
+    _rxData = _rxBuf;
+    _rxLen = res;
+    return res;
+}
+
+int ESP32MailHTTPClient::readByte()
+{
+    if (fillReceived() == 0)
+        return -1;
+    return _rxData[_rxPos++];
+}
+
+int ESP32MailHTTPClient::receiveSpan(const uint8_t *&data)
+{
+    int res = fillReceived();
+    data = res > 0 ? _rxData + _rxPos : nullptr;
+    return res;
+}
+
+void ESP32MailHTTPClient::releaseSpan(size_t len)
+{
+    if (len > _rxLen - _rxPos)
+        len = _rxLen - _rxPos;
+    _rxPos += len;
+}
+
+int ESP32MailHTTPClient::readable()
+{
+    if (_rxPos < _rxLen)
+        return _rxLen - _rxPos;
+    releaseReceived();
+    if (!_client)
+        return 0;
+    return static_cast<WiFiClientSecureESP32 *>(_client.get())->readable();
+}
+
+void ESP32MailHTTPClient::discardReceived()
+{
+    releaseReceived();
+    if (!_client)
+        return;
+    while (_client->available() > 0)
+        _client->read();
+}
+
+void ESP32MailHTTPClient::poolEntry(ESP32MailPoolEntry &entry, int protocol, bool starttls, const std::string &login, const std::string &password)
+{
+    entry.protocol = protocol;
+    entry.starttls = starttls;
+    entry.host = _host;
+    entry.port = _port;
+    entry.login = login;
+    ssl_sha256((const unsigned char *)password.c_str(), password.length(), entry.passwordHash);
+    entry.cacert = _cacert;
+    entry.cacertLen = _cacertLen;
+    entry.cipherProfile = _tlsOptions.cipherProfile;
+}
+
+bool ESP32MailHTTPClient::acquirePooled(int protocol, bool starttls, const std::string &login, const std::string &password, uint8_t &flags)
+{
+    ESP32MailPoolEntry key;
+    bool res = false;
+
+    poolEntry(key, protocol, starttls, login, password);
+
+    xSemaphoreTake(mailPoolMutex, portMAX_DELAY);
+
+    mailPoolPurge();
+
+    for (size_t i = 0; i < mailPool.size(); i++)
+    {
+        if (mailPoolMatch(mailPool[i], key))
+        {
+            if (_client)
+                _client->stop();
+            releaseReceived();
+            _client = std::move(mailPool[i].client);
+            flags = mailPool[i].flags;
+            mailPool.erase(mailPool.begin() + i);
+            res = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(mailPoolMutex);
+
+    return res;
+}
+
+bool ESP32MailHTTPClient::releaseToPool(int protocol, bool starttls, const std::string &login, const std::string &password, uint8_t flags)
+{
+    if (mailPoolSize == 0 || !_client || !_client->connected())
+        return false;
+
+    releaseReceived();
+
+    ESP32MailPoolEntry entry;
+    poolEntry(entry, protocol, starttls, login, password);
+    entry.lastUsed = millis();
+    entry.flags = flags;
+    entry.client = std::move(_client);
+
+    xSemaphoreTake(mailPoolMutex, portMAX_DELAY);
+
+    mailPoolPurge();
+
+    //the oldest idle connection gives its place
+    if (mailPool.size() >= mailPoolSize)
+    {
+        mailPool.front().client->stop();
+        mailPool.erase(mailPool.begin());
+    }
+
+    mailPool.push_back(std::move(entry));
+
+    xSemaphoreGive(mailPoolMutex);
+
+    return true;
+}
+
+void ESP32MailHTTPClient::setPoolOptions(size_t maxSize, unsigned long idleTimeout)
+{
+    xSemaphoreTake(mailPoolMutex, portMAX_DELAY);
+    mailPoolSize = maxSize;
+    mailPoolIdleTimeout = idleTimeout;
+    while (mailPool.size() > mailPoolSize)
+    {
+        mailPool.front().client->stop();
+        mailPool.erase(mailPool.begin());
+    }
+    xSemaphoreGive(mailPoolMutex);
+}
+
+void ESP32MailHTTPClient::clearPool()
+{
+    xSemaphoreTake(mailPoolMutex, portMAX_DELAY);
+    for (size_t i = 0; i < mailPool.size(); i++)
+        mailPool[i].client->stop();
+    mailPool.clear();
+    xSemaphoreGive(mailPoolMutex);
+}
+
 void ESP32MailHTTPClient::setDebugCallback(DebugMsgCallback cb)
 {
     _debugCallback = std::move(cb);
 }
 
+void ESP32MailHTTPClient::setSessionCache(bool enable)
+{
+    _tlsOptions.sessionCache = enable;
+}
+
+bool ESP32MailHTTPClient::setMaxFragmentLength(uint16_t length)
+{
+    if (length != 0 && ssl_max_frag_len_code(length) == MBEDTLS_SSL_MAX_FRAG_LEN_NONE)
+        return false;
+    _tlsOptions.maxFragmentLength = length;
+    return true;
+}
+
+bool ESP32MailHTTPClient::sessionResumed()
+{
+    if (_client)
+        return static_cast<WiFiClientSecureESP32 *>(_client.get())->sessionResumed();
+    return false;
+}
+
 #endif //ESP32
 
 #endif //ESP32MailHTTPClient_CPP
@@ -41,6 +41,20 @@
 #include <WiFiClient.h>
 #include "WiFiClientSecureESP32.h"
 
+#define ESP32_MAIL_POOL_IDLE_TIMEOUT 60000
+#define ESP32_MAIL_RX_BUF_SIZE 512
+
+struct ESP32MailPoolEntry;
+
+struct ESP32MailTLSOptions
+{
+  bool sessionCache = true;
+  uint16_t maxFragmentLength = 0;
+  ConnectIdleCallback idleCallback = NULL;
+  int starttlsProtocol = SSL_STARTTLS_SMTP;
+  int cipherProfile = SSL_CIPHER_PROFILE_DEFAULT;
+};
+
 class ESP32MailHTTPClient : public HTTPClient
 {
 public:
@@ -53,10 +67,11 @@ public:
     * \param port - Server's port.
     * \param uri - The URI of resource.
     * \param CAcert - The Base64 encode root certificate string
+    * \param CAcertLength - The length of DER encoded root certificates, 0 for the PEM string.
     * \return True as default.
     * If no certificate string provided, use (const char*)NULL to CAcert param 
     */
-  bool begin(const char *host, uint16_t port, const char *uri, const char *CAcert);
+  bool begin(const char *host, uint16_t port, const char *uri, const char *CAcert, size_t CAcertLength = 0);
 
   /**
     * Check the http connection status.
@@ -92,6 +107,142 @@ public:
   bool connect(bool starttls);
   void setDebugCallback(DebugMsgCallback cb);
 
+  /**
+    * Enable or disable the TLS session cache for the next begin.
+    * \param enable - Resume the cached session of the same host and port when possible.
+    */
+  void setSessionCache(bool enable);
+
+  /**
+    * Check whether the current TLS connection was established by resuming a cached session.
+    * \return True if the session was resumed.
+    */
+  bool sessionResumed();
+
+  /**
+    * Set the TLS maximum fragment length (RFC 6066) to request for the next begin.
+    * \param length - 512, 1024, 2048 or 4096 byte, 0 to disable.
+    * \return False if the length is not supported.
+    */
+  bool setMaxFragmentLength(uint16_t length);
+
+  /**
+    * Start the connection without waiting for the DNS lookup, TCP connect and TLS handshake.
+    * \param starttls - Upgrade the plain connection with STARTTLS before the handshake.
+    * \return 1 if connected, 0 if still in progress or -1 on error.
+    * Call connectPoll until it returns non zero.
+    */
+  int connectAsync(bool starttls);
+
+  /**
+    * Continue the connection started by connectAsync.
+    * \return 1 if connected, 0 if still in progress or -1 on error.
+    */
+  int connectPoll();
+
+  /**
+    * Set the function to call while the blocking connect waits for the server.
+    * \param cb - The callback function, NULL to disable.
+    */
+  void setIdleCallback(ConnectIdleCallback cb);
+
+  /**
+    * Set the protocol that negotiates STARTTLS for the next begin.
+    * \param protocol - SSL_STARTTLS_SMTP or SSL_STARTTLS_IMAP.
+    */
+  void setSTARTTLSProtocol(int protocol);
+
+  /**
+    * Get the capabilities the server advertised before the STARTTLS upgrade.
+    * \return The SSL_STARTTLS_CAP_xxx bits.
+    */
+  uint8_t starttlsCapabilities();
+
+  /**
+    * Read one byte of the server response.
+    * \return The byte or -1 if no data was received.
+    * The byte is taken from the decrypted record in place, the following calls do not touch the TLS layer.
+    */
+  int readByte();
+
+  /**
+    * Get the received response data to parse in place.
+    * \param data - Receive the pointer to the read-only data.
+    * \return The length, 0 if no data was received.
+    * The data stays valid until all of it was consumed and readByte, readable or receiveSpan requests the data after it.
+    */
+  int receiveSpan(const uint8_t *&data);
+
+  /**
+    * Mark the bytes of the span as consumed.
+    * \param len - The number of bytes from the beginning of the span.
+    */
+  void releaseSpan(size_t len);
+
+  /**
+    * Check for the server response data without reading it.
+    * \return Nonzero if the next readByte returns the data.
+    */
+  int readable();
+
+  /**
+    * Discard the buffered and received response data.
+    */
+  void discardReceived();
+
+  /**
+    * Take the idle pooled connection to the same server with the same credentials and TLS settings.
+    * \param protocol - SSL_STARTTLS_SMTP or SSL_STARTTLS_IMAP.
+    * \param starttls - The connection was upgraded with STARTTLS instead of implicit TLS.
+    * \param login - The login name.
+    * \param password - The login password.
+    * \param flags - Receive the protocol flags stored with the connection.
+    * \return True if the pooled connection is now used by this client.
+    * Call begin first, the caller should check the connection with the protocol NOOP.
+    */
+  bool acquirePooled(int protocol, bool starttls, const std::string &login, const std::string &password, uint8_t &flags);
+
+  /**
+    * Keep the current connection in the pool for the next client to the same server with the same credentials and TLS settings.
+    * \param protocol - SSL_STARTTLS_SMTP or SSL_STARTTLS_IMAP.
+    * \param starttls - The connection was upgraded with STARTTLS instead of implicit TLS.
+    * \param login - The login name.
+    * \param password - The login password.
+    * \param flags - The protocol flags to store with the connection.
+    * \return False if the pool is disabled or the connection was closed, the connection is not changed.
+    */
+  bool releaseToPool(int protocol, bool starttls, const std::string &login, const std::string &password, uint8_t flags);
+
+  /**
+    * Set the connection pool limits.
+    * \param maxSize - The maximum idle connections, 0 to disable the pool.
+    * \param idleTimeout - The time in milliseconds to keep the idle connection.
+    */
+  static void setPoolOptions(size_t maxSize, unsigned long idleTimeout);
+
+  /**
+    * Close all idle pooled connections.
+    */
+  static void clearPool();
+
+  /**
+    * Set the ciphersuite and curve profile for the next begin.
+    * \param profile - SSL_CIPHER_PROFILE_DEFAULT, SSL_CIPHER_PROFILE_ECDHE or SSL_CIPHER_PROFILE_ECDHE_ONLY.
+    */
+  void setCipherProfile(int profile);
+
+  /**
+    * Get the ciphersuite of the current TLS connection.
+    * \return The ciphersuite name or NULL if not connected.
+    */
+  const char *ciphersuite();
+
+  /**
+    * Get the duration of the last TLS handshake.
+    * \return The time in milliseconds.
+    */
+  unsigned long handshakeTime();
+
 protected:
   TransportTraitsPtr transportTraits;
   std::unique_ptr<WiFiClient> _client;
@@ -100,6 +251,18 @@ protected:
   std::string _host = "";
   std::string _uri = "";
   uint16_t _port = 0;
+  const char *_cacert = nullptr;
+  size_t _cacertLen = 0;
+  ESP32MailTLSOptions _tlsOptions;
+  uint8_t *_rxBuf = nullptr;
+  const uint8_t *_rxData = nullptr;
+  size_t _rxPos = 0;
+  size_t _rxLen = 0;
+  bool _rxSpan = false;
+
+  int fillReceived();
+  void releaseReceived();
+  void poolEntry(ESP32MailPoolEntry &entry, int protocol, bool starttls, const std::string &login, const std::string &password);
 };
 
 #endif //ESP32
@@ -49,6 +49,10 @@ struct ESP32_MailClient::IMAP_COMMAND_TYPE
   static const uint8_t FETCH_BODY_TEXT = 8;
   static const uint8_t FETCH_BODY_ATTACHMENT = 9;
   static const uint8_t LOGOUT = 10;
+  static const uint8_t CAPABILITY = 11;
+  static const uint8_t ENABLE = 12;
+  static const uint8_t FETCH_FLAGS = 13;
+  static const uint8_t ESEARCH = 15;
 };
 
 struct ESP32_MailClient::IMAP_HEADER_TYPE
@@ -87,6 +91,19 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
   int count = 0;
 
+  //The UID after the last fetched one when the new messages were more than the fetch limit
+  uint32_t resumeUID = 0;
+  bool recentSort = imapData._recentSort;
+
+  uint8_t poolFlags = 0;
+
+  //The new message UIDs were taken from the UIDNEXT range without search
+  bool uidRange = false;
+  uint32_t lastUID = 0;
+  uint32_t nextUID = 0;
+  uint32_t uidCount = 0;
+  bool noMessage = false;
+
   imapData._net->setDebugCallback(NULL);
 
   if (imapData._debug)
@@ -107,11 +124,34 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
   if (imapData._debug)
     imapData._net->setDebugCallback(ESP32MailDebug);
 
+  imapData._net->setSTARTTLSProtocol(SSL_STARTTLS_IMAP);
+
   if (imapData._rootCA.size() > 0)
-    imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)imapData._rootCA.front());
+    imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)imapData._rootCA.front(), imapData._rootCALength);
   else
     imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)NULL);
 
+  //reuse the logged in connection left by the previous readMail when it still answers
+  if (imapData._net->acquirePooled(SSL_STARTTLS_IMAP, starttls, imapData._loginEmail, imapData._loginPassword, poolFlags))
+  {
+    connected = true;
+    imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_325);
+    if (waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::LOGIN))
+    {
+      //the capabilities were checked on this connection, don't send CAPABILITY again
+      imapData.clearMessageData();
+      imapData._capabilityChecked = poolFlags & IMAP_CAP_CHECKED;
+      imapData._condstore = poolFlags & IMAP_CAP_CONDSTORE;
+      imapData._qresync = poolFlags & IMAP_CAP_QRESYNC;
+      imapData._esearch = poolFlags & IMAP_CAP_ESEARCH;
+      imapData._partialSearch = poolFlags & IMAP_CAP_PARTIAL;
+      imapData._contextSearch = poolFlags & IMAP_CAP_CONTEXT;
+      goto authenticated;
+    }
+    imapData._net->getStreamPtr()->stop();
+    connected = false;
+  }
+
   while (!imapData._net->connected() && count < 10)
   {
 
@@ -159,18 +199,24 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
   if (imapData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_228);
 
-  //Don't expect handshake from some servers
+  //Don't expect handshake from some servers, the greeting was already read before the STARTTLS upgrade
   dataTime = millis();
 
-  while (imapData._net->connected() && !imapData._net->getStreamPtr()->available() && millis() - 500 < dataTime)
+  while (!starttls && imapData._net->connected() && !imapData._net->getStreamPtr()->available() && millis() - 500 < dataTime)
     delay(0);
 
   if (imapData._net->connected() && imapData._net->getStreamPtr()->available())
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
+    imapData._net->discardReceived();
 
   imapData.clearMessageData();
 
+  imapData._capabilityChecked = false;
+  imapData._condstore = false;
+  imapData._qresync = false;
+  imapData._esearch = false;
+  imapData._partialSearch = false;
+  imapData._contextSearch = false;
+
   if (imapData._readCallback)
   {
     imapData._cbData._info = ESP32_MAIL_STR_56;
@@ -205,11 +251,47 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
     goto out;
   }
 
+authenticated:
+
   if (imapData._fetchUID.length() > 0)
     imapData._headerOnly = false;
   else
     imapData._headerOnly = true;
 
+  //The capabilities are required for incremental sync and ESEARCH, skip when it was already sent with LOGIN response
+  if (imapData._headerOnly && !imapData._capabilityChecked && (imapData._incrementalSync || (imapData._searchCriteria != "" && !(imapData._newMessageOnly && imapData._lastNextUID.length() > 0))))
+  {
+    if (imapData._debug)
+      ESP32MailDebugInfo(ESP32_MAIL_STR_277);
+
+    imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_264);
+    if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::CAPABILITY))
+    {
+      _imapStatus = IMAP_STATUS_BAD_COMMAND;
+      if (imapData._debug)
+      {
+        ESP32MailDebugError();
+        ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+      }
+    }
+  }
+
+  if (imapData._headerOnly && imapData._incrementalSync)
+  {
+    //VANISHED modifier of UID FETCH is only allowed after QRESYNC was enabled
+    if (imapData._qresync)
+    {
+      if (imapData._debug)
+        ESP32MailDebugInfo(ESP32_MAIL_STR_278);
+
+      imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_267);
+      if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::ENABLE))
+        imapData._qresync = false;
+    }
+
+    loadSyncState(imapData);
+  }
+
   if (imapData._headerOnly)
   {
     if (imapData._readCallback)
@@ -267,9 +349,16 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
   if (imapData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_231);
 
+  imapData._nextUID.clear();
+  imapData._uidValidity.clear();
+  imapData._highestModSeq.clear();
+
   imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_135);
   imapData._net->getStreamPtr()->print(imapData._currentFolder.c_str());
-  imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_136);
+  imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_136);
+  if (imapData._headerOnly && imapData._incrementalSync && imapData._condstore)
+    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_268);
+  imapData._net->getStreamPtr()->println();
   if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::EXAMINE))
   {
     _imapStatus = IMAP_STATUS_BAD_COMMAND;
@@ -331,19 +420,209 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
     }
   }
 
+  //The last UID is meaningless when the mailbox was recreated or renumbered
+  if (imapData._newMessageOnly && imapData._lastUIDValidity.length() > 0 && imapData._lastUIDValidity != imapData._uidValidity)
+  {
+    imapData._lastNextUID.clear();
+    imapData._lastUIDValidity.clear();
+  }
+
   imapData._msgNum.clear();
   imapData._uidSearch = false;
-  imapData._msgID.clear();
-  imapData._contentLanguage.clear();
-  imapData._acceptLanguage.clear();
-  imapData._attachmentCount.clear();
-  imapData._totalAttachFileSize.clear();
-  imapData._downloadedByte.clear();
-  imapData._error.clear();
-  imapData._errorMsg.clear();
+  imapData._message.clear();
+  imapData._headerArenaLength = 0;
   imapData._searchCount = 0;
 
-  if (imapData._headerOnly)
+  if (imapData._headerOnly && imapData._incrementalSync)
+  {
+    imapData._syncReset = imapData._nextUID.length() == 0 || imapData._syncNextUID.length() == 0 || imapData._syncFolder != imapData._currentFolder || imapData._syncUIDValidity != imapData._uidValidity;
+
+    if (imapData._syncReset && imapData._readCallback)
+    {
+      imapData._cbData._info = ESP32_MAIL_STR_284;
+      imapData._cbData._status = "";
+      imapData._cbData._success = false;
+      imapData._readCallback(imapData._cbData);
+    }
+  }
+
+  if (imapData._headerOnly && imapData._incrementalSync && !imapData._syncReset)
+  {
+    if (imapData._debug)
+      ESP32MailDebugInfo(ESP32_MAIL_STR_279);
+
+    imapData._uidSearch = true;
+
+    //Search only the UIDs which assigned after last sync, skip when UIDNEXT was not changed
+    if (strtoul(imapData._nextUID.c_str(), NULL, 10) > strtoul(imapData._syncNextUID.c_str(), NULL, 10))
+    {
+      command = ESP32_MAIL_STR_276;
+      command += imapData._syncNextUID;
+      command += ESP32_MAIL_STR_262;
+      command += ESP32_MAIL_STR_183;
+
+      imapData._net->getStreamPtr()->println(command.c_str());
+
+      std::string().swap(command);
+
+      //Keep the oldest new messages within the limit, the sync state can only advance past the contiguous fetched UIDs
+      imapData._recentSort = false;
+      res = waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::SEARCH, 1);
+      imapData._recentSort = recentSort;
+
+      if (!res)
+      {
+        _imapStatus = IMAP_STATUS_BAD_COMMAND;
+        if (imapData._readCallback)
+        {
+          imapData._cbData._info = ESP32_MAIL_STR_53 + imapErrorReasonStr();
+          imapData._cbData._status = ESP32_MAIL_STR_52;
+          imapData._cbData._success = false;
+          imapData._readCallback(imapData._cbData);
+        }
+        if (imapData._debug)
+        {
+          ESP32MailDebugError();
+          ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+        }
+        goto out;
+      }
+
+      //UID range n:* always includes the last message even its UID is less than n
+      for (int i = imapData._msgNum.size() - 1; i >= 0; i--)
+      {
+        if (imapData._msgNum[i] < strtoul(imapData._syncNextUID.c_str(), NULL, 10))
+        {
+          imapData._msgNum.erase(imapData._msgNum.begin() + i);
+          imapData._searchCount--;
+        }
+      }
+
+      if (imapData._searchCount > imapData._msgNum.size() && imapData._msgNum.size() > 0)
+        resumeUID = *std::max_element(imapData._msgNum.begin(), imapData._msgNum.end()) + 1;
+
+      if (imapData._recentSort)
+        std::sort(imapData._msgNum.begin(), imapData._msgNum.end(), compFunc);
+    }
+
+    if (imapData._condstore && imapData._syncModSeq.length() > 0 && imapData._highestModSeq.length() > 0 && imapData._syncModSeq != imapData._highestModSeq && strtoul(imapData._syncNextUID.c_str(), NULL, 10) > 1)
+    {
+      if (imapData._debug)
+        ESP32MailDebugInfo(ESP32_MAIL_STR_280);
+
+      //All messages known from the last sync, 1:n-1
+      command = ESP32_MAIL_STR_142;
+      command += ESP32_MAIL_STR_297;
+      memset(_val, 0, bufSize);
+      ultoa(strtoul(imapData._syncNextUID.c_str(), NULL, 10) - 1, _val, 10);
+      command += _val;
+      command += ESP32_MAIL_STR_271;
+      command += imapData._syncModSeq;
+      if (imapData._qresync)
+        command += ESP32_MAIL_STR_272;
+      command += ESP32_MAIL_STR_192;
+
+      imapData._net->getStreamPtr()->println(command.c_str());
+
+      std::string().swap(command);
+
+      if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::FETCH_FLAGS))
+      {
+        _imapStatus = IMAP_STATUS_BAD_COMMAND;
+        if (imapData._readCallback)
+        {
+          imapData._cbData._info = ESP32_MAIL_STR_53 + imapErrorReasonStr();
+          imapData._cbData._status = ESP32_MAIL_STR_52;
+          imapData._cbData._success = false;
+          imapData._readCallback(imapData._cbData);
+        }
+        if (imapData._debug)
+        {
+          ESP32MailDebugError();
+          ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+        }
+        goto out;
+      }
+    }
+
+    if (imapData._readCallback)
+    {
+      imapData._cbData._info = ESP32_MAIL_STR_281;
+      memset(_val, 0, bufSize);
+      itoa(imapData._msgNum.size(), _val, 10);
+      imapData._cbData._info += _val;
+      imapData._cbData._status = "";
+      imapData._cbData._success = false;
+      imapData._readCallback(imapData._cbData);
+
+      imapData._cbData._info = ESP32_MAIL_STR_282;
+      memset(_val, 0, bufSize);
+      itoa(imapData._changedUID.size(), _val, 10);
+      imapData._cbData._info += _val;
+      imapData._readCallback(imapData._cbData);
+
+      imapData._cbData._info = ESP32_MAIL_STR_283;
+      memset(_val, 0, bufSize);
+      itoa(imapData._vanishedUID.size(), _val, 10);
+      imapData._cbData._info += _val;
+      imapData._readCallback(imapData._cbData);
+    }
+  }
+  else if (imapData._headerOnly && imapData._newMessageOnly && imapData._nextUID.length() > 0 && imapData._lastNextUID.length() > 0)
+  {
+    imapData._uidSearch = true;
+
+    lastUID = strtoul(imapData._lastNextUID.c_str(), NULL, 10);
+    nextUID = strtoul(imapData._nextUID.c_str(), NULL, 10);
+
+    if (nextUID <= lastUID)
+    {
+      if (imapData._readCallback)
+      {
+        imapData._cbData._info = ESP32_MAIL_STR_287 + imapData._lastNextUID;
+        imapData._cbData._status = "";
+        imapData._cbData._success = false;
+        imapData._readCallback(imapData._cbData);
+      }
+    }
+    else
+    {
+      //The new messages are in the UID range from the last UIDNEXT up to the current UIDNEXT - 1,
+      //the expunged UIDs in this range are skipped when their header fetch returns no message.
+      imapData._searchCount = nextUID - lastUID;
+
+      //Fetch the oldest new messages within the limit, the rest will be fetched in the next readMail
+      uidCount = imapData._searchCount;
+      if (uidCount > imapData._emailNumMax)
+        uidCount = imapData._emailNumMax;
+      if (uidCount > MAX_EMAIL_SEARCH_LIMIT)
+        uidCount = MAX_EMAIL_SEARCH_LIMIT;
+
+      imapData._msgNum.reserve(uidCount);
+      for (uint32_t uid = lastUID; uid < lastUID + uidCount; uid++)
+        imapData._msgNum.push_back(uid);
+
+      if (uidCount < imapData._searchCount)
+        resumeUID = lastUID + uidCount;
+
+      uidRange = true;
+
+      if (imapData._recentSort)
+        std::sort(imapData._msgNum.begin(), imapData._msgNum.end(), compFunc);
+
+      if (imapData._readCallback)
+      {
+        imapData._cbData._info = ESP32_MAIL_STR_288 + imapData._lastNextUID + ESP32_MAIL_STR_131;
+        memset(_val, 0, bufSize);
+        itoa(imapData._searchCount, _val, 10);
+        imapData._cbData._info += _val;
+        imapData._cbData._status = "";
+        imapData._cbData._success = false;
+        imapData._readCallback(imapData._cbData);
+      }
+    }
+  }
+  else if (imapData._headerOnly)
   {
 
     if (imapData._searchCriteria != "")
@@ -358,6 +637,32 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
       }
       command += ESP32_MAIL_STR_139;
 
+      //Let the server return only the count and the ids within search limit (RFC 4731, RFC 5267 and RFC 9394)
+      if (imapData._esearch && imapData._emailNumMax > 0)
+      {
+        if (imapData._emailNumMax == 1)
+        {
+          if (imapData._recentSort)
+            command += ESP32_MAIL_STR_293;
+          else
+            command += ESP32_MAIL_STR_294;
+        }
+        else if (imapData._partialSearch || (imapData._contextSearch && !imapData._recentSort))
+        {
+          command += ESP32_MAIL_STR_295;
+          if (imapData._recentSort)
+            command += ESP32_MAIL_STR_296;
+          else
+            command += ESP32_MAIL_STR_297;
+          memset(_val, 0, bufSize);
+          itoa(imapData._emailNumMax, _val, 10);
+          command += _val;
+          command += ESP32_MAIL_STR_192;
+        }
+        else
+          command += ESP32_MAIL_STR_292;
+      }
+
       for (size_t i = 0; i < imapData._searchCriteria.length(); i++)
       {
         if (imapData._searchCriteria[i] != ' ' && imapData._searchCriteria[i] != '\r' && imapData._searchCriteria[i] != '\n' && imapData._searchCriteria[i] != '$')
@@ -391,7 +696,11 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
       std::string().swap(command);
 
-      if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::SEARCH, 1))
+      uint8_t searchType = IMAP_COMMAND_TYPE::SEARCH;
+      if (imapData._esearch && imapData._emailNumMax > 0)
+        searchType = IMAP_COMMAND_TYPE::ESEARCH;
+
+      if (!waitIMAPResponse(imapData, searchType, 1))
       {
         _imapStatus = IMAP_STATUS_BAD_COMMAND;
         if (imapData._readCallback)
@@ -469,10 +778,8 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
     imapData._msgNum.push_back(atoi(imapData._fetchUID.c_str()));
   }
 
-  for (int i = 0; i < imapData._messageDataInfo.size(); i++)
-    imapData._messageDataInfo[i].clear();
-
-  imapData._messageDataInfo.clear();
+  imapData._message.clear();
+  imapData._message.reserve(imapData._msgNum.size());
 
   for (int i = 0; i < imapData._msgNum.size(); i++)
   {
@@ -502,30 +809,7 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
       imapData._readCallback(imapData._cbData);
     }
 
-    imapData._date.push_back(std::string());
-    imapData._subject.push_back(std::string());
-    imapData._subject_charset.push_back(std::string());
-    imapData._from.push_back(std::string());
-    imapData._from_charset.push_back(std::string());
-    imapData._to.push_back(std::string());
-    imapData._to_charset.push_back(std::string());
-    imapData._cc.push_back(std::string());
-    imapData._attachmentCount.push_back(0);
-    imapData._totalAttachFileSize.push_back(0);
-    imapData._downloadedByte.push_back(0);
-    imapData._messageDataCount.push_back(0);
-    imapData._error.push_back(false);
-    imapData._errorMsg.push_back(std::string());
-    imapData._cc_charset.push_back(std::string());
-    imapData._msgID.push_back(std::string());
-    imapData._acceptLanguage.push_back(std::string());
-    imapData._contentLanguage.push_back(std::string());
-
-    std::vector<messageBodyData> d = std::vector<messageBodyData>();
-
-    imapData._messageDataInfo.push_back(d);
-
-    std::vector<messageBodyData>().swap(d);
+    imapData._message.push_back(messageRecord());
 
     if (imapData._uidSearch || imapData._fetchUID.length() > 0)
       imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_142);
@@ -557,6 +841,28 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
       goto out;
     }
 
+    if (uidRange)
+    {
+      //The expunged UID has no FETCH response, only the tagged OK
+      noMessage = true;
+      for (int j = 0; j < MAX_HEADER_FIELD; j++)
+      {
+        if (imapData._message[mailIndex]._header[j].length > 0)
+        {
+          noMessage = false;
+          break;
+        }
+      }
+
+      if (noMessage)
+      {
+        imapData._message.pop_back();
+        imapData._msgNum.erase(imapData._msgNum.begin() + i);
+        i--;
+        continue;
+      }
+    }
+
     if (!imapData._headerOnly)
     {
 
@@ -587,18 +893,18 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
         if (res)
         {
 
-          if (imapData._messageDataInfo[mailIndex].size() < messageDataIndex + 1)
+          if (imapData._message[mailIndex]._messageDataInfo.size() < messageDataIndex + 1)
           {
             messageBodyData b;
-            imapData._messageDataInfo[mailIndex].push_back(b);
+            imapData._message[mailIndex]._messageDataInfo.push_back(b);
             b.empty();
-            imapData._messageDataCount[mailIndex] = imapData._messageDataInfo[mailIndex].size();
+            imapData._message[mailIndex]._messageDataCount = imapData._message[mailIndex]._messageDataInfo.size();
           }
 
-          if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == "")
+          if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == "")
             continue;
 
-          if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType.find(ESP32_MAIL_STR_149) != std::string::npos)
+          if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType.find(ESP32_MAIL_STR_149) != std::string::npos)
           {
             do
             {
@@ -642,7 +948,7 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
       } while (res);
 
-      if (imapData._saveHTMLMsg || imapData._saveTextMsg || imapData._downloadAttachment)
+      if (imapData._saveHTMLMsg || imapData._saveTextMsg || (imapData._downloadAttachment && !attachmentSinkSet(imapData)))
       {
 
         if (!_sdOk)
@@ -659,27 +965,27 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
         }
       }
 
-      if (imapData._messageDataInfo[mailIndex].size() > 0)
+      if (imapData._message[mailIndex]._messageDataInfo.size() > 0)
       {
-        if (imapData._attachmentCount[mailIndex] > 0 && imapData._readCallback)
+        if (imapData._message[mailIndex]._attachmentCount > 0 && imapData._readCallback)
         {
           imapData._cbData._info = ESP32_MAIL_STR_78;
           memset(_val, 0, bufSize);
-          itoa(imapData._attachmentCount[mailIndex], _val, 10);
+          itoa(imapData._message[mailIndex]._attachmentCount, _val, 10);
           imapData._cbData._info += _val;
           imapData._cbData._info += ESP32_MAIL_STR_79;
           imapData._cbData._status = "";
           imapData._cbData._success = false;
           imapData._readCallback(imapData._cbData);
 
-          for (int j = 0; j < imapData._messageDataInfo[mailIndex].size(); j++)
+          for (int j = 0; j < imapData._message[mailIndex]._messageDataInfo.size(); j++)
           {
-            if (imapData._messageDataInfo[mailIndex][j]._disposition == ESP32_MAIL_STR_153)
+            if (imapData._message[mailIndex]._messageDataInfo[j]._disposition == ESP32_MAIL_STR_153)
             {
-              imapData._cbData._info = imapData._messageDataInfo[mailIndex][j]._filename;
+              imapData._cbData._info = imapData._message[mailIndex]._messageDataInfo[j]._filename;
               imapData._cbData._info += ESP32_MAIL_STR_83;
               memset(_val, 0, bufSize);
-              itoa(imapData._messageDataInfo[mailIndex][j]._size, _val, 10);
+              itoa(imapData._message[mailIndex]._messageDataInfo[j]._size, _val, 10);
               imapData._cbData._info += _val;
               imapData._cbData._info += ESP32_MAIL_STR_82;
               imapData._cbData._status = "";
@@ -688,7 +994,7 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
             }
           }
 
-          if (imapData._downloadAttachment && _sdOk)
+          if (imapData._downloadAttachment && (_sdOk || attachmentSinkSet(imapData)))
           {
             imapData._cbData._info = ESP32_MAIL_STR_80;
             imapData._cbData._status = ESP32_MAIL_STR_81;
@@ -697,16 +1003,16 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
           }
         }
 
-        for (int j = 0; j < imapData._messageDataInfo[mailIndex].size(); j++)
+        for (int j = 0; j < imapData._message[mailIndex]._messageDataInfo.size(); j++)
         {
 
-          if (imapData._messageDataInfo[mailIndex][j]._disposition == "")
+          if (imapData._message[mailIndex]._messageDataInfo[j]._disposition == "")
           {
 
-            if (!imapData._textFormat && imapData._messageDataInfo[mailIndex][j]._contentType != ESP32_MAIL_STR_154)
+            if (!imapData._textFormat && imapData._message[mailIndex]._messageDataInfo[j]._contentType != ESP32_MAIL_STR_154)
               continue;
 
-            if (!imapData._htmlFormat && imapData._messageDataInfo[mailIndex][j]._contentType != ESP32_MAIL_STR_155)
+            if (!imapData._htmlFormat && imapData._message[mailIndex]._messageDataInfo[j]._contentType != ESP32_MAIL_STR_155)
               continue;
 
             if (imapData._uidSearch || imapData._fetchUID.length() > 0)
@@ -716,8 +1022,29 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
             imapData._net->getStreamPtr()->print(imapData._msgNum[i]);
             imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_147);
-            imapData._net->getStreamPtr()->print(imapData._messageDataInfo[mailIndex][j]._part.c_str());
-            imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_156);
+            imapData._net->getStreamPtr()->print(imapData._message[mailIndex]._messageDataInfo[j]._part.c_str());
+
+            if (!imapData._saveHTMLMsg && !imapData._saveTextMsg)
+            {
+              //Fetch only the partial data that fits the message buffer instead of the whole body part
+              size_t offset = imapData._messageOffset;
+              size_t length = imapData._messageLength;
+
+              if (length == 0)
+              {
+                offset = 0;
+                length = imapData._message_buffer_size;
+              }
+
+              imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_304);
+              imapData._net->getStreamPtr()->print(offset);
+              imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_152);
+              imapData._net->getStreamPtr()->print(length);
+              imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_15);
+            }
+            else
+              imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_156);
+
             if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::FETCH_BODY_TEXT, imapData._message_buffer_size, mailIndex, j))
             {
               _imapStatus = IMAP_STATUS_IMAP_RESPONSE_FAILED;
@@ -735,20 +1062,38 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
               }
             }
           }
-          else if (imapData._messageDataInfo[mailIndex][j]._disposition == ESP32_MAIL_STR_153 && _sdOk)
+          else if (imapData._message[mailIndex]._messageDataInfo[j]._disposition == ESP32_MAIL_STR_153 && (_sdOk || attachmentSinkSet(imapData)))
           {
 
             if (imapData._downloadAttachment)
             {
-              if (imapData._messageDataInfo[mailIndex][j]._size <= imapData._attacement_max_size)
+              if (imapData._message[mailIndex]._messageDataInfo[j]._size <= imapData._attacement_max_size)
               {
 
-                if (_sdOk)
+                if (_sdOk || attachmentSinkSet(imapData))
                 {
 
-                  if (j < imapData._messageDataInfo[mailIndex].size() - 1)
-                    if (imapData._messageDataInfo[mailIndex][j + 1]._size > imapData._attacement_max_size)
-                      imapData._downloadedByte[mailIndex] += imapData._messageDataInfo[mailIndex][j + 1]._size;
+                  if (j < imapData._message[mailIndex]._messageDataInfo.size() - 1)
+                    if (imapData._message[mailIndex]._messageDataInfo[j + 1]._size > imapData._attacement_max_size)
+                      imapData._message[mailIndex]._downloadedByte += imapData._message[mailIndex]._messageDataInfo[j + 1]._size;
+
+                  imapData._message[mailIndex]._messageDataInfo[j]._resumeOffset = 0;
+                  imapData._message[mailIndex]._messageDataInfo[j]._resumeSize = 0;
+                  imapData._message[mailIndex]._messageDataInfo[j]._encodedSize = 0;
+
+                  if (imapData._resumeDownload && !attachmentSinkSet(imapData) && (imapData._uidSearch || imapData._fetchUID.length() > 0))
+                  {
+                    if (loadDownloadCheckpoint(imapData, mailIndex, j) && imapData._readCallback)
+                    {
+                      imapData._cbData._info = ESP32_MAIL_STR_308 + imapData._message[mailIndex]._messageDataInfo[j]._filename + ESP32_MAIL_STR_309;
+                      memset(_val, 0, bufSize);
+                      itoa(imapData._message[mailIndex]._messageDataInfo[j]._resumeSize, _val, 10);
+                      imapData._cbData._info += _val;
+                      imapData._cbData._status = "";
+                      imapData._cbData._success = false;
+                      imapData._readCallback(imapData._cbData);
+                    }
+                  }
 
                   if (imapData._uidSearch || imapData._fetchUID.length() > 0)
                     imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_142);
@@ -757,11 +1102,26 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
                   imapData._net->getStreamPtr()->print(imapData._msgNum[i]);
                   imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_147);
-                  imapData._net->getStreamPtr()->print(imapData._messageDataInfo[mailIndex][j]._part.c_str());
-                  imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_156);
+                  imapData._net->getStreamPtr()->print(imapData._message[mailIndex]._messageDataInfo[j]._part.c_str());
+
+                  //Fetch the remaining data from the last checkpoint which is at the encoded line boundary (base64 quantum aligned)
+                  if (imapData._message[mailIndex]._messageDataInfo[j]._resumeOffset > 0)
+                  {
+                    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_304);
+                    imapData._net->getStreamPtr()->print(imapData._message[mailIndex]._messageDataInfo[j]._resumeOffset);
+                    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_152);
+                    imapData._net->getStreamPtr()->print(imapData._message[mailIndex]._messageDataInfo[j]._encodedSize - imapData._message[mailIndex]._messageDataInfo[j]._resumeOffset);
+                    imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_15);
+                  }
+                  else
+                    imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_156);
+
                   if (!waitIMAPResponse(imapData, IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT, imapData._message_buffer_size, mailIndex, j))
                   {
-                    _imapStatus = IMAP_STATUS_IMAP_RESPONSE_FAILED;
+                    if (imapData._attachmentAbort)
+                      _imapStatus = IMAP_STATUS_ATTACHMENT_WRITE_FAILED;
+                    else
+                      _imapStatus = IMAP_STATUS_IMAP_RESPONSE_FAILED;
                     if (imapData._readCallback)
                     {
                       imapData._cbData._info = ESP32_MAIL_STR_53 + imapErrorReasonStr();
@@ -774,6 +1134,10 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
                       ESP32MailDebugError();
                       ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
                     }
+
+                    //The connection was closed to stop the transfer
+                    if (imapData._attachmentAbort)
+                      goto out;
                   }
 
                   delay(0);
@@ -781,8 +1145,8 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
               }
               else
               {
-                if (j == imapData._messageDataInfo[mailIndex].size() - 1)
-                  imapData._downloadedByte[mailIndex] += imapData._messageDataInfo[mailIndex][j]._size;
+                if (j == imapData._message[mailIndex]._messageDataInfo.size() - 1)
+                  imapData._message[mailIndex]._downloadedByte += imapData._message[mailIndex]._messageDataInfo[j]._size;
               }
             }
           }
@@ -817,59 +1181,96 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
     mailIndex++;
   }
 
-  if (imapData._readCallback)
+  if (imapData._headerOnly && imapData._nextUID.length() > 0)
   {
-    imapData._cbData._info = ESP32_MAIL_STR_85;
-    imapData._cbData._status = ESP32_MAIL_STR_86;
-    imapData._cbData._success = false;
-    imapData._readCallback(imapData._cbData);
-  }
-
-  if (imapData._debug)
-    ESP32MailDebugInfo(ESP32_MAIL_STR_234);
-
-  if (imapData._net->connected())
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
-
-  imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_146);
+    imapData._lastNextUID = imapData._nextUID;
+    imapData._lastUIDValidity = imapData._uidValidity;
 
-  if (!waitIMAPResponse(imapData, 0))
-  {
-    _imapStatus = IMAP_STATUS_BAD_COMMAND;
-    if (imapData._readCallback)
+    if (resumeUID > 0)
     {
-      imapData._cbData._info = ESP32_MAIL_STR_53 + imapErrorReasonStr();
-      imapData._cbData._status = ESP32_MAIL_STR_52;
-      imapData._cbData._success = false;
-      imapData._readCallback(imapData._cbData);
+      memset(_val, 0, bufSize);
+      ultoa(resumeUID, _val, 10);
+      imapData._lastNextUID = _val;
     }
-    if (imapData._debug)
+  }
+
+  if (imapData._headerOnly && imapData._incrementalSync && imapData._nextUID.length() > 0)
+  {
+    imapData._syncFolder = imapData._currentFolder;
+    imapData._syncUIDValidity = imapData._uidValidity;
+    imapData._syncNextUID = imapData._nextUID;
+
+    //The remaining new messages will be fetched in the next sync, the changes of the fetched range were already reported
+    if (resumeUID > 0)
     {
-      ESP32MailDebugError();
-      ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+      memset(_val, 0, bufSize);
+      ultoa(resumeUID, _val, 10);
+      imapData._syncNextUID = _val;
     }
-    goto out;
+    else
+      imapData._syncModSeq = imapData._highestModSeq;
+
+    saveSyncState(imapData);
   }
 
   if (imapData._readCallback)
   {
-    imapData._cbData._info = ESP32_MAIL_STR_98;
-    imapData._cbData._status = ESP32_MAIL_STR_96;
-    imapData._cbData._success = true;
+    imapData._cbData._info = ESP32_MAIL_STR_85;
+    imapData._cbData._status = ESP32_MAIL_STR_86;
+    imapData._cbData._success = false;
     imapData._readCallback(imapData._cbData);
   }
 
   if (imapData._debug)
-    ESP32MailDebugInfo(ESP32_MAIL_STR_235);
+    ESP32MailDebugInfo(ESP32_MAIL_STR_234);
 
   if (imapData._net->connected())
-  {
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
+    imapData._net->discardReceived();
 
-    imapData._net->getStreamPtr()->stop();
-  }
+  poolFlags = (imapData._capabilityChecked ? IMAP_CAP_CHECKED : 0) | (imapData._condstore ? IMAP_CAP_CONDSTORE : 0) | (imapData._qresync ? IMAP_CAP_QRESYNC : 0) |
+              (imapData._esearch ? IMAP_CAP_ESEARCH : 0) | (imapData._partialSearch ? IMAP_CAP_PARTIAL : 0) | (imapData._contextSearch ? IMAP_CAP_CONTEXT : 0);
+
+  //keep the logged in connection for the next readMail instead of LOGOUT
+  if (!imapData._net->releaseToPool(SSL_STARTTLS_IMAP, starttls, imapData._loginEmail, imapData._loginPassword, poolFlags))
+  {
+    imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_146);
+
+    if (!waitIMAPResponse(imapData, 0))
+    {
+      _imapStatus = IMAP_STATUS_BAD_COMMAND;
+      if (imapData._readCallback)
+      {
+        imapData._cbData._info = ESP32_MAIL_STR_53 + imapErrorReasonStr();
+        imapData._cbData._status = ESP32_MAIL_STR_52;
+        imapData._cbData._success = false;
+        imapData._readCallback(imapData._cbData);
+      }
+      if (imapData._debug)
+      {
+        ESP32MailDebugError();
+        ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+      }
+      goto out;
+    }
+  }
+
+  if (imapData._readCallback)
+  {
+    imapData._cbData._info = ESP32_MAIL_STR_98;
+    imapData._cbData._status = ESP32_MAIL_STR_96;
+    imapData._cbData._success = true;
+    imapData._readCallback(imapData._cbData);
+  }
+
+  if (imapData._debug)
+    ESP32MailDebugInfo(ESP32_MAIL_STR_235);
+
+  if (imapData._net->connected())
+  {
+    imapData._net->discardReceived();
+
+    imapData._net->getStreamPtr()->stop();
+  }
 
   imapData._cbData.empty();
   delete[] _val;
@@ -881,12 +1282,15 @@ bool ESP32_MailClient::readMail(IMAPData &imapData)
 
 out:
 
+  //The UIDs which were not fetched have no message record
+  if (imapData._msgNum.size() > imapData._message.size())
+    imapData._msgNum.resize(imapData._message.size());
+
   if (connected)
   {
     if (imapData._net->connected())
     {
-      while (imapData._net->getStreamPtr()->available())
-        imapData._net->getStreamPtr()->read();
+      imapData._net->discardReceived();
       imapData._net->getStreamPtr()->stop();
     }
   }
@@ -902,20 +1306,653 @@ out:
 
 bool ESP32_MailClient::setFlag(IMAPData &imapData, int msgUID, const String &flag)
 {
-  return _setFlag(imapData, msgUID, flag, 0);
+  return _setFlag(imapData, String(msgUID).c_str(), flag, 0, false);
 }
 
 bool ESP32_MailClient::addFlag(IMAPData &imapData, int msgUID, const String &flag)
 {
-  return _setFlag(imapData, msgUID, flag, 1);
+  return _setFlag(imapData, String(msgUID).c_str(), flag, 1, false);
 }
 
 bool ESP32_MailClient::removeFlag(IMAPData &imapData, int msgUID, const String &flag)
 {
-  return _setFlag(imapData, msgUID, flag, 2);
+  return _setFlag(imapData, String(msgUID).c_str(), flag, 2, false);
+}
+
+bool ESP32_MailClient::setFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flag)
+{
+  return _setFlag(imapData, getUIDSequenceSet(msgUIDs), flag, 0, true);
+}
+
+bool ESP32_MailClient::addFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flag)
+{
+  return _setFlag(imapData, getUIDSequenceSet(msgUIDs), flag, 1, true);
+}
+
+bool ESP32_MailClient::removeFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flag)
+{
+  return _setFlag(imapData, getUIDSequenceSet(msgUIDs), flag, 2, true);
+}
+
+bool ESP32_MailClient::setFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flag)
+{
+  return _setFlag(imapData, getUIDRange(fromUID, toUID), flag, 0, true);
+}
+
+bool ESP32_MailClient::addFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flag)
+{
+  return _setFlag(imapData, getUIDRange(fromUID, toUID), flag, 1, true);
+}
+
+bool ESP32_MailClient::removeFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flag)
+{
+  return _setFlag(imapData, getUIDRange(fromUID, toUID), flag, 2, true);
+}
+
+std::string ESP32_MailClient::getUIDSequenceSet(const std::vector<uint32_t> &uids)
+{
+  std::string set = "";
+
+  if (uids.size() == 0)
+    return set;
+
+  //Sort ascending and compress the consecutive UIDs into ranges e.g. 1:50,72,90:95
+  std::vector<uint32_t> sorted = uids;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  int bufSize = 20;
+  char *_val = new char[bufSize];
+
+  size_t start = 0;
+  for (size_t i = 1; i <= sorted.size(); i++)
+  {
+    if (i < sorted.size() && sorted[i] == sorted[i - 1] + 1)
+      continue;
+
+    if (set.length() > 0)
+      set += ESP32_MAIL_STR_263;
+
+    memset(_val, 0, bufSize);
+    ultoa(sorted[start], _val, 10);
+    set += _val;
+
+    if (i - 1 > start)
+    {
+      memset(_val, 0, bufSize);
+      ultoa(sorted[i - 1], _val, 10);
+      set += ESP32_MAIL_STR_262;
+      set += _val;
+    }
+
+    start = i;
+  }
+
+  delete[] _val;
+  std::vector<uint32_t>().swap(sorted);
+
+  return set;
+}
+
+std::string ESP32_MailClient::getUIDRange(uint32_t fromUID, uint32_t toUID)
+{
+  std::string set = "";
+
+  if (fromUID == 0)
+    return set;
+
+  int bufSize = 20;
+  char *_val = new char[bufSize];
+
+  memset(_val, 0, bufSize);
+  ultoa(fromUID, _val, 10);
+  set += _val;
+  set += ESP32_MAIL_STR_262;
+
+  if (toUID == 0)
+    set += ESP32_MAIL_STR_183;
+  else
+  {
+    memset(_val, 0, bufSize);
+    ultoa(toUID, _val, 10);
+    set += _val;
+  }
+
+  delete[] _val;
+
+  return set;
+}
+
+void ESP32_MailClient::parseUIDSet(const std::string &uidSet, std::vector<uint32_t> &uids)
+{
+  size_t p1 = 0;
+  size_t p2 = 0;
+  size_t p3 = 0;
+  uint32_t first = 0;
+  uint32_t last = 0;
+
+  while (p1 < uidSet.length() && uids.size() < MAX_EMAIL_SEARCH_LIMIT)
+  {
+    p2 = uidSet.find(ESP32_MAIL_STR_263, p1);
+    if (p2 == std::string::npos)
+      p2 = uidSet.length();
+
+    p3 = uidSet.find(ESP32_MAIL_STR_262, p1);
+
+    first = strtoul(uidSet.c_str() + p1, NULL, 10);
+    if (p3 != std::string::npos && p3 < p2)
+      last = strtoul(uidSet.c_str() + p3 + 1, NULL, 10);
+    else
+      last = first;
+
+    if (last < first)
+      std::swap(first, last);
+
+    for (uint32_t uid = first; uid <= last && uid > 0 && uids.size() < MAX_EMAIL_SEARCH_LIMIT; uid++)
+      uids.push_back(uid);
+
+    p1 = p2 + 1;
+  }
+}
+
+void ESP32_MailClient::parseSearchSet(IMAPData &imapData, const std::string &set)
+{
+  std::vector<std::string> ranges = std::vector<std::string>();
+  size_t p1 = 0;
+  size_t p2 = 0;
+  uint32_t first = 0;
+  uint32_t last = 0;
+
+  while (p1 < set.length())
+  {
+    p2 = set.find(ESP32_MAIL_STR_263, p1);
+    if (p2 == std::string::npos)
+      p2 = set.length();
+    ranges.push_back(set.substr(p1, p2 - p1));
+    p1 = p2 + 1;
+  }
+
+  //Walk the ranges from the end for recent sort to keep only the last ids within search limit
+  for (size_t i = 0; i < ranges.size() && imapData._msgNum.size() < imapData._emailNumMax; i++)
+  {
+    std::string &range = imapData._recentSort ? ranges[ranges.size() - 1 - i] : ranges[i];
+
+    first = strtoul(range.c_str(), NULL, 10);
+    p1 = range.find(ESP32_MAIL_STR_262);
+    if (p1 != std::string::npos)
+      last = strtoul(range.c_str() + p1 + 1, NULL, 10);
+    else
+      last = first;
+
+    if (last < first)
+      std::swap(first, last);
+
+    if (imapData._recentSort)
+    {
+      for (uint32_t n = last; n >= first && n > 0 && imapData._msgNum.size() < imapData._emailNumMax; n--)
+        imapData._msgNum.push_back(n);
+    }
+    else
+    {
+      for (uint32_t n = first; n <= last && n > 0 && imapData._msgNum.size() < imapData._emailNumMax; n++)
+        imapData._msgNum.push_back(n);
+    }
+  }
+
+  std::vector<std::string>().swap(ranges);
+}
+
+bool ESP32_MailClient::syncStorageBegin(IMAPData &imapData, bool &mounted)
+{
+  mounted = false;
+
+  if (imapData._syncFile.length() == 0)
+    return false;
+
+  //the storage mounted by readMail or sendMail stays mounted for them
+  mounted = !_sdOk;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    return sdTest();
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    return SPIFFS.begin(true);
+
+  return false;
+}
+
+void ESP32_MailClient::syncStorageEnd(IMAPData &imapData, bool mounted)
+{
+  if (!mounted)
+    return;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    SD.end();
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    SPIFFS.end();
+}
+
+bool ESP32_MailClient::loadSyncState(IMAPData &imapData)
+{
+  std::string line = "";
+  int index = 0;
+  bool mounted = false;
+  File file;
+
+  imapData._syncFolder.clear();
+  imapData._syncUIDValidity.clear();
+  imapData._syncNextUID.clear();
+  imapData._syncModSeq.clear();
+
+  if (!syncStorageBegin(imapData, mounted))
+    return false;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    file = SD.open(imapData._syncFile.c_str(), FILE_READ);
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    file = SPIFFS.open(imapData._syncFile.c_str(), FILE_READ);
+
+  if (!file)
+  {
+    syncStorageEnd(imapData, mounted);
+    return false;
+  }
+
+  //The state file contains folder, UIDVALIDITY, UIDNEXT and HIGHESTMODSEQ, one value per line
+  while (file.available())
+  {
+    int r = file.read();
+    if (r < 0)
+      break;
+
+    if (r == '\n')
+    {
+      if (index == 0)
+        imapData._syncFolder = line;
+      else if (index == 1)
+        imapData._syncUIDValidity = line;
+      else if (index == 2)
+        imapData._syncNextUID = line;
+      else if (index == 3)
+        imapData._syncModSeq = line;
+      index++;
+      line.clear();
+    }
+    else if (r != '\r')
+      line.append(1, (char)r);
+  }
+
+  file.close();
+  syncStorageEnd(imapData, mounted);
+  std::string().swap(line);
+
+  return index >= 3;
+}
+
+bool ESP32_MailClient::saveSyncState(IMAPData &imapData)
+{
+  bool mounted = false;
+  bool res = false;
+  std::string content = "";
+
+  if (!syncStorageBegin(imapData, mounted))
+    return false;
+
+  content = imapData._syncFolder + ESP32_MAIL_STR_34;
+  content += imapData._syncUIDValidity + ESP32_MAIL_STR_34;
+  content += imapData._syncNextUID + ESP32_MAIL_STR_34;
+  content += imapData._syncModSeq + ESP32_MAIL_STR_34;
+
+  res = writeStateFile(imapData, imapData._syncFile, content);
+
+  syncStorageEnd(imapData, mounted);
+  std::string().swap(content);
+
+  return res;
+}
+
+//Write the whole content to the temporary file and rename it into place, the old file is kept if the write did not complete
+bool ESP32_MailClient::writeStateFile(IMAPData &imapData, const std::string &path, const std::string &content)
+{
+  std::string tmppath = path + ESP32_MAIL_STR_329;
+  size_t written = 0;
+  bool res = false;
+  File file;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    file = SD.open(tmppath.c_str(), FILE_WRITE);
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    file = SPIFFS.open(tmppath.c_str(), FILE_WRITE);
+
+  if (!file)
+    goto out;
+
+  written = file.write((const uint8_t *)content.c_str(), content.length());
+  file.close();
+
+  //FAT and SPIFFS don't rename over the existing file
+  if (imapData._storageType == MailClientStorageType::SD)
+  {
+    if (written != content.length())
+      SD.remove(tmppath.c_str());
+    else
+    {
+      if (SD.exists(path.c_str()))
+        SD.remove(path.c_str());
+      res = SD.rename(tmppath.c_str(), path.c_str());
+    }
+  }
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+  {
+    if (written != content.length())
+      SPIFFS.remove(tmppath.c_str());
+    else
+    {
+      if (SPIFFS.exists(path.c_str()))
+        SPIFFS.remove(path.c_str());
+      res = SPIFFS.rename(tmppath.c_str(), path.c_str());
+    }
+  }
+
+out:
+  std::string().swap(tmppath);
+  return res;
+}
+
+std::string ESP32_MailClient::getAttachmentFilePath(IMAPData &imapData, int mailIndex, int messageDataIndex)
+{
+  std::string filepath = imapData._savePath;
+  filepath += ESP32_MAIL_STR_202;
+
+  char *midx = new char[50];
+  memset(midx, 0, 50);
+  itoa(imapData._msgNum[mailIndex], midx, 10);
+
+  filepath += midx;
+
+  delete[] midx;
+
+  filepath += ESP32_MAIL_STR_202;
+  filepath += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._filename;
+
+  return filepath;
+}
+
+bool ESP32_MailClient::loadDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex)
+{
+  std::string filepath = getAttachmentFilePath(imapData, mailIndex, messageDataIndex);
+  std::string chkpath = filepath + ESP32_MAIL_STR_326;
+  std::string line = "";
+  std::vector<std::string> values = std::vector<std::string>();
+  File file;
+  size_t fileSize = 0;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    file = SD.open(chkpath.c_str(), FILE_READ);
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    file = SPIFFS.open(chkpath.c_str(), FILE_READ);
+
+  if (file)
+  {
+    //The checkpoint file contains UIDVALIDITY, UID, part, encoded offset and decoded size, one value per line
+    while (file.available())
+    {
+      int r = file.read();
+      if (r < 0)
+        break;
+
+      if (r == '\n')
+      {
+        values.push_back(line);
+        line.clear();
+      }
+      else if (r != '\r')
+        line.append(1, (char)r);
+    }
+    file.close();
+  }
+
+  if (imapData._storageType == MailClientStorageType::SD)
+    file = SD.open(filepath.c_str(), FILE_READ);
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+    file = SPIFFS.open(filepath.c_str(), FILE_READ);
+
+  if (file)
+  {
+    fileSize = file.size();
+    file.close();
+  }
+
+  if (values.size() == 6 && values[0] == imapData._uidValidity && strtoul(values[1].c_str(), NULL, 10) == imapData._msgNum[mailIndex] &&
+      values[2] == imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._part && strtoul(values[4].c_str(), NULL, 10) <= fileSize &&
+      strtoul(values[5].c_str(), NULL, 10) > strtoul(values[3].c_str(), NULL, 10))
+  {
+    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._resumeOffset = strtoul(values[3].c_str(), NULL, 10);
+    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._resumeSize = strtoul(values[4].c_str(), NULL, 10);
+    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._encodedSize = strtoul(values[5].c_str(), NULL, 10);
+  }
+
+  std::string().swap(filepath);
+  std::string().swap(chkpath);
+  std::string().swap(line);
+  std::vector<std::string>().swap(values);
+
+  return imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._resumeOffset > 0;
+}
+
+void ESP32_MailClient::saveDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex, size_t offset, size_t size, size_t encodedSize)
+{
+  std::string chkpath = getAttachmentFilePath(imapData, mailIndex, messageDataIndex) + ESP32_MAIL_STR_326;
+  std::string content = imapData._uidValidity + ESP32_MAIL_STR_34;
+  char *num = new char[50];
+
+  //all values are written at once, the UID and the offset can't be left from the different saves
+  memset(num, 0, 50);
+  ultoa(imapData._msgNum[mailIndex], num, 10);
+  content += num;
+  content += ESP32_MAIL_STR_34;
+  content += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._part + ESP32_MAIL_STR_34;
+  memset(num, 0, 50);
+  ultoa(offset, num, 10);
+  content += num;
+  content += ESP32_MAIL_STR_34;
+  memset(num, 0, 50);
+  ultoa(size, num, 10);
+  content += num;
+  content += ESP32_MAIL_STR_34;
+  memset(num, 0, 50);
+  ultoa(encodedSize, num, 10);
+  content += num;
+  content += ESP32_MAIL_STR_34;
+
+  writeStateFile(imapData, chkpath, content);
+
+  delete[] num;
+  std::string().swap(chkpath);
+  std::string().swap(content);
+}
+
+void ESP32_MailClient::removeDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex)
+{
+  std::string chkpath = getAttachmentFilePath(imapData, mailIndex, messageDataIndex) + ESP32_MAIL_STR_326;
+
+  if (imapData._storageType == MailClientStorageType::SD)
+  {
+    if (SD.exists(chkpath.c_str()))
+      SD.remove(chkpath.c_str());
+  }
+  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+  {
+    if (SPIFFS.exists(chkpath.c_str()))
+      SPIFFS.remove(chkpath.c_str());
+  }
+
+  std::string().swap(chkpath);
+}
+
+void ESP32_MailClient::setHeaderField(IMAPData &imapData, int mailIndex, uint8_t field, const char *value, size_t length, bool append)
+{
+  if (mailIndex < 0 || mailIndex >= imapData._message.size() || field >= MAX_HEADER_FIELD)
+    return;
+
+  headerArenaSlice &slice = imapData._message[mailIndex]._header[field];
+
+  if (!append || slice.length == 0)
+  {
+    slice.offset = imapData._headerArenaLength;
+    slice.length = 0;
+  }
+  else if (slice.offset + slice.length + 1 == imapData._headerArenaLength)
+  {
+    //The value is at the top of arena, extend it in place
+    imapData._headerArenaLength--;
+  }
+  else
+  {
+    //Other value was set or decoded after this one, move the value to the top of arena and extend it there
+    if (!imapData.headerArenaReserve(slice.length + length + 1))
+      return;
+
+    memcpy(imapData._headerArena + imapData._headerArenaLength, imapData._headerArena + slice.offset, slice.length);
+    slice.offset = imapData._headerArenaLength;
+    imapData._headerArenaLength += slice.length;
+  }
+
+  if (!imapData.headerArenaReserve(length + 1))
+  {
+    if (slice.length > 0)
+    {
+      imapData._headerArena[slice.offset + slice.length] = 0;
+      imapData._headerArenaLength = slice.offset + slice.length + 1;
+    }
+    return;
+  }
+
+  memcpy(imapData._headerArena + imapData._headerArenaLength, value, length);
+  imapData._headerArenaLength += length;
+  imapData._headerArena[imapData._headerArenaLength++] = 0;
+  slice.length += length;
+
+  //Keep the raw value, the encoded words will be decoded when the value is accessed
+  if (field == MailClientHeaderField::FROM || field == MailClientHeaderField::TO || field == MailClientHeaderField::CC || field == MailClientHeaderField::SUBJECT)
+    slice.encoded = strstr(imapData._headerArena + slice.offset, "=?") != NULL;
+}
+
+size_t ESP32_MailClient::qpDecodeChar(qpDecoderState &qp, char c, char *out)
+{
+  //state 0: text, 1: after '=', 2: after '=' and one hex digit, 3: soft line break, skip until LF
+  int h;
+
+  switch (qp.state)
+  {
+  case 1:
+    if (c == '\r' || c == ' ' || c == '\t')
+    {
+      qp.state = 3;
+      return 0;
+    }
+    else if (c == '\n')
+    {
+      qp.state = 0;
+      return 0;
+    }
+    else if (hexval(c) >= 0)
+    {
+      qp.hex = c;
+      qp.state = 2;
+      return 0;
+    }
+    qp.state = 0;
+    out[0] = '=';
+    out[1] = c;
+    return 2;
+
+  case 2:
+    qp.state = 0;
+    h = hexval(c);
+    if (h >= 0)
+    {
+      out[0] = (hexval(qp.hex) << 4) | h;
+      return 1;
+    }
+    out[0] = '=';
+    out[1] = qp.hex;
+    out[2] = c;
+    return 3;
+
+  case 3:
+    if (c == '\n')
+      qp.state = 0;
+    return 0;
+
+  default:
+    if (c == '=')
+    {
+      qp.state = 1;
+      return 0;
+    }
+    out[0] = c;
+    return 1;
+  }
 }
 
-bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &flag, uint8_t action)
+bool ESP32_MailClient::attachmentSinkSet(IMAPData &imapData)
+{
+  return imapData._attachmentCallback || imapData._attachmentStream || (imapData._attachmentBuffer && imapData._attachmentBufferSize > 0);
+}
+
+bool ESP32_MailClient::writeAttachmentSink(IMAPData &imapData, int mailIndex, int messageDataIndex, const uint8_t *data, size_t length, size_t offset, bool final)
+{
+  bool ret = true;
+
+  if (imapData._attachmentCallback)
+  {
+    AttachmentChunk chunk;
+    chunk._mailIndex = mailIndex;
+    chunk._attachmentIndex = messageDataIndex;
+    chunk._data = data;
+    chunk._length = length;
+    chunk._offset = offset;
+    chunk._totalSize = imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size;
+    chunk._final = final;
+    imapData._attachmentCallback(chunk);
+
+    if (imapData._attachmentAbort)
+      ret = false;
+  }
+
+  if (length == 0)
+    return ret;
+
+  if (imapData._attachmentStream)
+  {
+    if (imapData._attachmentStream->write(data, length) != length)
+      ret = false;
+  }
+
+  if (imapData._attachmentBuffer && imapData._attachmentBufferSize > 0)
+  {
+    size_t len = length;
+
+    if (imapData._attachmentBufferLength + len > imapData._attachmentBufferSize)
+    {
+      len = imapData._attachmentBufferSize - imapData._attachmentBufferLength;
+      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.clear();
+      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_310;
+      ret = false;
+    }
+
+    if (len > 0)
+    {
+      memcpy(imapData._attachmentBuffer + imapData._attachmentBufferLength, data, len);
+      imapData._attachmentBufferLength += len;
+    }
+  }
+
+  return ret;
+}
+
+bool ESP32_MailClient::_setFlag(IMAPData &imapData, const std::string &uidSet, const String &flag, uint8_t action, bool silent)
 {
 
   std::string buf;
@@ -932,6 +1969,19 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
 
   int count = 0;
 
+  if (uidSet.length() == 0)
+  {
+    _imapStatus = IMAP_STATUS_NO_MESSAGE_UID;
+    if (imapData._debug)
+    {
+      ESP32MailDebugError();
+      ESP32MailDebugLine(imapErrorReasonStr().c_str(), true);
+    }
+    delete[] _val;
+    delete[] _part;
+    return false;
+  }
+
   imapData._net->setDebugCallback(NULL);
 
   if (imapData._debug)
@@ -952,8 +2002,10 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
   if (imapData._debug)
     imapData._net->setDebugCallback(ESP32MailDebug);
 
+  imapData._net->setSTARTTLSProtocol(SSL_STARTTLS_IMAP);
+
   if (imapData._rootCA.size() > 0)
-    imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)imapData._rootCA.front());
+    imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)imapData._rootCA.front(), imapData._rootCALength);
   else
     imapData._net->begin(imapData._host.c_str(), imapData._port, ESP32_MAIL_STR_202, (const char *)NULL);
 
@@ -1004,15 +2056,14 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
   if (imapData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_228);
 
-  //Don't expect handshake from some servers
+  //Don't expect handshake from some servers, the greeting was already read before the STARTTLS upgrade
   dataTime = millis();
 
-  while (imapData._net->connected() && !imapData._net->getStreamPtr()->available() && millis() - 500 < dataTime)
+  while (!starttls && imapData._net->connected() && !imapData._net->getStreamPtr()->available() && millis() - 500 < dataTime)
     delay(0);
 
   if (imapData._net->connected() && imapData._net->getStreamPtr()->available())
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
+    imapData._net->discardReceived();
 
   imapData.clearMessageData();
 
@@ -1136,13 +2187,13 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
   }
 
   imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_249);
-  imapData._net->getStreamPtr()->print(msgUID);
+  imapData._net->getStreamPtr()->print(uidSet.c_str());
   if (action == 0)
-    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_250);
+    imapData._net->getStreamPtr()->print(silent ? ESP32_MAIL_STR_258 : ESP32_MAIL_STR_250);
   else if (action == 1)
-    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_251);
+    imapData._net->getStreamPtr()->print(silent ? ESP32_MAIL_STR_259 : ESP32_MAIL_STR_251);
   else
-    imapData._net->getStreamPtr()->print(ESP32_MAIL_STR_252);
+    imapData._net->getStreamPtr()->print(silent ? ESP32_MAIL_STR_260 : ESP32_MAIL_STR_252);
   imapData._net->getStreamPtr()->print(flag);
   imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_192);
 
@@ -1176,8 +2227,7 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
     ESP32MailDebugInfo(ESP32_MAIL_STR_234);
 
   if (imapData._net->connected())
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
+    imapData._net->discardReceived();
 
   imapData._net->getStreamPtr()->println(ESP32_MAIL_STR_146);
 
@@ -1212,8 +2262,7 @@ bool ESP32_MailClient::_setFlag(IMAPData &imapData, int msgUID, const String &fl
 
   if (imapData._net->connected())
   {
-    while (imapData._net->getStreamPtr()->available())
-      imapData._net->getStreamPtr()->read();
+    imapData._net->discardReceived();
 
     imapData._net->getStreamPtr()->stop();
   }
@@ -1231,8 +2280,7 @@ out:
   {
     if (imapData._net->connected())
     {
-      while (imapData._net->getStreamPtr()->available())
-        imapData._net->getStreamPtr()->read();
+      imapData._net->discardReceived();
       imapData._net->getStreamPtr()->stop();
     }
   }
@@ -1250,10 +2298,11 @@ bool ESP32_MailClient::smtpClientAvailable(SMTPData &smtpData, bool available)
   if (!smtpData._net->getStreamPtr())
     return false;
 
+  //the buffered response bytes stay readable after the server closed the connection
   if (available)
-    return smtpData._net->getStreamPtr()->connected() && smtpData._net->getStreamPtr()->available();
+    return smtpData._net->readable() > 0;
   else
-    return smtpData._net->getStreamPtr()->connected() && !smtpData._net->getStreamPtr()->available();
+    return smtpData._net->getStreamPtr()->connected() && smtpData._net->readable() == 0;
 }
 
 bool ESP32_MailClient::imapClientAvailable(IMAPData &imapData, bool available)
@@ -1262,10 +2311,11 @@ bool ESP32_MailClient::imapClientAvailable(IMAPData &imapData, bool available)
   if (!imapData._net->getStreamPtr())
     return false;
 
+  //the buffered response bytes stay readable after the server closed the connection
   if (available)
-    return imapData._net->getStreamPtr()->connected() && imapData._net->getStreamPtr()->available();
+    return imapData._net->readable() > 0;
   else
-    return imapData._net->getStreamPtr()->connected() && !imapData._net->getStreamPtr()->available();
+    return imapData._net->getStreamPtr()->connected() && imapData._net->readable() == 0;
 }
 
 void ESP32_MailClient::createDirs(std::string dirs)
@@ -1331,6 +2381,9 @@ bool ESP32_MailClient::sendMail(SMTPData &smtpData)
   bool connected = false;
   char *_val = new char[bufSize];
   int res = 0;
+  uint8_t encoding = ENC7BIT;
+  qpEncoderState qp;
+  uint8_t poolFlags = 0;
 
   smtpData._net->setDebugCallback(NULL);
 
@@ -1351,14 +2404,32 @@ bool ESP32_MailClient::sendMail(SMTPData &smtpData)
   if (smtpData._debug)
     smtpData._net->setDebugCallback(ESP32MailDebug);
 
+  smtpData._net->setSTARTTLSProtocol(SSL_STARTTLS_SMTP);
+
   if (smtpData._rootCA.size() > 0)
-    smtpData._net->begin(smtpData._host.c_str(), smtpData._port, ESP32_MAIL_STR_202, (const char *)smtpData._rootCA.front());
+    smtpData._net->begin(smtpData._host.c_str(), smtpData._port, ESP32_MAIL_STR_202, (const char *)smtpData._rootCA.front(), smtpData._rootCALength);
   else
     smtpData._net->begin(smtpData._host.c_str(), smtpData._port, ESP32_MAIL_STR_202, (const char *)NULL);
 
   if (smtpData._port == 587)
     starttls = true;
 
+  //reuse the authenticated connection left by the previous message when it still answers
+  if (smtpData._net->acquirePooled(SSL_STARTTLS_SMTP, starttls, smtpData._loginEmail, smtpData._loginPassword, poolFlags))
+  {
+    connected = true;
+    smtpData._net->getStreamPtr()->println(ESP32_MAIL_STR_324);
+    if (waitSMTPResponse(smtpData) == 250)
+    {
+      smtpData._8bitMIME = poolFlags & SSL_STARTTLS_CAP_8BITMIME;
+      smtpData._binaryMIME = poolFlags & SSL_STARTTLS_CAP_BINARYMIME;
+      smtpData._chunking = poolFlags & SSL_STARTTLS_CAP_CHUNKING;
+      goto authenticated;
+    }
+    smtpData._net->getStreamPtr()->stop();
+    connected = false;
+  }
+
   if (!smtpData._net->connect(starttls))
   {
     _smtpStatus = SMTP_STATUS_SERVER_CONNECT_FAILED;
@@ -1420,9 +2491,13 @@ bool ESP32_MailClient::sendMail(SMTPData &smtpData)
   if (smtpData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_239);
 
+  smtpData._8bitMIME = false;
+  smtpData._binaryMIME = false;
+  smtpData._chunking = false;
+
   smtpData._net->getStreamPtr()->println(ESP32_MAIL_STR_6);
 
-  if (waitSMTPResponse(smtpData) == 250)
+  if (waitSMTPResponse(smtpData, true) == 250)
   {
     goto accept;
   }
@@ -1524,6 +2599,8 @@ accept:
     goto failed;
   }
 
+authenticated:
+
   if (smtpData._sendCallback)
   {
     smtpData._cbData._info = ESP32_MAIL_STR_125;
@@ -1570,10 +2647,24 @@ accept:
   buf2 += ESP32_MAIL_STR_15;
   buf2 += ESP32_MAIL_STR_34;
 
+  //BINARYMIME can only be sent with BDAT
+  encoding = smtpData._messageEncoding;
+  if (encoding == ENCBINARY && !(smtpData._binaryMIME && smtpData._chunking))
+    encoding = ENC8BIT;
+  //8bit lines are still limited to 998 octets (RFC 6152)
+  if (encoding == ENC8BIT && (!smtpData._8bitMIME || hasLongLine(smtpData._message, 998)))
+    encoding = ENCQUOTEDPRINTABLE;
+  if (encoding != ENC8BIT && encoding != ENCQUOTEDPRINTABLE && encoding != ENCBINARY)
+    encoding = ENC7BIT;
+
   buf += ESP32_MAIL_STR_8;
   buf += ESP32_MAIL_STR_14;
   buf += smtpData._senderEmail;
   buf += ESP32_MAIL_STR_15;
+  if (encoding == ENC8BIT)
+    buf += ESP32_MAIL_STR_315;
+  else if (encoding == ENCBINARY)
+    buf += ESP32_MAIL_STR_319;
   smtpData._net->getStreamPtr()->println(buf.c_str());
 
   if (waitSMTPResponse(smtpData) != 250)
@@ -1722,44 +2813,71 @@ accept:
   if (smtpData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_243);
 
-  smtpData._net->getStreamPtr()->println(ESP32_MAIL_STR_16);
+  //with CHUNKING, the message is sent in counted BDAT chunks instead of DATA
+  smtpData._bdat = smtpData._chunking;
+  smtpData._chunkError = false;
+  smtpData._chunkLength = 0;
+  smtpData._lineStart = true;
 
-  if (waitSMTPResponse(smtpData) != 354)
+  if (smtpData._bdat)
+    smtpData._chunkBuf = new uint8_t[BDAT_CHUNK_SIZE];
+  else
   {
-    _smtpStatus = SMTP_STATUS_SEND_BODY_FAILED;
-    if (smtpData._sendCallback)
-    {
-      smtpData._cbData._info = ESP32_MAIL_STR_53 + smtpErrorReasonStr();
-      smtpData._cbData._success = false;
-      smtpData._sendCallback(smtpData._cbData);
-    }
-    if (smtpData._debug)
+    smtpData._net->getStreamPtr()->println(ESP32_MAIL_STR_16);
+
+    if (waitSMTPResponse(smtpData) != 354)
     {
-      ESP32MailDebugError();
-      ESP32MailDebugLine(smtpErrorReasonStr().c_str(), true);
+      _smtpStatus = SMTP_STATUS_SEND_BODY_FAILED;
+      if (smtpData._sendCallback)
+      {
+        smtpData._cbData._info = ESP32_MAIL_STR_53 + smtpErrorReasonStr();
+        smtpData._cbData._success = false;
+        smtpData._sendCallback(smtpData._cbData);
+      }
+      if (smtpData._debug)
+      {
+        ESP32MailDebugError();
+        ESP32MailDebugLine(smtpErrorReasonStr().c_str(), true);
+      }
+      goto failed;
     }
-    goto failed;
   }
 
-  smtpData._net->getStreamPtr()->print(buf2.c_str());
+  smtpSendData(smtpData, buf2.c_str());
 
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_24);
-  smtpData._net->getStreamPtr()->println(smtpData._subject.c_str());
+  smtpSendData(smtpData, ESP32_MAIL_STR_24);
+  smtpSendData(smtpData, smtpData._subject.c_str());
+  smtpSendData(smtpData, ESP32_MAIL_STR_34);
 
   if (smtpData._customMessageHeader.size() > 0)
     for (uint8_t k = 0; k < smtpData._customMessageHeader.size(); k++)
-      smtpData._net->getStreamPtr()->println(smtpData._customMessageHeader[k].c_str());
+    {
+      smtpSendData(smtpData, smtpData._customMessageHeader[k].c_str());
+      smtpSendData(smtpData, ESP32_MAIL_STR_34);
+    }
 
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_3);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_1);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_2);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_35);
+  smtpSendData(smtpData, ESP32_MAIL_STR_3);
+  //the multipart entity should not declare a narrower encoding than its parts
+  if (encoding == ENC8BIT)
+    smtpSendData(smtpData, ESP32_MAIL_STR_313);
+  else if (encoding == ENCBINARY)
+    smtpSendData(smtpData, ESP32_MAIL_STR_320);
+  smtpSendData(smtpData, ESP32_MAIL_STR_1);
+  smtpSendData(smtpData, ESP32_MAIL_STR_2);
+  smtpSendData(smtpData, ESP32_MAIL_STR_35);
 
   buf.clear();
 
-  set_message_header(buf, smtpData._message, smtpData._htmlFormat);
+  set_message_header(buf, smtpData._message, smtpData._htmlFormat, encoding);
 
-  smtpData._net->getStreamPtr()->print(buf.c_str());
+  smtpSendData(smtpData, buf.c_str());
+
+  if (encoding == ENCQUOTEDPRINTABLE)
+  {
+    send_qp_encode_data(smtpData, qp, smtpData._message.c_str(), smtpData._message.length(), true);
+    smtpSendData(smtpData, ESP32_MAIL_STR_34);
+    smtpSendData(smtpData, ESP32_MAIL_STR_34);
+  }
 
   if (smtpData._attach._index > 0)
   {
@@ -1784,10 +2902,13 @@ accept:
         ESP32MailDebug(smtpData._attach._filename[i].c_str());
 
       buf.clear();
-      set_attachment_header(i, buf, smtpData._attach);
-      smtpData._net->getStreamPtr()->print(buf.c_str());
-      send_base64_encode_mime_data(smtpData._net->getStreamPtr(), smtpData._attach._buf[i].front(), smtpData._attach._size[i]);
-      smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_34);
+      set_attachment_header(i, buf, smtpData._attach, encoding == ENCBINARY);
+      smtpSendData(smtpData, buf.c_str());
+      if (encoding == ENCBINARY)
+        smtpSendData(smtpData, smtpData._attach._buf[i].front(), smtpData._attach._size[i]);
+      else
+        send_base64_encode_mime_data(smtpData, smtpData._attach._buf[i].front(), smtpData._attach._size[i]);
+      smtpSendData(smtpData, ESP32_MAIL_STR_34);
     }
     else
     {
@@ -1820,8 +2941,8 @@ accept:
           ESP32MailDebug(smtpData._attach._filename[i].c_str());
 
         buf.clear();
-        set_attachment_header(i, buf, smtpData._attach);
-        smtpData._net->getStreamPtr()->print(buf.c_str());
+        set_attachment_header(i, buf, smtpData._attach, encoding == ENCBINARY);
+        smtpSendData(smtpData, buf.c_str());
 
         File file;
         if (smtpData._storageType == MailClientStorageType::SD)
@@ -1829,8 +2950,11 @@ accept:
         else if (smtpData._storageType == MailClientStorageType::SPIFFS)
           file = SPIFFS.open(smtpData._attach._filename[i].c_str(), FILE_READ);
 
-        send_base64_encode_mime_file(smtpData._net->getStreamPtr(), file);
-        smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_34);
+        if (encoding == ENCBINARY)
+          send_binary_mime_file(smtpData, file);
+        else
+          send_base64_encode_mime_file(smtpData, file);
+        smtpSendData(smtpData, ESP32_MAIL_STR_34);
       }
     }
   }
@@ -1838,10 +2962,13 @@ accept:
   if (smtpData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_245);
 
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_33);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_2);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_33);
-  smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_37);
+  smtpSendData(smtpData, ESP32_MAIL_STR_33);
+  smtpSendData(smtpData, ESP32_MAIL_STR_2);
+  smtpSendData(smtpData, ESP32_MAIL_STR_33);
+  if (smtpData._bdat)
+    smtpSendData(smtpData, ESP32_MAIL_STR_34);
+  else
+    smtpData._net->getStreamPtr()->print(ESP32_MAIL_STR_37);
 
   if (smtpData._sendCallback)
   {
@@ -1850,7 +2977,10 @@ accept:
     smtpData._sendCallback(smtpData._cbData);
   }
 
-  res = waitSMTPResponse(smtpData);
+  if (smtpData._bdat)
+    res = smtpData._chunkError ? -1 : sendBDATChunk(smtpData, smtpData._chunkBuf, smtpData._chunkLength, true);
+  else
+    res = waitSMTPResponse(smtpData);
 
   if (res != 250 && res != -1000)
   {
@@ -1879,7 +3009,10 @@ accept:
   if (smtpData._debug)
     ESP32MailDebugInfo(ESP32_MAIL_STR_246);
 
-  if (smtpData._net->connected())
+  poolFlags = (smtpData._8bitMIME ? SSL_STARTTLS_CAP_8BITMIME : 0) | (smtpData._binaryMIME ? SSL_STARTTLS_CAP_BINARYMIME : 0) | (smtpData._chunking ? SSL_STARTTLS_CAP_CHUNKING : 0);
+
+  //keep the authenticated connection for the next message to the same server
+  if (smtpData._net->connected() && !smtpData._net->releaseToPool(SSL_STARTTLS_SMTP, starttls, smtpData._loginEmail, smtpData._loginPassword, poolFlags))
     smtpData._net->getStreamPtr()->stop();
 
   smtpData._cbData.empty();
@@ -1887,6 +3020,8 @@ accept:
   std::string().swap(buf);
   std::string().swap(buf2);
   delete[] _val;
+  delete[] smtpData._chunkBuf;
+  smtpData._chunkBuf = nullptr;
 
   return true;
 
@@ -1902,6 +3037,8 @@ failed:
   std::string().swap(buf);
   std::string().swap(buf2);
   delete[] _val;
+  delete[] smtpData._chunkBuf;
+  smtpData._chunkBuf = nullptr;
   return false;
 }
 
@@ -1974,6 +3111,12 @@ String ESP32_MailClient::imapErrorReason()
   case IMAP_STATUS_PARSE_FLAG_FAILED:
     res = ESP32_MAIL_STR_256;
     break;
+  case IMAP_STATUS_NO_MESSAGE_UID:
+    res = ESP32_MAIL_STR_261;
+    break;
+  case IMAP_STATUS_ATTACHMENT_WRITE_FAILED:
+    res = ESP32_MAIL_STR_328;
+    break;
   case MAIL_CLIENT_STATUS_WIFI_CONNECT_FAIL:
     res = ESP32_MAIL_STR_221;
     break;
@@ -2004,6 +3147,12 @@ std::string ESP32_MailClient::imapErrorReasonStr()
   case IMAP_STATUS_PARSE_FLAG_FAILED:
     res = ESP32_MAIL_STR_256;
     break;
+  case IMAP_STATUS_NO_MESSAGE_UID:
+    res = ESP32_MAIL_STR_261;
+    break;
+  case IMAP_STATUS_ATTACHMENT_WRITE_FAILED:
+    res = ESP32_MAIL_STR_328;
+    break;
   case MAIL_CLIENT_STATUS_WIFI_CONNECT_FAIL:
     res = ESP32_MAIL_STR_221;
     break;
@@ -2033,6 +3182,56 @@ void ESP32_MailClient::ESP32MailDebugInfo(PGM_P info)
   delete[] dbgInfo;
 }
 
+bool ESP32_MailClient::saveTLSSessionCache()
+{
+  return ssl_session_cache_save(ESP32_MAIL_STR_323);
+}
+
+bool ESP32_MailClient::loadTLSSessionCache()
+{
+  return ssl_session_cache_load(ESP32_MAIL_STR_323);
+}
+
+void ESP32_MailClient::clearTLSSessionCache()
+{
+  ssl_session_cache_clear(NULL, 0);
+}
+
+void ESP32_MailClient::clearCACertCache()
+{
+  ssl_ca_cache_clear();
+}
+
+bool ESP32_MailClient::preResolveHost(const char *host)
+{
+  return ssl_dns_cache_resolve(host);
+}
+
+void ESP32_MailClient::setDNSCacheTTL(unsigned long ttl)
+{
+  ssl_dns_cache_set_ttl(ttl);
+}
+
+void ESP32_MailClient::clearDNSCache()
+{
+  ssl_dns_cache_invalidate(NULL);
+}
+
+bool ESP32_MailClient::getHandshakeRecord(const char *host, uint16_t port, ssl_handshake_record32 &record)
+{
+  return ssl_handshake_record_get(host, port, &record);
+}
+
+void ESP32_MailClient::setConnectionPool(size_t maxSize, unsigned long idleTimeout)
+{
+  ESP32MailHTTPClient::setPoolOptions(maxSize, idleTimeout);
+}
+
+void ESP32_MailClient::clearConnectionPool()
+{
+  ESP32MailHTTPClient::clearPool();
+}
+
 bool ESP32_MailClient::sdBegin(uint8_t sck, uint8_t miso, uint8_t mosi, uint8_t ss)
 {
   _sck = sck;
@@ -2050,25 +3249,38 @@ bool ESP32_MailClient::sdBegin(void)
   return SD.begin();
 }
 
-void ESP32_MailClient::set_message_header(string &header, string &message, bool htmlFormat)
+void ESP32_MailClient::set_message_header(string &header, string &message, bool htmlFormat, uint8_t encoding)
 {
   header += ESP32_MAIL_STR_33;
   header += ESP32_MAIL_STR_2;
   header += ESP32_MAIL_STR_34;
-  if (!htmlFormat)
+  if (htmlFormat)
+    header += ESP32_MAIL_STR_28;
+  else if (encoding == ENC7BIT)
     header += ESP32_MAIL_STR_27;
   else
-    header += ESP32_MAIL_STR_28;
-
-  header += ESP32_MAIL_STR_29;
+    header += ESP32_MAIL_STR_314;
+
+  if (encoding == ENCQUOTEDPRINTABLE)
+    header += ESP32_MAIL_STR_312;
+  else if (encoding == ENC8BIT)
+    header += ESP32_MAIL_STR_313;
+  else if (encoding == ENCBINARY)
+    header += ESP32_MAIL_STR_320;
+  else
+    header += ESP32_MAIL_STR_29;
   header += ESP32_MAIL_STR_34;
 
+  //quoted-printable body is encoded while sending
+  if (encoding == ENCQUOTEDPRINTABLE)
+    return;
+
   header += message;
   header += ESP32_MAIL_STR_34;
   header += ESP32_MAIL_STR_34;
 }
 
-void ESP32_MailClient::set_attachment_header(uint8_t index, std::string &header, attachmentData &attach)
+void ESP32_MailClient::set_attachment_header(uint8_t index, std::string &header, attachmentData &attach, bool binary)
 {
 
   header += ESP32_MAIL_STR_33;
@@ -2101,13 +3313,16 @@ void ESP32_MailClient::set_attachment_header(uint8_t index, std::string &header,
   header += filename;
   header += ESP32_MAIL_STR_36;
 
-  header += ESP32_MAIL_STR_31;
+  if (binary)
+    header += ESP32_MAIL_STR_320;
+  else
+    header += ESP32_MAIL_STR_31;
   header += ESP32_MAIL_STR_34;
 
   std::string().swap(filename);
 }
 
-int ESP32_MailClient::waitSMTPResponse(SMTPData &smtpData)
+int ESP32_MailClient::waitSMTPResponse(SMTPData &smtpData, bool ehlo)
 {
 
   long dataTime = millis();
@@ -2125,7 +3340,7 @@ int ESP32_MailClient::waitSMTPResponse(SMTPData &smtpData)
   {
     while (smtpClientAvailable(smtpData, true))
     {
-      int r = smtpData._net->getStreamPtr()->read();
+      int r = smtpData._net->readByte();
 
       if (r < 0)
         continue;
@@ -2142,6 +3357,16 @@ int ESP32_MailClient::waitSMTPResponse(SMTPData &smtpData)
           if (p1 != std::string::npos)
             resCode = atoi(lineBuf.substr(0, p1).c_str());
         }
+        //EHLO keywords follow the 3 digits reply code and '-' or ' '
+        if (ehlo && lineBuf.length() > 4)
+        {
+          if (strncasecmp(lineBuf.c_str() + 4, ESP32_MAIL_STR_316, strlen(ESP32_MAIL_STR_316)) == 0)
+            smtpData._8bitMIME = true;
+          else if (strncasecmp(lineBuf.c_str() + 4, ESP32_MAIL_STR_317, strlen(ESP32_MAIL_STR_317)) == 0)
+            smtpData._binaryMIME = true;
+          else if (strncasecmp(lineBuf.c_str() + 4, ESP32_MAIL_STR_318, strlen(ESP32_MAIL_STR_318)) == 0)
+            smtpData._chunking = true;
+        }
         if (smtpData._debug)
           ESP32MailDebug(lineBuf.c_str());
         lineBuf.clear();
@@ -2170,7 +3395,7 @@ bool ESP32_MailClient::getIMAPResponse(IMAPData &imapData)
   {
     while (imapClientAvailable(imapData, true))
     {
-      int r = imapData._net->getStreamPtr()->read();
+      int r = imapData._net->readByte();
       if (r < 0)
         continue;
       c = (char)r;
@@ -2192,6 +3417,23 @@ bool ESP32_MailClient::getIMAPResponse(IMAPData &imapData)
   return success;
 }
 
+void ESP32_MailClient::addSearchResult(IMAPData &imapData, uint32_t msgNum, size_t &ringIndex)
+{
+  imapData._searchCount++;
+
+  if (imapData._emailNumMax == 0)
+    return;
+
+  if (imapData._msgNum.size() < imapData._emailNumMax)
+    imapData._msgNum.push_back(msgNum);
+  else if (imapData._recentSort)
+  {
+    //Keep the last ids in the fixed size window by overwriting the oldest one, the result will be sorted later
+    imapData._msgNum[ringIndex] = msgNum;
+    ringIndex = (ringIndex + 1) % imapData._emailNumMax;
+  }
+}
+
 bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandType, int maxChar, int mailIndex, int messageDataIndex, std::string part)
 {
 
@@ -2203,21 +3445,8 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
   std::string filepath = "";
   std::string hpath = "";
   std::string tmp = "";
-  std::string msgID = "";
-  std::string from = "";
-  std::string to = "";
-  std::string subject = "";
-  std::string date = "";
-  std::string cc = "";
-  std::string from_charset = "";
-  std::string to_charset = "";
-  std::string cc_charset = "";
-  std::string subject_charset = "";
-  std::string acceptLanguage = "";
-  std::string contentLanguage = "";
 
   int bufSize = 100;
-  char *dest = new char[bufSize];
   char *buf = new char[bufSize];
 
   int readCount = 0;
@@ -2234,15 +3463,54 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
   bool downloadReq = false;
   size_t currentDownloadByte = 0;
 
-  int max = imapData._emailNumMax;
-  if (!imapData._recentSort)
-    max = max - 1;
+  size_t ringIndex = 0;
 
   uint8_t headerType = 0;
 
   File file;
   int reportState = 0;
   int downloadedByte = 0;
+  size_t resumeOffset = 0;
+  size_t checkpointOffset = 0;
+  size_t checkpointSize = 0;
+  bool sinkReq = false;
+  int charset = CHARSET_UTF8;
+  bool qpDecode = false;
+  bool saveDecoded = false;
+  qpDecoderState qp;
+  unsigned char *decodeBuf = nullptr;
+  size_t decodeBufLen = 0;
+  const uint8_t *span = nullptr;
+  size_t spanLen = 0;
+  bool spanLine = false;
+  const char *lineData = NULL;
+  size_t lineDataLen = 0;
+  char qpBuf[3];
+  char utf8[9];
+  const char *text = NULL;
+  size_t textLength = 0;
+
+  if (imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_TEXT && messageDataIndex > -1)
+  {
+    messageBodyData &part = imapData._message[mailIndex]._messageDataInfo[messageDataIndex];
+
+    qpDecode = strcasecmp(part._transfer_encoding.c_str(), ESP32_MAIL_STR_311) == 0;
+    saveDecoded = (part._contentType == ESP32_MAIL_STR_155 && imapData._saveDecodedText) || (part._contentType == ESP32_MAIL_STR_154 && imapData._saveDecodedHTML);
+
+    if (imapData._utf8Conversion)
+      charset = CharsetDecoder.getCharset(part._charset.c_str(), part._charset.length());
+  }
+
+  if (imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && messageDataIndex > -1)
+  {
+    imapData._attachmentAbort = false;
+    resumeOffset = imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._resumeOffset;
+    downloadedByte = imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._resumeSize;
+    currentDownloadByte = downloadedByte;
+    checkpointOffset = resumeOffset;
+    checkpointSize = downloadedByte;
+    imapData._message[mailIndex]._downloadedByte += downloadedByte;
+  }
 
   if (imapCommandType == IMAP_COMMAND_TYPE::LIST)
     std::vector<std::string>()
@@ -2257,10 +3525,36 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
     while (imapClientAvailable(imapData, true) || !completeResp)
     {
 
-      int r = imapData._net->getStreamPtr()->read();
+      spanLine = false;
+
+      //The attachment line that ends in the decrypted record is decoded from there, it is not copied to lineBuf
+      if (downloadReq && validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && lfCount > 0 && payloadLength > 0 && !completeResp && lineBuf.length() == 0)
+      {
+        spanLen = imapData._net->receiveSpan(span);
+        size_t n = 0;
+        while (n < spanLen && span[n] != '\r' && span[n] != '\n')
+          n++;
+
+        //the CRLF is consumed with the line, the span stays valid until the data after it is read
+        if (n > 0 && n + 1 < spanLen && span[n] == '\r' && span[n + 1] == '\n' && charCount + n + 2 < payloadLength)
+        {
+          lineData = (const char *)span;
+          lineDataLen = n;
+          charCount += n + 1;
+          imapData._net->releaseSpan(n + 2);
+          spanLine = true;
+        }
+      }
+
+      int r = spanLine ? '\n' : imapData._net->readByte();
 
       if (r < 0)
+      {
+        //Stop waiting for the incomplete response when the connection was lost
+        if (millis() - dataTime > imapData._net->tcpTimeout && (!imapData._net->connected() || millis() - dataTime > imapData._net->tcpTimeout + (30 * 1000)))
+          break;
         continue;
+      }
 
       c = (char)r;
 
@@ -2269,9 +3563,10 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
 
       if (imapCommandType == IMAP_COMMAND_TYPE::SEARCH && lfCount == 0)
       {
-        delay(0);
         if (c == ' ')
         {
+          delay(0);
+
           p3 = msgNumBuf.find(ESP32_MAIL_STR_257);
           if (p3 != std::string::npos)
           {
@@ -2279,14 +3574,8 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             break;
           }
 
-          if (msgNumBuf != ESP32_MAIL_STR_183 && msgNumBuf != ESP32_MAIL_STR_141 && imapData._msgNum.size() <= max)
-          {
-            imapData._msgNum.push_back(atoi(msgNumBuf.c_str()));
-
-            if (imapData._msgNum.size() > imapData._emailNumMax && imapData._recentSort)
-              imapData._msgNum.erase(imapData._msgNum.begin());
-            imapData._searchCount++;
-          }
+          if (msgNumBuf.length() > 0 && msgNumBuf != ESP32_MAIL_STR_183 && msgNumBuf != ESP32_MAIL_STR_141)
+            addSearchResult(imapData, atoi(msgNumBuf.c_str()), ringIndex);
 
           msgNumBuf.clear();
         }
@@ -2299,23 +3588,51 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
       if (c != '\r' && c != '\n' && imapCommandType != IMAP_COMMAND_TYPE::SEARCH)
         lineBuf.append(1, c);
 
+      //The line split between the records is collected in lineBuf, the last payload char is read as usual
+      if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && lfCount > 0 && payloadLength > 0 && !completeResp && c != '\r' && c != '\n')
+      {
+        spanLen = imapData._net->receiveSpan(span);
+        size_t n = 0;
+        while (n < spanLen && span[n] != '\r' && span[n] != '\n' && charCount + n + 1 < payloadLength)
+          n++;
+        lineBuf.append((const char *)span, n);
+        charCount += n;
+        imapData._net->releaseSpan(n);
+      }
+
       if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_TEXT && lfCount > 0)
       {
 
         if (payloadLength > 0 && charCount < payloadLength - 1)
         {
 
-          if (imapData._messageDataInfo[mailIndex][messageDataIndex]._transfer_encoding != ESP32_MAIL_STR_160)
+          if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._transfer_encoding != ESP32_MAIL_STR_160)
           {
+            //The quoted-printable decoder keeps its state between chars, soft line breaks can span any read boundary
+            text = &c;
+            textLength = 1;
+
+            if (qpDecode)
+            {
+              textLength = qpDecodeChar(qp, c, qpBuf);
+              text = qpBuf;
+            }
+
+            if (charset > CHARSET_UTF8 && textLength > 0)
+            {
+              textLength = CharsetDecoder.toUTF8(utf8, sizeof(utf8), text, textLength, charset);
+              text = utf8;
+            }
+
             if (charCount < maxChar)
-              imapData._messageDataInfo[mailIndex][messageDataIndex]._text.append(1, c);
+              imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._text.append(text, textLength);
 
             if (imapData._saveHTMLMsg || imapData._saveTextMsg)
             {
 
-              if (!imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite)
+              if (!imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite)
               {
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite = true;
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite = true;
 
                 if (_sdOk)
                 {
@@ -2341,14 +3658,14 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                   if (!imapData._headerSaved)
                     hpath = filepath + ESP32_MAIL_STR_203;
 
-                  if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_155)
+                  if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_155)
                   {
                     if (imapData._saveDecodedText)
                       filepath += ESP32_MAIL_STR_161;
                     else
                       filepath += ESP32_MAIL_STR_162;
                   }
-                  else if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_154)
+                  else if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_154)
                   {
                     if (imapData._saveDecodedHTML)
                       filepath += ESP32_MAIL_STR_163;
@@ -2364,16 +3681,24 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                 else
                 {
 
-                  if (imapData._messageDataCount[mailIndex] == messageDataIndex + 1)
+                  if (imapData._message[mailIndex]._messageDataCount == messageDataIndex + 1)
                   {
-                    imapData._messageDataInfo[mailIndex][messageDataIndex]._error = true;
-                    imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError.clear();
-                    imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
+                    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+                    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.clear();
+                    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
                   }
                 }
               }
               if (_sdOk)
-                file.write(c);
+              {
+                if (saveDecoded)
+                {
+                  if (textLength > 0)
+                    file.write((const uint8_t *)text, textLength);
+                }
+                else
+                  file.write(c);
+              }
             }
           }
         }
@@ -2382,7 +3707,7 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
         {
 
           if (charCount < payloadLength || !completeResp)
-            clientReadAll(imapData._net->getStreamPtr());
+            imapData._net->discardReceived();
 
           break;
         }
@@ -2432,11 +3757,15 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                 imapCommandType == IMAP_COMMAND_TYPE::EXAMINE ||
                 imapCommandType == IMAP_COMMAND_TYPE::SEARCH ||
                 imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_MIME ||
-                imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_HEADER)
+                imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_HEADER ||
+                imapCommandType == IMAP_COMMAND_TYPE::CAPABILITY ||
+                imapCommandType == IMAP_COMMAND_TYPE::ENABLE ||
+                imapCommandType == IMAP_COMMAND_TYPE::FETCH_FLAGS ||
+                imapCommandType == IMAP_COMMAND_TYPE::ESEARCH)
             {
 
               //Cyrus server 3.0 does not comply to rfc3501 as it resonses the CAPABILITY after received LOGIN command with no CAPABILITY command requested.
-              if (lineBuf.find(ESP32_MAIL_STR_134) == std::string::npos && lineBuf.find(ESP32_MAIL_STR_145) == std::string::npos)
+              if (imapCommandType == IMAP_COMMAND_TYPE::CAPABILITY || (lineBuf.find(ESP32_MAIL_STR_134) == std::string::npos && lineBuf.find(ESP32_MAIL_STR_145) == std::string::npos))
                 completeResp = true;
 
               //Some servers e.g. STRATO E-Mail-Server does not reply any error when fetching none existing MIME header part at defined index.
@@ -2469,11 +3798,11 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
           if (payloadLength > 0 && validResponse)
           {
 
-            if (imapData._messageDataInfo[mailIndex].size() < messageDataIndex + 1)
+            if (imapData._message[mailIndex]._messageDataInfo.size() < messageDataIndex + 1)
             {
               messageBodyData b;
-              imapData._messageDataInfo[mailIndex].push_back(b);
-              imapData._messageDataCount[mailIndex] = imapData._messageDataInfo[mailIndex].size();
+              imapData._message[mailIndex]._messageDataInfo.push_back(b);
+              imapData._message[mailIndex]._messageDataCount = imapData._message[mailIndex]._messageDataInfo.size();
             }
 
             p1 = tmp.find(ESP32_MAIL_STR_167);
@@ -2484,19 +3813,19 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               if (p2 != std::string::npos)
               {
 
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_167), p2 - p1 - strlen(ESP32_MAIL_STR_167));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_167), p2 - p1 - strlen(ESP32_MAIL_STR_167));
 
                 p1 = tmp.find(ESP32_MAIL_STR_168, p2);
                 if (p1 != std::string::npos)
                 {
                   p2 = lineBuf.find(ESP32_MAIL_STR_136, p1 + strlen(ESP32_MAIL_STR_168));
                   if (p2 != std::string::npos)
-                    imapData._messageDataInfo[mailIndex][messageDataIndex]._charset = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_168), p2 - p1 - strlen(ESP32_MAIL_STR_168));
+                    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._charset = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_168), p2 - p1 - strlen(ESP32_MAIL_STR_168));
                 }
                 else if (tmp.find(ESP32_MAIL_STR_169, p2) != std::string::npos)
                 {
                   p1 = tmp.find(ESP32_MAIL_STR_169, p2);
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._charset = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_169));
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._charset = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_169));
                 }
 
                 p1 = tmp.find(ESP32_MAIL_STR_170, p2);
@@ -2504,12 +3833,12 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                 {
                   p2 = lineBuf.find(ESP32_MAIL_STR_136, p1 + strlen(ESP32_MAIL_STR_170));
                   if (p2 != std::string::npos)
-                    imapData._messageDataInfo[mailIndex][messageDataIndex]._name = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_170), p2 - p1 - strlen(ESP32_MAIL_STR_170));
+                    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._name = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_170), p2 - p1 - strlen(ESP32_MAIL_STR_170));
                 }
                 else if (tmp.find(ESP32_MAIL_STR_171, p2) != std::string::npos)
                 {
                   p1 = tmp.find(ESP32_MAIL_STR_171, p2);
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._name = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_171));
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._name = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_171));
                 }
               }
             }
@@ -2521,9 +3850,9 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + strlen(ESP32_MAIL_STR_172));
 
               if (p2 != std::string::npos)
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._transfer_encoding = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_172), p2 - p1 - strlen(ESP32_MAIL_STR_172));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._transfer_encoding = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_172), p2 - p1 - strlen(ESP32_MAIL_STR_172));
               else
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._transfer_encoding = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_172));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._transfer_encoding = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_172));
             }
 
             p1 = tmp.find(ESP32_MAIL_STR_174);
@@ -2532,9 +3861,9 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + strlen(ESP32_MAIL_STR_174));
 
               if (p2 != std::string::npos)
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._descr = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_174), p2 - p1 - strlen(ESP32_MAIL_STR_174));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._descr = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_174), p2 - p1 - strlen(ESP32_MAIL_STR_174));
               else
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._descr = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_174));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._descr = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_174));
             }
 
             p1 = tmp.find(ESP32_MAIL_STR_175);
@@ -2544,15 +3873,15 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               p2 = lineBuf.find(";", p1 + strlen(ESP32_MAIL_STR_175));
 
               if (p2 != std::string::npos)
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._disposition = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_175), p2 - p1 - strlen(ESP32_MAIL_STR_175));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._disposition = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_175), p2 - p1 - strlen(ESP32_MAIL_STR_175));
               else
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._disposition = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_175));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._disposition = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_175));
 
-              if (imapData._messageDataInfo[mailIndex][messageDataIndex]._disposition == ESP32_MAIL_STR_153)
-                imapData._attachmentCount[mailIndex]++;
+              if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._disposition == ESP32_MAIL_STR_153)
+                imapData._message[mailIndex]._attachmentCount++;
             }
 
-            if (imapData._messageDataInfo[mailIndex][messageDataIndex]._disposition != "")
+            if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._disposition != "")
             {
 
               p1 = tmp.find(ESP32_MAIL_STR_176);
@@ -2561,13 +3890,13 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                 p2 = lineBuf.find(ESP32_MAIL_STR_136, p1 + strlen(ESP32_MAIL_STR_176));
 
                 if (p2 != std::string::npos)
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._filename = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_176), p2 - p1 - strlen(ESP32_MAIL_STR_176));
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._filename = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_176), p2 - p1 - strlen(ESP32_MAIL_STR_176));
               }
               else if (tmp.find(ESP32_MAIL_STR_177) != std::string::npos)
               {
 
                 p1 = tmp.find(ESP32_MAIL_STR_177);
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._filename = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_177));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._filename = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_177));
               }
 
               p1 = tmp.find(ESP32_MAIL_STR_178);
@@ -2576,13 +3905,13 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                 p2 = lineBuf.find(";", p1 + strlen(ESP32_MAIL_STR_178) + 1);
                 if (p2 != std::string::npos)
                 {
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._size = atoi(lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_178), p2 - p1 - strlen(ESP32_MAIL_STR_178)).c_str());
-                  imapData._totalAttachFileSize[mailIndex] += imapData._messageDataInfo[mailIndex][messageDataIndex]._size;
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size = atoi(lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_178), p2 - p1 - strlen(ESP32_MAIL_STR_178)).c_str());
+                  imapData._message[mailIndex]._totalAttachFileSize += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size;
                 }
                 else
                 {
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._size = atoi(lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_178)).c_str());
-                  imapData._totalAttachFileSize[mailIndex] += imapData._messageDataInfo[mailIndex][messageDataIndex]._size;
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size = atoi(lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_178)).c_str());
+                  imapData._message[mailIndex]._totalAttachFileSize += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size;
                 }
               }
 
@@ -2591,12 +3920,12 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               {
                 p2 = lineBuf.find(ESP32_MAIL_STR_136, p1 + strlen(ESP32_MAIL_STR_179));
                 if (p2 != std::string::npos)
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._creation_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_179), p2 - p1 - strlen(ESP32_MAIL_STR_179));
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._creation_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_179), p2 - p1 - strlen(ESP32_MAIL_STR_179));
               }
               else if (tmp.find(ESP32_MAIL_STR_180) != std::string::npos)
               {
                 p1 = tmp.find(ESP32_MAIL_STR_180);
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._creation_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_180));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._creation_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_180));
               }
 
               p1 = tmp.find(ESP32_MAIL_STR_181);
@@ -2604,30 +3933,24 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
               {
                 p2 = lineBuf.find(ESP32_MAIL_STR_136, p1 + strlen(ESP32_MAIL_STR_181));
                 if (p2 != std::string::npos)
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._modification_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_181), p2 - p1 - strlen(ESP32_MAIL_STR_181));
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._modification_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_181), p2 - p1 - strlen(ESP32_MAIL_STR_181));
               }
               else if (tmp.find(ESP32_MAIL_STR_182) != std::string::npos)
               {
                 p1 = tmp.find(ESP32_MAIL_STR_182);
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._modification_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_182));
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._modification_date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_182));
               }
             }
 
-            imapData._messageDataInfo[mailIndex][messageDataIndex]._part = part;
+            imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._part = part;
           }
         }
 
         if (imapCommandType == IMAP_COMMAND_TYPE::SEARCH && lfCount == 0)
         {
 
-          if (msgNumBuf.length() > 0 && msgNumBuf != ESP32_MAIL_STR_183 && msgNumBuf != ESP32_MAIL_STR_141 && imapData._msgNum.size() <= max)
-          {
-            imapData._msgNum.push_back(atoi(msgNumBuf.c_str()));
-            imapData._searchCount++;
-
-            if (imapData._msgNum.size() > imapData._emailNumMax && imapData._recentSort)
-              imapData._msgNum.erase(imapData._msgNum.begin());
-          }
+          if (msgNumBuf.length() > 0 && msgNumBuf != ESP32_MAIL_STR_183 && msgNumBuf != ESP32_MAIL_STR_141)
+            addSearchResult(imapData, atoi(msgNumBuf.c_str()), ringIndex);
 
           if (imapData._recentSort)
             std::sort(imapData._msgNum.begin(), imapData._msgNum.end(), compFunc);
@@ -2644,23 +3967,17 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::FROM;
             _headerType = IMAP_HEADER_TYPE::FROM;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + strlen(ESP32_MAIL_STR_184));
-            if (p2 != std::string::npos)
-              from = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_184), p2 - p1 - strlen(ESP32_MAIL_STR_184));
-            else
-              from = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_184));
+            p1 += strlen(ESP32_MAIL_STR_184);
 
-            if (from[0] == '=' && from[1] == '?')
+            if (lineBuf.length() > p1 + 1 && lineBuf[p1] == '=' && lineBuf[p1 + 1] == '?')
             {
-              p1 = from.find("?", 2);
+              p2 = lineBuf.find("?", p1 + 2);
 
-              if (p1 != std::string::npos)
-                from_charset = from.substr(2, p1 - 2);
+              if (p2 != std::string::npos)
+                setHeaderField(imapData, mailIndex, MailClientHeaderField::FROM_CHARSET, lineBuf.c_str() + p1 + 2, p2 - p1 - 2, false);
             }
 
-            memset(dest, 0, bufSize);
-            RFC2047Decoder.rfc2047Decode(dest, from.c_str(), bufSize);
-            from = dest;
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::FROM, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_185);
@@ -2669,23 +3986,17 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::TO;
             _headerType = IMAP_HEADER_TYPE::TO;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              to = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_185), p2 - p1 - strlen(ESP32_MAIL_STR_185));
-            else
-              to = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_185));
+            p1 += strlen(ESP32_MAIL_STR_185);
 
-            if (to[0] == '=' && to[1] == '?')
+            if (lineBuf.length() > p1 + 1 && lineBuf[p1] == '=' && lineBuf[p1 + 1] == '?')
             {
-              p1 = to.find("?", 2);
+              p2 = lineBuf.find("?", p1 + 2);
 
-              if (p1 != std::string::npos)
-                to_charset = to.substr(2, p1 - 2);
+              if (p2 != std::string::npos)
+                setHeaderField(imapData, mailIndex, MailClientHeaderField::TO_CHARSET, lineBuf.c_str() + p1 + 2, p2 - p1 - 2, false);
             }
 
-            memset(dest, 0, bufSize);
-            RFC2047Decoder.rfc2047Decode(dest, to.c_str(), bufSize);
-            to = dest;
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::TO, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_186);
@@ -2694,23 +4005,17 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::CC;
             _headerType = IMAP_HEADER_TYPE::CC;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              cc = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_186), p2 - p1 - strlen(ESP32_MAIL_STR_186));
-            else
-              cc = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_186));
+            p1 += strlen(ESP32_MAIL_STR_186);
 
-            if (cc[0] == '=' && cc[1] == '?')
+            if (lineBuf.length() > p1 + 1 && lineBuf[p1] == '=' && lineBuf[p1 + 1] == '?')
             {
-              p1 = cc.find("?", 2);
+              p2 = lineBuf.find("?", p1 + 2);
 
-              if (p1 != std::string::npos)
-                cc_charset = cc.substr(2, p1 - 2);
+              if (p2 != std::string::npos)
+                setHeaderField(imapData, mailIndex, MailClientHeaderField::CC_CHARSET, lineBuf.c_str() + p1 + 2, p2 - p1 - 2, false);
             }
 
-            memset(dest, 0, bufSize);
-            RFC2047Decoder.rfc2047Decode(dest, cc.c_str(), bufSize);
-            cc = dest;
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::CC, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_187);
@@ -2719,24 +4024,16 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::SUBJECT;
             _headerType = IMAP_HEADER_TYPE::SUBJECT;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-
-            memset(dest, 0, bufSize);
-            if (p2 != std::string::npos)
-              subject = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_187), p2 - p1 - strlen(ESP32_MAIL_STR_187));
-            else
-              subject = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_187));
+            p1 += strlen(ESP32_MAIL_STR_187);
 
-            if (subject[0] == '=' && subject[1] == '?')
+            if (lineBuf.length() > p1 + 1 && lineBuf[p1] == '=' && lineBuf[p1 + 1] == '?')
             {
-              p1 = subject.find("?", 2);
-              if (p1 != std::string::npos)
-                subject_charset = subject.substr(2, p1 - 2);
+              p2 = lineBuf.find("?", p1 + 2);
+              if (p2 != std::string::npos)
+                setHeaderField(imapData, mailIndex, MailClientHeaderField::SUBJECT_CHARSET, lineBuf.c_str() + p1 + 2, p2 - p1 - 2, false);
             }
 
-            memset(dest, 0, bufSize);
-            RFC2047Decoder.rfc2047Decode(dest, subject.c_str(), bufSize);
-            subject = dest;
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::SUBJECT, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
           p1 = tmp.find(ESP32_MAIL_STR_188);
           if (p1 != std::string::npos)
@@ -2744,11 +4041,8 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::DATE;
             _headerType = IMAP_HEADER_TYPE::DATE;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_188), p2 - p1 - strlen(ESP32_MAIL_STR_188));
-            else
-              date = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_188));
+            p1 += strlen(ESP32_MAIL_STR_188);
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::DATE, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_189);
@@ -2757,11 +4051,8 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::MSG_ID;
             _headerType = IMAP_HEADER_TYPE::MSG_ID;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              msgID = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_189), p2 - p1 - strlen(ESP32_MAIL_STR_189));
-            else
-              msgID = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_189));
+            p1 += strlen(ESP32_MAIL_STR_189);
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::MSG_ID, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_190);
@@ -2769,12 +4060,9 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
           {
             headerType = IMAP_HEADER_TYPE::ACCEPT_LANG;
             _headerType = IMAP_HEADER_TYPE::ACCEPT_LANG;
-
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              acceptLanguage = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_190), p2 - p1 - strlen(ESP32_MAIL_STR_190));
-            else
-              acceptLanguage = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_190));
+
+            p1 += strlen(ESP32_MAIL_STR_190);
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::ACCEPT_LANG, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           p1 = tmp.find(ESP32_MAIL_STR_191);
@@ -2783,38 +4071,27 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             headerType = IMAP_HEADER_TYPE::CONT_LANG;
             _headerType = IMAP_HEADER_TYPE::CONT_LANG;
 
-            p2 = lineBuf.find(ESP32_MAIL_STR_173, p1 + 1);
-            if (p2 != std::string::npos)
-              contentLanguage = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_191), p2 - p1 - strlen(ESP32_MAIL_STR_191));
-            else
-              contentLanguage = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_191));
+            p1 += strlen(ESP32_MAIL_STR_191);
+            setHeaderField(imapData, mailIndex, MailClientHeaderField::CONT_LANG, lineBuf.c_str() + p1, lineBuf.length() - p1, false);
           }
 
           if (_headerType == 0 && charCount < payloadLength && payloadLength > 0)
           {
             if (headerType == IMAP_HEADER_TYPE::FROM)
             {
-              memset(dest, 0, bufSize);
-              RFC2047Decoder.rfc2047Decode(dest, lineBuf.c_str(), bufSize);
-              from += dest;
+              setHeaderField(imapData, mailIndex, MailClientHeaderField::FROM, lineBuf.c_str(), lineBuf.length(), true);
             }
             else if (headerType == IMAP_HEADER_TYPE::TO)
             {
-              memset(dest, 0, bufSize);
-              RFC2047Decoder.rfc2047Decode(dest, lineBuf.c_str(), bufSize);
-              to += dest;
+              setHeaderField(imapData, mailIndex, MailClientHeaderField::TO, lineBuf.c_str(), lineBuf.length(), true);
             }
             else if (headerType == IMAP_HEADER_TYPE::CC)
             {
-              memset(dest, 0, bufSize);
-              RFC2047Decoder.rfc2047Decode(dest, lineBuf.c_str(), bufSize);
-              cc += dest;
+              setHeaderField(imapData, mailIndex, MailClientHeaderField::CC, lineBuf.c_str(), lineBuf.length(), true);
             }
             else if (headerType == IMAP_HEADER_TYPE::SUBJECT)
             {
-              memset(dest, 0, bufSize);
-              RFC2047Decoder.rfc2047Decode(dest, lineBuf.c_str(), bufSize);
-              subject += dest;
+              setHeaderField(imapData, mailIndex, MailClientHeaderField::SUBJECT, lineBuf.c_str(), lineBuf.length(), true);
             }
           }
         }
@@ -2836,6 +4113,111 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
           }
         }
 
+        if ((imapCommandType == IMAP_COMMAND_TYPE::LOGIN || imapCommandType == IMAP_COMMAND_TYPE::CAPABILITY) && lineBuf.find(ESP32_MAIL_STR_134) != std::string::npos)
+        {
+          imapData._capabilityChecked = true;
+
+          std::string cap = lineBuf + ESP32_MAIL_STR_131;
+
+          if (cap.find(ESP32_MAIL_STR_265 + std::string(ESP32_MAIL_STR_131)) != std::string::npos)
+            imapData._condstore = true;
+
+          //QRESYNC implies CONDSTORE
+          if (cap.find(ESP32_MAIL_STR_266 + std::string(ESP32_MAIL_STR_131)) != std::string::npos)
+          {
+            imapData._condstore = true;
+            imapData._qresync = true;
+          }
+
+          if (cap.find(ESP32_MAIL_STR_289 + std::string(ESP32_MAIL_STR_131)) != std::string::npos)
+            imapData._esearch = true;
+
+          if (cap.find(ESP32_MAIL_STR_290 + std::string(ESP32_MAIL_STR_131)) != std::string::npos)
+            imapData._partialSearch = true;
+
+          //CONTEXT=SEARCH implies ESEARCH
+          if (cap.find(ESP32_MAIL_STR_291 + std::string(ESP32_MAIL_STR_131)) != std::string::npos)
+          {
+            imapData._esearch = true;
+            imapData._contextSearch = true;
+          }
+
+          std::string().swap(cap);
+        }
+
+        if (imapCommandType == IMAP_COMMAND_TYPE::FETCH_FLAGS)
+        {
+          p1 = lineBuf.find(ESP32_MAIL_STR_165);
+          if (lineBuf[0] == '*' && p1 != std::string::npos)
+          {
+            p2 = lineBuf.find(ESP32_MAIL_STR_137, p1);
+            p3 = lineBuf.find(ESP32_MAIL_STR_274, p1);
+            if (p2 != std::string::npos && p3 != std::string::npos)
+            {
+              imapData._changedUID.push_back(strtoul(lineBuf.c_str() + p2 + strlen(ESP32_MAIL_STR_137), NULL, 10));
+
+              p1 = p3 + strlen(ESP32_MAIL_STR_274);
+              p2 = lineBuf.find(ESP32_MAIL_STR_192, p1);
+              if (p2 != std::string::npos)
+                imapData._changedFlags.push_back(lineBuf.substr(p1, p2 - p1));
+              else
+                imapData._changedFlags.push_back(std::string());
+            }
+          }
+
+          if (lineBuf.find(ESP32_MAIL_STR_273) == 0)
+          {
+            p1 = strlen(ESP32_MAIL_STR_273);
+            if (lineBuf.find(ESP32_MAIL_STR_275, p1) == p1)
+              p1 += strlen(ESP32_MAIL_STR_275);
+            parseUIDSet(lineBuf.substr(p1), imapData._vanishedUID);
+          }
+        }
+
+        if (imapCommandType == IMAP_COMMAND_TYPE::ESEARCH && lineBuf.find(ESP32_MAIL_STR_298) == 0)
+        {
+          p1 = lineBuf.find(ESP32_MAIL_STR_299);
+          if (p1 != std::string::npos)
+            imapData._searchCount = atoi(lineBuf.c_str() + p1 + strlen(ESP32_MAIL_STR_299));
+
+          p1 = lineBuf.find(ESP32_MAIL_STR_300);
+          p3 = strlen(ESP32_MAIL_STR_300);
+          if (p1 == std::string::npos)
+          {
+            p1 = lineBuf.find(ESP32_MAIL_STR_301);
+            p3 = strlen(ESP32_MAIL_STR_301);
+          }
+          if (p1 == std::string::npos)
+          {
+            p1 = lineBuf.find(ESP32_MAIL_STR_302);
+            p3 = strlen(ESP32_MAIL_STR_302);
+          }
+
+          if (p1 != std::string::npos)
+          {
+            p1 += p3;
+            p2 = lineBuf.find(ESP32_MAIL_STR_131, p1);
+            if (p2 == std::string::npos)
+              p2 = lineBuf.length();
+            parseSearchSet(imapData, lineBuf.substr(p1, p2 - p1));
+          }
+          else
+          {
+            //PARTIAL (<range> <set>) where set is NIL if no match
+            p1 = lineBuf.find(ESP32_MAIL_STR_303);
+            if (p1 != std::string::npos)
+            {
+              p1 = lineBuf.find(ESP32_MAIL_STR_131, p1 + strlen(ESP32_MAIL_STR_303));
+              p2 = lineBuf.find(ESP32_MAIL_STR_192, p1);
+              if (p1 != std::string::npos && p2 != std::string::npos)
+                parseSearchSet(imapData, lineBuf.substr(p1 + 1, p2 - p1 - 1));
+            }
+          }
+
+          if (imapData._recentSort)
+            std::sort(imapData._msgNum.begin(), imapData._msgNum.end(), compFunc);
+        }
+
         if (imapCommandType == IMAP_COMMAND_TYPE::SELECT || imapCommandType == IMAP_COMMAND_TYPE::EXAMINE)
         {
 
@@ -2885,28 +4267,53 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
             if (p2 != std::string::npos)
               imapData._nextUID = lineBuf.substr(p1 + 10, p2 - p1 - 10);
           }
+
+          p1 = lineBuf.find(ESP32_MAIL_STR_269);
+          if (p1 != std::string::npos)
+          {
+            p2 = lineBuf.find(ESP32_MAIL_STR_156, p1 + strlen(ESP32_MAIL_STR_269));
+            if (p2 != std::string::npos)
+              imapData._uidValidity = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_269), p2 - p1 - strlen(ESP32_MAIL_STR_269));
+          }
+
+          p1 = lineBuf.find(ESP32_MAIL_STR_270);
+          if (p1 != std::string::npos)
+          {
+            p2 = lineBuf.find(ESP32_MAIL_STR_156, p1 + strlen(ESP32_MAIL_STR_270));
+            if (p2 != std::string::npos)
+              imapData._highestModSeq = lineBuf.substr(p1 + strlen(ESP32_MAIL_STR_270), p2 - p1 - strlen(ESP32_MAIL_STR_270));
+          }
         }
 
         if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_TEXT && lfCount > 0 && (charCount < maxChar || imapData._saveHTMLMsg || imapData._saveTextMsg))
         {
 
-          if (imapData._messageDataInfo[mailIndex][messageDataIndex]._transfer_encoding == ESP32_MAIL_STR_160)
+          if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._transfer_encoding == ESP32_MAIL_STR_160)
           {
 
             unsigned char *decoded = base64_decode_char((const unsigned char *)lineBuf.c_str(), lineBuf.length(), &outputLength);
 
+            if (decoded && charset > CHARSET_UTF8)
+            {
+              //Convert the decoded line to UTF-8, the single byte charset has no state across lines
+              unsigned char *converted = new unsigned char[outputLength * 3];
+              outputLength = CharsetDecoder.toUTF8((char *)converted, outputLength * 3, (const char *)decoded, outputLength, charset);
+              delete[] decoded;
+              decoded = converted;
+            }
+
             if (decoded)
             {
               if (charCount < maxChar)
-                imapData._messageDataInfo[mailIndex][messageDataIndex]._text.append((char *)decoded, outputLength);
+                imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._text.append((char *)decoded, outputLength);
 
               if (imapData._saveHTMLMsg || imapData._saveTextMsg)
               {
 
-                if (!imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite)
+                if (!imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite)
                 {
 
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite = true;
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite = true;
 
                   if (_sdOk)
                   {
@@ -2932,14 +4339,14 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                     if (!imapData._headerSaved)
                       hpath = filepath + ESP32_MAIL_STR_203;
 
-                    if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_155)
+                    if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_155)
                     {
                       if (imapData._saveDecodedText)
                         filepath += ESP32_MAIL_STR_161;
                       else
                         filepath += ESP32_MAIL_STR_162;
                     }
-                    else if (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_154)
+                    else if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_154)
                     {
                       if (imapData._saveDecodedHTML)
                         filepath += ESP32_MAIL_STR_163;
@@ -2954,19 +4361,19 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                   }
                   else
                   {
-                    if (imapData._messageDataCount[mailIndex] == messageDataIndex + 1)
+                    if (imapData._message[mailIndex]._messageDataCount == messageDataIndex + 1)
                     {
-                      imapData._messageDataInfo[mailIndex][messageDataIndex]._error = true;
-                      imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError.clear();
-                      imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
+                      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+                      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.clear();
+                      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
                     }
                   }
                 }
 
                 if (_sdOk)
                 {
-                  if ((imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_155 && imapData._saveDecodedText) ||
-                      (imapData._messageDataInfo[mailIndex][messageDataIndex]._contentType == ESP32_MAIL_STR_154 && imapData._saveDecodedHTML))
+                  if ((imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_155 && imapData._saveDecodedText) ||
+                      (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._contentType == ESP32_MAIL_STR_154 && imapData._saveDecodedHTML))
                     file.write((const uint8_t *)decoded, outputLength);
                   else
                     file.write((const uint8_t *)lineBuf.c_str(), lineBuf.length());
@@ -2981,15 +4388,21 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
         if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && lfCount > 0)
         {
 
-          if (imapData._messageDataInfo[mailIndex][messageDataIndex]._transfer_encoding == ESP32_MAIL_STR_160)
+          if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._transfer_encoding == ESP32_MAIL_STR_160)
           {
 
-            if (!imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite)
+            if (!imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite)
             {
 
-              imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite = true;
+              imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite = true;
 
-              if (_sdOk)
+              if (attachmentSinkSet(imapData))
+              {
+                downloadReq = true;
+                sinkReq = true;
+                imapData._attachmentBufferLength = 0;
+              }
+              else if (_sdOk)
               {
 
                 downloadReq = true;
@@ -3012,61 +4425,117 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
 
                 filepath += ESP32_MAIL_STR_202;
 
-                filepath += imapData._messageDataInfo[mailIndex][messageDataIndex]._filename;
+                filepath += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._filename;
 
-                if (imapData._storageType == MailClientStorageType::SD)
+                if (resumeOffset > 0)
+                {
+                  //Overwrite the data that was written after the last checkpoint
+                  if (imapData._storageType == MailClientStorageType::SD)
+                    file = SD.open(filepath.c_str(), ESP32_MAIL_STR_307);
+                  else if (imapData._storageType == MailClientStorageType::SPIFFS)
+                    file = SPIFFS.open(filepath.c_str(), ESP32_MAIL_STR_307);
+
+                  if (file)
+                    file.seek(checkpointSize);
+                }
+                else if (imapData._storageType == MailClientStorageType::SD)
                   file = SD.open(filepath.c_str(), FILE_WRITE);
                 else if (imapData._storageType == MailClientStorageType::SPIFFS)
                   file = SPIFFS.open(filepath.c_str(), FILE_WRITE);
               }
               else
               {
-                if (imapData._messageDataCount[mailIndex] == messageDataIndex + 1)
+                if (imapData._message[mailIndex]._messageDataCount == messageDataIndex + 1)
                 {
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._error = true;
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError.clear();
-                  imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.clear();
+                  imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_89;
                 }
               }
             }
 
-            if (_sdOk)
+            if (sinkReq || _sdOk)
             {
 
-              unsigned char *decoded = base64_decode_char((const unsigned char *)lineBuf.c_str(), lineBuf.length(), &outputLength);
+              if (!spanLine)
+              {
+                lineData = lineBuf.c_str();
+                lineDataLen = lineBuf.length();
+              }
+
+              //one decode buffer for all lines
+              if (decodeBufLen < (lineDataLen + 3) / 4 * 3)
+              {
+                delete[] decodeBuf;
+                decodeBufLen = (lineDataLen + 3) / 4 * 3;
+                decodeBuf = new unsigned char[decodeBufLen];
+              }
+
+              unsigned char *decoded = NULL;
+              outputLength = 0;
+              if (base64_decode_buf((const unsigned char *)lineData, lineDataLen, decodeBuf, &outputLength))
+                decoded = decodeBuf;
 
               downloadedByte += outputLength;
 
-              if (downloadedByte > imapData._messageDataInfo[mailIndex][messageDataIndex]._size)
+              if (downloadedByte > imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size)
                 continue;
 
               if (decoded)
               {
-                file.write((const uint8_t *)decoded, outputLength);
-
-                if (imapData._storageType == MailClientStorageType::SPIFFS)
-                  delayMicroseconds(1);
+                if (sinkReq)
+                {
+                  if (!writeAttachmentSink(imapData, mailIndex, messageDataIndex, (const uint8_t *)decoded, outputLength, downloadedByte - outputLength, false))
+                  {
+                    imapData._attachmentAbort = true;
+                    break;
+                  }
+                }
                 else
-                  yield();
+                {
+                  if (file.write((const uint8_t *)decoded, outputLength) != outputLength)
+                  {
+                    imapData._attachmentAbort = true;
+                    break;
+                  }
+
+                  if (imapData._storageType == MailClientStorageType::SPIFFS)
+                    delayMicroseconds(1);
+                  else
+                    yield();
+                }
+
+                if (imapData._resumeDownload && !sinkReq)
+                {
+                  //The encoded offset at the end of this line
+                  checkpointOffset = resumeOffset + charCount;
+
+                  if (downloadedByte - checkpointSize >= DOWNLOAD_CHECKPOINT_INTERVAL)
+                  {
+                    file.flush();
+                    saveDownloadCheckpoint(imapData, mailIndex, messageDataIndex, checkpointOffset, downloadedByte, resumeOffset + payloadLength);
+                    checkpointSize = downloadedByte;
+                  }
+                }
 
                 if (imapData._downloadReport)
                 {
-                  imapData._downloadedByte[mailIndex] += outputLength;
+                  imapData._message[mailIndex]._downloadedByte += outputLength;
                   currentDownloadByte += outputLength;
 
-                  if (imapData._messageDataInfo[mailIndex][messageDataIndex]._size == 0)
+                  if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size == 0)
                   {
                     if (payloadLength > 36)
                     {
-                      imapData._messageDataInfo[mailIndex][messageDataIndex]._size = base64DecodeSize(lineBuf, payloadLength - (payloadLength / 36));
-                      imapData._totalAttachFileSize[mailIndex] += imapData._messageDataInfo[mailIndex][messageDataIndex]._size;
+                      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size = base64DecodeSize(std::string(lineData, lineDataLen), payloadLength - (payloadLength / 36));
+                      imapData._message[mailIndex]._totalAttachFileSize += imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size;
                     }
                   }
 
                   int p = 0;
 
-                  if (imapData._totalAttachFileSize[mailIndex] > 0)
-                    p = 100 * imapData._downloadedByte[mailIndex] / imapData._totalAttachFileSize[mailIndex];
+                  if (imapData._message[mailIndex]._totalAttachFileSize > 0)
+                    p = 100 * imapData._message[mailIndex]._downloadedByte / imapData._message[mailIndex]._totalAttachFileSize;
 
                   if ((p % 5 == 0) && (p <= 100))
                   {
@@ -3076,7 +4545,7 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                       memset(buf, 0, bufSize);
                       itoa(p, buf, 10);
 
-                      std::string dl = ESP32_MAIL_STR_90 + imapData._messageDataInfo[mailIndex][messageDataIndex]._filename + ESP32_MAIL_STR_91 + buf + ESP32_MAIL_STR_92;
+                      std::string dl = ESP32_MAIL_STR_90 + imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._filename + ESP32_MAIL_STR_91 + buf + ESP32_MAIL_STR_92;
 
                       if (imapData._readCallback)
                       {
@@ -3093,8 +4562,6 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
                   else
                     reportState = 0;
                 }
-
-                delete[] decoded;
               }
 
               if (millis() - dataTime > imapData._net->tcpTimeout + 1000 * 60 * 5)
@@ -3122,12 +4589,12 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
       readCount++;
     }
 
-    if (imapData._error.size() > 0 && mailIndex > -1)
+    if (imapData._message.size() > 0 && mailIndex > -1)
     {
-      if (validResponse && !imapData._error[mailIndex])
+      if (validResponse && !imapData._message[mailIndex]._error)
       {
-        imapData._errorMsg[mailIndex].clear();
-        imapData._errorMsg[mailIndex] = "";
+        imapData._message[mailIndex]._errorMsg.clear();
+        imapData._message[mailIndex]._errorMsg = "";
       }
     }
 
@@ -3136,35 +4603,73 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
 
       if (downloadReq)
       {
-        if (imapData._messageDataCount[mailIndex] == messageDataIndex + 1)
+        if (imapData._message[mailIndex]._messageDataCount == messageDataIndex + 1)
         {
-          imapData._messageDataInfo[mailIndex][messageDataIndex]._error = true;
-          imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError.clear();
-          imapData._messageDataInfo[mailIndex][messageDataIndex]._downloadError = ESP32_MAIL_STR_93;
+          imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+          imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.clear();
+          imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_93;
         }
       }
       else
       {
 
-        if (imapData._error.size() > 0 && mailIndex > -1)
+        if (imapData._message.size() > 0 && mailIndex > -1)
         {
-          imapData._error[mailIndex] = true;
-          imapData._errorMsg[mailIndex].clear();
-          imapData._errorMsg[mailIndex] = ESP32_MAIL_STR_95;
+          imapData._message[mailIndex]._error = true;
+          imapData._message[mailIndex]._errorMsg.clear();
+          imapData._message[mailIndex]._errorMsg = ESP32_MAIL_STR_95;
         }
       }
     }
   }
 
+  if (sinkReq)
+  {
+    if (completeResp && !imapData._attachmentAbort)
+    {
+      if (!writeAttachmentSink(imapData, mailIndex, messageDataIndex, NULL, 0, downloadedByte, true))
+        imapData._attachmentAbort = true;
+    }
+    else
+      validResponse = false;
+  }
+  else if (downloadReq)
+  {
+    if (!completeResp)
+    {
+      //Incomplete download, keep the checkpoint at the last decoded line for the next resume
+      if (imapData._resumeDownload && checkpointOffset > 0)
+      {
+        file.flush();
+        saveDownloadCheckpoint(imapData, mailIndex, messageDataIndex, checkpointOffset, downloadedByte, resumeOffset + payloadLength);
+      }
+
+      file.close();
+      validResponse = false;
+    }
+    else if (imapData._resumeDownload && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT)
+      removeDownloadCheckpoint(imapData, mailIndex, messageDataIndex);
+  }
+
+  //The rest of the FETCH response can't be skipped without reading it, close the connection to stop the transfer
+  if (imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && imapData._attachmentAbort)
+  {
+    validResponse = false;
+    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._error = true;
+    if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError.length() == 0)
+      imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._downloadError = ESP32_MAIL_STR_328;
+    imapData._net->getStreamPtr()->stop();
+  }
+
   if (validResponse && (imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT || imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_TEXT) && messageDataIndex != -1)
   {
-    if (imapData._messageDataInfo[mailIndex][messageDataIndex]._sdFileOpenWrite)
+    if (imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._sdFileOpenWrite)
       file.close();
   }
 
-  if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && imapData._messageDataInfo[mailIndex][messageDataIndex]._size != currentDownloadByte)
+  if (validResponse && imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_ATTACHMENT && imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size != currentDownloadByte)
   {
-    imapData._messageDataInfo[mailIndex][messageDataIndex]._size = currentDownloadByte;
+    imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._size = currentDownloadByte;
   }
 
   if (hpath != "")
@@ -3176,7 +4681,7 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
       file = SPIFFS.open(hpath.c_str(), FILE_WRITE);
 
     file.print(ESP32_MAIL_STR_99);
-    file.println(imapData._date[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::DATE));
 
     file.print(ESP32_MAIL_STR_100);
     if (imapData._uidSearch)
@@ -3188,45 +4693,45 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
     file.println(imapData._msgNum[mailIndex]);
 
     file.print(ESP32_MAIL_STR_102);
-    file.println(imapData._acceptLanguage[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::ACCEPT_LANG));
 
     file.print(ESP32_MAIL_STR_103);
-    file.println(imapData._contentLanguage[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::CONT_LANG));
 
     file.print(ESP32_MAIL_STR_104);
-    file.println(imapData._from[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::FROM));
 
     file.print(ESP32_MAIL_STR_105);
-    file.println(imapData._from_charset[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::FROM_CHARSET));
 
     file.print(ESP32_MAIL_STR_106);
-    file.println(imapData._to[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::TO));
 
     file.print(ESP32_MAIL_STR_107);
-    file.println(imapData._to_charset[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::TO_CHARSET));
 
     file.print(ESP32_MAIL_STR_108);
-    file.println(imapData._cc[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::CC));
 
     file.print(ESP32_MAIL_STR_109);
-    file.println(imapData._cc_charset[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::CC_CHARSET));
 
     file.print(ESP32_MAIL_STR_110);
-    file.println(imapData._subject[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::SUBJECT));
 
     file.print(ESP32_MAIL_STR_111);
-    file.println(imapData._subject_charset[mailIndex].c_str());
+    file.println(imapData.getHeaderField(mailIndex, MailClientHeaderField::SUBJECT_CHARSET));
 
     file.print(ESP32_MAIL_STR_112);
-    file.println(imapData._messageDataInfo[mailIndex][messageDataIndex]._charset.c_str());
+    file.println(imapData._message[mailIndex]._messageDataInfo[messageDataIndex]._charset.c_str());
 
-    if (imapData._attachmentCount[mailIndex] > 0)
+    if (imapData._message[mailIndex]._attachmentCount > 0)
     {
 
       file.print(ESP32_MAIL_STR_113);
-      file.println(imapData._attachmentCount[mailIndex]);
+      file.println(imapData._message[mailIndex]._attachmentCount);
 
-      for (int j = 0; j < imapData._attachmentCount[mailIndex]; j++)
+      for (int j = 0; j < imapData._message[mailIndex]._attachmentCount; j++)
       {
         file.print(ESP32_MAIL_STR_114);
         file.println(j + 1);
@@ -3252,27 +4757,8 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
     imapData._headerSaved = true;
   }
 
-  if (imapCommandType == IMAP_COMMAND_TYPE::FETCH_BODY_HEADER)
-  {
-    if (from != "")
-    {
-      imapData._msgID[mailIndex] = msgID;
-      imapData._from[mailIndex] = from;
-      imapData._to[mailIndex] = to;
-      imapData._cc[mailIndex] = cc;
-      imapData._subject[mailIndex] = subject;
-      imapData._date[mailIndex] = date;
-      imapData._from_charset[mailIndex] = from_charset;
-      imapData._to_charset[mailIndex] = to_charset;
-      imapData._cc_charset[mailIndex] = cc_charset;
-      imapData._subject_charset[mailIndex] = subject_charset;
-      imapData._contentLanguage[mailIndex] = contentLanguage;
-      imapData._acceptLanguage[mailIndex] = acceptLanguage;
-    }
-  }
-
   delete[] buf;
-  delete[] dest;
+  delete[] decodeBuf;
 
   std::string().swap(lineBuf);
   std::string().swap(msgNumBuf);
@@ -3280,19 +4766,6 @@ bool ESP32_MailClient::waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandT
   std::string().swap(hpath);
   std::string().swap(tmp);
 
-  std::string().swap(msgID);
-  std::string().swap(from);
-  std::string().swap(to);
-  std::string().swap(subject);
-  std::string().swap(date);
-  std::string().swap(cc);
-  std::string().swap(from_charset);
-  std::string().swap(to_charset);
-  std::string().swap(cc_charset);
-  std::string().swap(subject_charset);
-  std::string().swap(contentLanguage);
-  std::string().swap(acceptLanguage);
-
   return validResponse;
 }
 
@@ -3322,20 +4795,43 @@ double ESP32_MailClient::base64DecodeSize(std::string lastBase64String, int leng
 }
 
 unsigned char *ESP32_MailClient::base64_decode_char(const unsigned char *src, size_t len, size_t *out_len)
+{
+  unsigned char *out = (unsigned char *)malloc((len + 3) / 4 * 3);
+
+  if (out == NULL)
+    return NULL;
+
+  if (!base64_decode_buf(src, len, out, out_len))
+  {
+    free(out);
+    return NULL;
+  }
+
+  return out;
+}
+
+//Decode into the caller's buffer, out should hold (len + 3) / 4 * 3 bytes
+bool ESP32_MailClient::base64_decode_buf(const unsigned char *src, size_t len, unsigned char *out, size_t *out_len)
 {
 
-  unsigned char *out, *pos, block[4], tmp;
-  size_t i, count, olen;
+  unsigned char *pos, block[4], tmp;
+  size_t i, count;
   int pad = 0;
   size_t extra_pad;
 
-  unsigned char *dtable = new unsigned char[256];
+  //built once, the attachment download decodes every line
+  static unsigned char dtable[256];
+  static bool dtableReady = false;
 
-  memset(dtable, 0x80, 256);
+  if (!dtableReady)
+  {
+    memset(dtable, 0x80, 256);
 
-  for (i = 0; i < sizeof(base64_table) - 1; i++)
-    dtable[base64_table[i]] = (unsigned char)i;
-  dtable['='] = 0;
+    for (i = 0; i < sizeof(base64_table) - 1; i++)
+      dtable[base64_table[i]] = (unsigned char)i;
+    dtable['='] = 0;
+    dtableReady = true;
+  }
 
   count = 0;
   for (i = 0; i < len; i++)
@@ -3345,13 +4841,10 @@ unsigned char *ESP32_MailClient::base64_decode_char(const unsigned char *src, si
   }
 
   if (count == 0)
-    goto exit;
+    return false;
   extra_pad = (4 - count % 4) % 4;
 
-  olen = (count + extra_pad) / 4 * 3;
-  pos = out = (unsigned char *)malloc(olen);
-  if (out == NULL)
-    goto exit;
+  pos = out;
 
   count = 0;
   for (i = 0; i < len + extra_pad; i++)
@@ -3383,22 +4876,14 @@ unsigned char *ESP32_MailClient::base64_decode_char(const unsigned char *src, si
         else if (pad == 2)
           pos -= 2;
         else
-        {
-          free(out);
-          goto exit;
-        }
+          return false;
         break;
       }
     }
   }
 
   *out_len = pos - out;
-  delete[] dtable;
-  return out;
-
-exit:
-  delete[] dtable;
-  return NULL;
+  return true;
 }
 
 std::string ESP32_MailClient::base64_encode_string(const unsigned char *src, size_t len)
@@ -3410,46 +4895,276 @@ std::string ESP32_MailClient::base64_encode_string(const unsigned char *src, siz
 
   olen = 4 * ((len + 2) / 3);
 
-  if (olen < len)
-    return std::string();
+  if (olen < len)
+    return std::string();
+
+  std::string outStr = "";
+  outStr.resize(olen);
+  out = (unsigned char *)&outStr[0];
+
+  end = src + len;
+  in = src;
+  pos = out;
+
+  while (end - in >= 3)
+  {
+    *pos++ = base64_table[in[0] >> 2];
+    *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+    *pos++ = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+    *pos++ = base64_table[in[2] & 0x3f];
+    in += 3;
+  }
+
+  if (end - in)
+  {
+    *pos++ = base64_table[in[0] >> 2];
+    if (end - in == 1)
+    {
+      *pos++ = base64_table[(in[0] & 0x03) << 4];
+      *pos++ = '=';
+    }
+    else
+    {
+      *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+      *pos++ = base64_table[(in[1] & 0x0f) << 2];
+    }
+    *pos++ = '=';
+  }
+
+  return outStr;
+}
+
+size_t ESP32_MailClient::qpEncodeEmit(qpEncoderState &qp, unsigned char c, bool encode, char *out)
+{
+  size_t n = 0;
+
+  //soft line break, the encoded line including '=' should not exceed 76 characters
+  if (qp.lineLength + (encode ? 3 : 1) > 75)
+  {
+    out[n++] = '=';
+    out[n++] = '\r';
+    out[n++] = '\n';
+    qp.lineLength = 0;
+  }
+
+  //a dot at the line beginning could be taken as the end of data
+  if (c == '.' && qp.lineLength == 0)
+    encode = true;
+
+  if (encode)
+  {
+    out[n++] = '=';
+    out[n++] = qp_hex_table[c >> 4];
+    out[n++] = qp_hex_table[c & 0x0f];
+    qp.lineLength += 3;
+  }
+  else
+  {
+    out[n++] = c;
+    qp.lineLength++;
+  }
+
+  return n;
+}
+
+size_t ESP32_MailClient::qpEncodeChar(qpEncoderState &qp, char c, char *out)
+{
+  size_t n = 0;
+  unsigned char uc = (unsigned char)c;
+
+  if (qp.cr)
+  {
+    qp.cr = false;
+    if (c != '\n')
+    {
+      //bare CR is not a line break
+      if (qp.whitespace)
+      {
+        n += qpEncodeEmit(qp, qp.whitespace, false, out + n);
+        qp.whitespace = 0;
+      }
+      n += qpEncodeEmit(qp, '\r', true, out + n);
+    }
+  }
+
+  if (c == '\r')
+  {
+    qp.cr = true;
+    return n;
+  }
+
+  if (c == '\n')
+  {
+    //whitespace before the line break should be encoded
+    if (qp.whitespace)
+    {
+      n += qpEncodeEmit(qp, qp.whitespace, true, out + n);
+      qp.whitespace = 0;
+    }
+    out[n++] = '\r';
+    out[n++] = '\n';
+    qp.lineLength = 0;
+    return n;
+  }
+
+  if (qp.whitespace)
+  {
+    n += qpEncodeEmit(qp, qp.whitespace, false, out + n);
+    qp.whitespace = 0;
+  }
+
+  if (c == ' ' || c == '\t')
+  {
+    qp.whitespace = c;
+    return n;
+  }
+
+  n += qpEncodeEmit(qp, uc, uc < 33 || uc > 126 || c == '=', out + n);
+  return n;
+}
+
+size_t ESP32_MailClient::qpEncodeFlush(qpEncoderState &qp, char *out)
+{
+  size_t n = 0;
+
+  if (qp.cr)
+  {
+    qp.cr = false;
+    if (qp.whitespace)
+    {
+      n += qpEncodeEmit(qp, qp.whitespace, false, out + n);
+      qp.whitespace = 0;
+    }
+    n += qpEncodeEmit(qp, '\r', true, out + n);
+  }
+
+  if (qp.whitespace)
+  {
+    n += qpEncodeEmit(qp, qp.whitespace, true, out + n);
+    qp.whitespace = 0;
+  }
+
+  return n;
+}
+
+void ESP32_MailClient::send_qp_encode_data(SMTPData &smtpData, qpEncoderState &qp, const char *src, size_t len, bool final)
+{
+  //the longest output of one input character is 16 bytes (bare CR, whitespace and encoded character with soft breaks)
+  size_t chunkSize = 936;
+  size_t byteAdd = 0;
+  char *buf = new char[chunkSize];
+
+  for (size_t i = 0; i < len; i++)
+  {
+    byteAdd += qpEncodeChar(qp, src[i], buf + byteAdd);
+    if (byteAdd >= chunkSize - 16)
+    {
+      smtpSendData(smtpData, (const uint8_t *)buf, byteAdd);
+      byteAdd = 0;
+    }
+  }
+
+  if (final)
+    byteAdd += qpEncodeFlush(qp, buf + byteAdd);
+
+  if (byteAdd > 0)
+    smtpSendData(smtpData, (const uint8_t *)buf, byteAdd);
+
+  delete[] buf;
+}
+
+bool ESP32_MailClient::hasLongLine(const std::string &text, size_t limit)
+{
+  size_t start = 0;
+  size_t p = 0;
+
+  while ((p = text.find('\n', start)) != std::string::npos)
+  {
+    if (p - start - (p > start && text[p - 1] == '\r' ? 1 : 0) > limit)
+      return true;
+    start = p + 1;
+  }
+
+  return text.length() - start > limit;
+}
 
-  std::string outStr = "";
-  outStr.resize(olen);
-  out = (unsigned char *)&outStr[0];
+void ESP32_MailClient::smtpSendData(SMTPData &smtpData, const char *data)
+{
+  smtpSendData(smtpData, (const uint8_t *)data, strlen(data));
+}
 
-  end = src + len;
-  in = src;
-  pos = out;
+void ESP32_MailClient::smtpSendData(SMTPData &smtpData, const uint8_t *data, size_t len)
+{
+  size_t n = 0;
 
-  while (end - in >= 3)
+  if (!smtpData._bdat)
   {
-    *pos++ = base64_table[in[0] >> 2];
-    *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
-    *pos++ = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
-    *pos++ = base64_table[in[2] & 0x3f];
-    in += 3;
+    //DATA transparency (RFC 5321 section 4.5.2), double the dot at the beginning of line
+    for (size_t i = 0; i < len; i++)
+    {
+      if (smtpData._lineStart && data[i] == '.')
+      {
+        smtpData._net->getStreamPtr()->write(data + n, i - n);
+        smtpData._net->getStreamPtr()->write('.');
+        n = i;
+      }
+      smtpData._lineStart = data[i] == '\n';
+    }
+
+    if (len > n)
+      smtpData._net->getStreamPtr()->write(data + n, len - n);
+    return;
   }
 
-  if (end - in)
+  while (len > 0 && !smtpData._chunkError)
   {
-    *pos++ = base64_table[in[0] >> 2];
-    if (end - in == 1)
+    //large data goes out as its own chunk without copying
+    if (smtpData._chunkLength == 0 && len >= BDAT_CHUNK_SIZE)
     {
-      *pos++ = base64_table[(in[0] & 0x03) << 4];
-      *pos++ = '=';
+      if (sendBDATChunk(smtpData, data, len, false) != 250)
+        smtpData._chunkError = true;
+      return;
     }
-    else
+
+    n = BDAT_CHUNK_SIZE - smtpData._chunkLength;
+    if (n > len)
+      n = len;
+    memcpy(smtpData._chunkBuf + smtpData._chunkLength, data, n);
+    smtpData._chunkLength += n;
+    data += n;
+    len -= n;
+
+    if (smtpData._chunkLength == BDAT_CHUNK_SIZE)
     {
-      *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
-      *pos++ = base64_table[(in[1] & 0x0f) << 2];
+      if (sendBDATChunk(smtpData, smtpData._chunkBuf, smtpData._chunkLength, false) != 250)
+        smtpData._chunkError = true;
+      smtpData._chunkLength = 0;
     }
-    *pos++ = '=';
   }
+}
 
-  return outStr;
+int ESP32_MailClient::sendBDATChunk(SMTPData &smtpData, const uint8_t *data, size_t len, bool last)
+{
+  std::string cmd = ESP32_MAIL_STR_321;
+  char *_val = new char[20];
+  memset(_val, 0, 20);
+  ultoa(len, _val, 10);
+
+  cmd += _val;
+  if (last)
+    cmd += ESP32_MAIL_STR_322;
+
+  smtpData._net->getStreamPtr()->println(cmd.c_str());
+  if (len > 0)
+    smtpData._net->getStreamPtr()->write(data, len);
+
+  delete[] _val;
+  std::string().swap(cmd);
+
+  return waitSMTPResponse(smtpData);
 }
 
-void ESP32_MailClient::send_base64_encode_mime_data(WiFiClient *client, const unsigned char *src, size_t len)
+void ESP32_MailClient::send_base64_encode_mime_data(SMTPData &smtpData, const unsigned char *src, size_t len)
 {
 
   const unsigned char *end, *in;
@@ -3491,7 +5206,7 @@ void ESP32_MailClient::send_base64_encode_mime_data(WiFiClient *client, const un
     if (byteAdd >= chunkSize - 4)
     {
       byteSent += byteAdd;
-      client->write(buf, byteAdd);
+      smtpSendData(smtpData, buf, byteAdd);
       memset(buf, 0, chunkSize);
       byteAdd = 0;
     }
@@ -3499,7 +5214,7 @@ void ESP32_MailClient::send_base64_encode_mime_data(WiFiClient *client, const un
   }
 
   if (byteAdd > 0)
-    client->write(buf, byteAdd);
+    smtpSendData(smtpData, buf, byteAdd);
 
   if (end - in)
   {
@@ -3519,13 +5234,13 @@ void ESP32_MailClient::send_base64_encode_mime_data(WiFiClient *client, const un
     }
     buf[byteAdd++] = '=';
 
-    client->write(buf, byteAdd);
+    smtpSendData(smtpData, buf, byteAdd);
     memset(buf, 0, chunkSize);
   }
   delete[] buf;
 }
 
-void ESP32_MailClient::send_base64_encode_mime_file(WiFiClient *client, File file)
+void ESP32_MailClient::send_base64_encode_mime_file(SMTPData &smtpData, File file)
 {
 
   if (!file)
@@ -3567,7 +5282,7 @@ void ESP32_MailClient::send_base64_encode_mime_file(WiFiClient *client, File fil
       if (byteAdd >= chunkSize - 4)
       {
         byteSent += byteAdd;
-        client->write(buf, byteAdd);
+        smtpSendData(smtpData, buf, byteAdd);
         memset(buf, 0, chunkSize);
         byteAdd = 0;
       }
@@ -3590,7 +5305,7 @@ void ESP32_MailClient::send_base64_encode_mime_file(WiFiClient *client, File fil
 
   file.close();
   if (byteAdd > 0)
-    client->write(buf, byteAdd);
+    smtpSendData(smtpData, buf, byteAdd);
 
   if (len - fbufIndex > 0)
   {
@@ -3608,12 +5323,39 @@ void ESP32_MailClient::send_base64_encode_mime_file(WiFiClient *client, File fil
       buf[byteAdd++] = base64_table[(fbuf[1] & 0x0f) << 2];
     }
     buf[byteAdd++] = '=';
-    client->write(buf, byteAdd);
+    smtpSendData(smtpData, buf, byteAdd);
   }
   delete[] buf;
   delete[] fbuf;
 }
 
+void ESP32_MailClient::send_binary_mime_file(SMTPData &smtpData, File file)
+{
+  int n = 0;
+
+  if (!file)
+    return;
+
+  //read the file straight into the BDAT chunk buffer
+  while (file.available() && !smtpData._chunkError)
+  {
+    if (smtpData._chunkLength == BDAT_CHUNK_SIZE)
+    {
+      if (sendBDATChunk(smtpData, smtpData._chunkBuf, smtpData._chunkLength, false) != 250)
+        smtpData._chunkError = true;
+      smtpData._chunkLength = 0;
+      continue;
+    }
+
+    n = file.read(smtpData._chunkBuf + smtpData._chunkLength, BDAT_CHUNK_SIZE - smtpData._chunkLength);
+    if (n <= 0)
+      break;
+    smtpData._chunkLength += n;
+  }
+
+  file.close();
+}
+
 IMAPData::IMAPData() {}
 IMAPData::~IMAPData()
 {
@@ -3635,10 +5377,21 @@ void IMAPData::setLogin(const String &host, uint16_t port, const String &loginEm
   _loginPassword = loginPassword.c_str();
 
   _rootCA.clear();
+  _rootCALength = 0;
   if (strlen(rootCA) > 0)
     _rootCA.push_back((char *)rootCA);
 }
 
+void IMAPData::setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const uint8_t *rootCA, size_t rootCALength)
+{
+  setLogin(host, port, loginEmail, loginPassword);
+
+  _rootCA.clear();
+  _rootCALength = rootCALength;
+  if (rootCALength > 0)
+    _rootCA.push_back((const char *)rootCA);
+}
+
 void IMAPData::setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword)
 {
   _host.clear();
@@ -3656,6 +5409,26 @@ void IMAPData::setSTARTTLS(bool starttls)
   _starttls = starttls;
 }
 
+void IMAPData::setSessionCache(bool enable)
+{
+  _net->setSessionCache(enable);
+}
+
+bool IMAPData::setMaxFragmentLength(uint16_t length)
+{
+  return _net->setMaxFragmentLength(length);
+}
+
+void IMAPData::setConnectIdleCallback(ConnectIdleCallback cb)
+{
+  _net->setIdleCallback(cb);
+}
+
+void IMAPData::setCipherProfile(int profile)
+{
+  _net->setCipherProfile(profile);
+}
+
 void IMAPData::setDebug(bool debug)
 {
   _debug = debug;
@@ -3671,6 +5444,12 @@ void IMAPData::setMessageBufferSize(size_t size)
   _message_buffer_size = size;
 }
 
+void IMAPData::setMessageRange(size_t offset, size_t length)
+{
+  _messageOffset = offset;
+  _messageLength = length;
+}
+
 void IMAPData::setAttachmentSizeLimit(size_t size)
 {
   _attacement_max_size = size;
@@ -3765,11 +5544,120 @@ void IMAPData::setReadCallback(readStatusCallback readCallback)
   _readCallback = std::move(readCallback);
 }
 
+void IMAPData::setUTF8Conversion(bool convert)
+{
+  _utf8Conversion = convert;
+}
+
 void IMAPData::setDownloadReport(bool report)
 {
   _downloadReport = report;
 }
 
+void IMAPData::setResumeDownload(bool resume)
+{
+  _resumeDownload = resume;
+}
+
+void IMAPData::setAttachmentCallback(attachmentDataCallback attachmentCallback)
+{
+  _attachmentCallback = std::move(attachmentCallback);
+}
+
+void IMAPData::stopAttachmentDownload()
+{
+  _attachmentAbort = true;
+}
+
+void IMAPData::setAttachmentStream(Stream *stream)
+{
+  _attachmentStream = stream;
+}
+
+void IMAPData::setAttachmentBuffer(uint8_t *buf, size_t size)
+{
+  _attachmentBuffer = buf;
+  _attachmentBufferSize = size;
+  _attachmentBufferLength = 0;
+}
+
+size_t IMAPData::getAttachmentBufferLength()
+{
+  return _attachmentBufferLength;
+}
+
+void IMAPData::setIncrementalSync(bool sync, const String &stateFile)
+{
+  _incrementalSync = sync;
+  _syncFile = stateFile.c_str();
+}
+
+void IMAPData::setNewMessageOnly(bool newOnly, const String &lastNextUID, const String &lastUIDValidity)
+{
+  _newMessageOnly = newOnly;
+  if (lastNextUID.length() > 0)
+  {
+    _lastNextUID = lastNextUID.c_str();
+    _lastUIDValidity = lastUIDValidity.c_str();
+  }
+}
+
+bool IMAPData::syncReset()
+{
+  return _syncReset;
+}
+
+size_t IMAPData::getChangedCount()
+{
+  return _changedUID.size();
+}
+
+uint32_t IMAPData::getChangedUID(size_t index)
+{
+  if (index < _changedUID.size())
+    return _changedUID[index];
+  return 0;
+}
+
+String IMAPData::getChangedFlags(size_t index)
+{
+  if (index < _changedFlags.size())
+    return _changedFlags[index].c_str();
+  return std::string().c_str();
+}
+
+size_t IMAPData::getVanishedCount()
+{
+  return _vanishedUID.size();
+}
+
+uint32_t IMAPData::getVanishedUID(size_t index)
+{
+  if (index < _vanishedUID.size())
+    return _vanishedUID[index];
+  return 0;
+}
+
+String IMAPData::getUIDValidity()
+{
+  return _uidValidity.c_str();
+}
+
+String IMAPData::getNextUID()
+{
+  return _nextUID.c_str();
+}
+
+String IMAPData::getLastNextUID()
+{
+  return _lastNextUID.c_str();
+}
+
+String IMAPData::getHighestModSeq()
+{
+  return _highestModSeq.c_str();
+}
+
 uint16_t IMAPData::getFolderCount()
 {
   return _folders.size();
@@ -3809,25 +5697,25 @@ size_t IMAPData::availableMessages()
 
 size_t IMAPData::getAttachmentCount(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _attachmentCount[messageIndex];
+  if (messageIndex < _message.size())
+    return _message[messageIndex]._attachmentCount;
   return 0;
 }
 
 String IMAPData::getAttachmentFileName(size_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._filename.c_str();
+            return _message[messageIndex]._messageDataInfo[i]._filename.c_str();
           id++;
         }
       }
@@ -3843,18 +5731,18 @@ String IMAPData::getAttachmentFileName(size_t messageIndex, size_t attachmentInd
 
 String IMAPData::getAttachmentName(size_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._name.c_str();
+            return _message[messageIndex]._messageDataInfo[i]._name.c_str();
           id++;
         }
       }
@@ -3870,18 +5758,18 @@ String IMAPData::getAttachmentName(size_t messageIndex, size_t attachmentIndex)
 
 int IMAPData::getAttachmentFileSize(size_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._size;
+            return _message[messageIndex]._messageDataInfo[i]._size;
           id++;
         }
       }
@@ -3897,18 +5785,18 @@ int IMAPData::getAttachmentFileSize(size_t messageIndex, size_t attachmentIndex)
 
 String IMAPData::getAttachmentCreationDate(size_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._creation_date.c_str();
+            return _message[messageIndex]._messageDataInfo[i]._creation_date.c_str();
           id++;
         }
       }
@@ -3924,18 +5812,18 @@ String IMAPData::getAttachmentCreationDate(size_t messageIndex, size_t attachmen
 
 String IMAPData::getAttachmentType(size_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._contentType.c_str();
+            return _message[messageIndex]._messageDataInfo[i]._contentType.c_str();
           id++;
         }
       }
@@ -3949,55 +5837,78 @@ String IMAPData::getAttachmentType(size_t messageIndex, size_t attachmentIndex)
   return std::string().c_str();
 }
 
+bool IMAPData::headerArenaReserve(size_t length)
+{
+  if (_headerArenaLength + length <= _headerArenaSize)
+    return true;
+
+  size_t size = _headerArenaSize;
+  while (size < _headerArenaLength + length)
+    size += HEADER_ARENA_BLOCK_SIZE;
+
+  //The header values are referenced by offset, the arena can be moved when it grows
+  char *arena = (char *)realloc(_headerArena, size);
+  if (!arena)
+    return false;
+
+  _headerArena = arena;
+  _headerArenaSize = size;
+  return true;
+}
+
+const char *IMAPData::getHeaderField(uint16_t messageIndex, uint8_t field)
+{
+  if (messageIndex < _message.size() && field < MAX_HEADER_FIELD && _message[messageIndex]._header[field].length > 0)
+  {
+    headerArenaSlice &slice = _message[messageIndex]._header[field];
+
+    //Decode to the top of arena as the text converted to UTF-8 can be up to three times longer, and keep the result
+    if (slice.encoded && headerArenaReserve(slice.length * 3 + 1))
+    {
+      slice.length = RFC2047Decoder.rfc2047Decode(_headerArena + _headerArenaLength, _headerArena + slice.offset, slice.length * 3 + 1);
+      slice.offset = _headerArenaLength;
+      _headerArenaLength += slice.length + 1;
+      slice.encoded = false;
+    }
+
+    return _headerArena + slice.offset;
+  }
+  return "";
+}
+
 String IMAPData::getFrom(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _from[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::FROM);
 }
 
 String IMAPData::getFromCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _from_charset[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::FROM_CHARSET);
 }
 String IMAPData::getTo(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _to[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::TO);
 }
 String IMAPData::getToCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _to_charset[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::TO_CHARSET);
 }
 String IMAPData::getCC(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _cc[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::CC);
 }
 String IMAPData::getCCCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _cc_charset[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::CC_CHARSET);
 }
 
 String IMAPData::getSubject(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _subject[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::SUBJECT);
 }
 String IMAPData::getSubjectCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _subject_charset[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::SUBJECT_CHARSET);
 }
 String IMAPData::getHTMLMessage(uint16_t messageIndex)
 {
@@ -4015,18 +5926,18 @@ String IMAPData::getTextMessage(uint16_t messageIndex)
 
 String IMAPData::getMessage(uint16_t messageIndex, bool htmlFormat)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
 
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._contentType == ESP32_MAIL_STR_155 && !htmlFormat)
-          return _messageDataInfo[messageIndex][i]._text.c_str();
-        else if (_messageDataInfo[messageIndex][i]._contentType == ESP32_MAIL_STR_154 && htmlFormat)
-          return _messageDataInfo[messageIndex][i]._text.c_str();
+        if (_message[messageIndex]._messageDataInfo[i]._contentType == ESP32_MAIL_STR_155 && !htmlFormat)
+          return _message[messageIndex]._messageDataInfo[i]._text.c_str();
+        else if (_message[messageIndex]._messageDataInfo[i]._contentType == ESP32_MAIL_STR_154 && htmlFormat)
+          return _message[messageIndex]._messageDataInfo[i]._text.c_str();
       }
       return std::string().c_str();
     }
@@ -4041,16 +5952,16 @@ String IMAPData::getMessage(uint16_t messageIndex, bool htmlFormat)
 
 String IMAPData::getHTMLMessgaeCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
 
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._contentType == ESP32_MAIL_STR_154)
-          return _messageDataInfo[messageIndex][i]._charset.c_str();
+        if (_message[messageIndex]._messageDataInfo[i]._contentType == ESP32_MAIL_STR_154)
+          return _message[messageIndex]._messageDataInfo[i]._charset.c_str();
       }
       return std::string().c_str();
     }
@@ -4065,16 +5976,16 @@ String IMAPData::getHTMLMessgaeCharset(uint16_t messageIndex)
 
 String IMAPData::getTextMessgaeCharset(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
 
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._contentType == ESP32_MAIL_STR_155)
-          return _messageDataInfo[messageIndex][i]._charset.c_str();
+        if (_message[messageIndex]._messageDataInfo[i]._contentType == ESP32_MAIL_STR_155)
+          return _message[messageIndex]._messageDataInfo[i]._charset.c_str();
       }
       return std::string().c_str();
     }
@@ -4089,9 +6000,7 @@ String IMAPData::getTextMessgaeCharset(uint16_t messageIndex)
 
 String IMAPData::getDate(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _date[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::DATE);
 }
 
 String IMAPData::getUID(uint16_t messageIndex)
@@ -4129,51 +6038,45 @@ String IMAPData::getNumber(uint16_t messageIndex)
 
 String IMAPData::getMessageID(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _msgID[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::MSG_ID);
 }
 
 String IMAPData::getAcceptLanguage(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _acceptLanguage[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::ACCEPT_LANG);
 }
 String IMAPData::getContentLanguage(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _contentLanguage[messageIndex].c_str();
-  return std::string().c_str();
+  return getHeaderField(messageIndex, MailClientHeaderField::CONT_LANG);
 }
 
 bool IMAPData::isFetchMessageFailed(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _error[messageIndex];
+  if (messageIndex < _message.size())
+    return _message[messageIndex]._error;
   return false;
 }
 String IMAPData::getFetchMessageFailedReason(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
-    return _errorMsg[messageIndex].c_str();
+  if (messageIndex < _message.size())
+    return _message[messageIndex]._errorMsg.c_str();
   return std::string().c_str();
 }
 
 bool IMAPData::isDownloadAttachmentFailed(uint16_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._error;
+            return _message[messageIndex]._messageDataInfo[i]._error;
           id++;
         }
       }
@@ -4189,18 +6092,18 @@ bool IMAPData::isDownloadAttachmentFailed(uint16_t messageIndex, size_t attachme
 
 String IMAPData::getDownloadAttachmentFailedReason(uint16_t messageIndex, size_t attachmentIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     int id = 0;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == ESP32_MAIL_STR_153)
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == ESP32_MAIL_STR_153)
         {
           if (attachmentIndex == id)
-            return _messageDataInfo[messageIndex][i]._downloadError.c_str();
+            return _message[messageIndex]._messageDataInfo[i]._downloadError.c_str();
           id++;
         }
       }
@@ -4215,17 +6118,17 @@ String IMAPData::getDownloadAttachmentFailedReason(uint16_t messageIndex, size_t
 
 bool IMAPData::isDownloadMessageFailed(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     bool res = false;
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == "")
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == "")
         {
-          res |= _messageDataInfo[messageIndex][i]._error;
+          res |= _message[messageIndex]._messageDataInfo[i]._error;
         }
       }
 
@@ -4241,18 +6144,18 @@ bool IMAPData::isDownloadMessageFailed(uint16_t messageIndex)
 }
 String IMAPData::getDownloadMessageFailedReason(uint16_t messageIndex)
 {
-  if (messageIndex < _msgNum.size())
+  if (messageIndex < _message.size())
   {
-    int s = _messageDataInfo[messageIndex].size();
+    int s = _message[messageIndex]._messageDataInfo.size();
     string res = "";
     if (s > 0)
     {
       for (int i = 0; i < s; i++)
       {
-        if (_messageDataInfo[messageIndex][i]._disposition == "")
+        if (_message[messageIndex]._messageDataInfo[i]._disposition == "")
         {
-          if (_messageDataInfo[messageIndex][i]._downloadError != "")
-            res = _messageDataInfo[messageIndex][i]._downloadError;
+          if (_message[messageIndex]._messageDataInfo[i]._downloadError != "")
+            res = _message[messageIndex]._messageDataInfo[i]._downloadError;
         }
       }
 
@@ -4275,56 +6178,59 @@ void IMAPData::empty()
   std::string().swap(_currentFolder);
   std::string().swap(_nextUID);
   std::string().swap(_searchCriteria);
-  std::vector<std::string>().swap(_date);
-  std::vector<std::string>().swap(_subject);
-  std::vector<std::string>().swap(_subject_charset);
-  std::vector<std::string>().swap(_from);
-  std::vector<std::string>().swap(_from_charset);
-  std::vector<std::string>().swap(_to);
-  std::vector<std::string>().swap(_to_charset);
-  std::vector<std::string>().swap(_cc);
-  std::vector<std::string>().swap(_cc_charset);
+  free(_headerArena);
+  _headerArena = nullptr;
+  _headerArenaSize = 0;
+  _headerArenaLength = 0;
+  std::vector<messageRecord>().swap(_message);
   std::vector<uint32_t>().swap(_msgNum);
   std::vector<std::string>().swap(_folders);
   std::vector<std::string>().swap(_flag);
-  std::vector<std::string>().swap(_msgID);
-  std::vector<std::string>().swap(_acceptLanguage);
-  std::vector<std::string>().swap(_contentLanguage);
-  std::vector<int>().swap(_attachmentCount);
-  std::vector<int>().swap(_totalAttachFileSize);
-  std::vector<int>().swap(_downloadedByte);
-  std::vector<bool>().swap(_error);
-  std::vector<std::vector<messageBodyData>>().swap(_messageDataInfo);
-  std::vector<std::string>().swap(_errorMsg);
+  std::vector<uint32_t>().swap(_changedUID);
+  std::vector<std::string>().swap(_changedFlags);
+  std::vector<uint32_t>().swap(_vanishedUID);
+  std::string().swap(_syncFile);
+  std::string().swap(_syncFolder);
+  std::string().swap(_syncUIDValidity);
+  std::string().swap(_syncNextUID);
+  std::string().swap(_syncModSeq);
+  std::string().swap(_uidValidity);
+  std::string().swap(_highestModSeq);
+  std::string().swap(_lastNextUID);
+  std::string().swap(_lastUIDValidity);
 }
 
 void IMAPData::clearMessageData()
 {
-  std::vector<std::string>().swap(_date);
-  std::vector<std::string>().swap(_subject);
-  std::vector<std::string>().swap(_subject_charset);
-  std::vector<std::string>().swap(_from);
-  std::vector<std::string>().swap(_from_charset);
-  std::vector<std::string>().swap(_to);
-  std::vector<std::string>().swap(_to_charset);
-  std::vector<std::string>().swap(_cc);
-  std::vector<std::string>().swap(_cc_charset);
+  free(_headerArena);
+  _headerArena = nullptr;
+  _headerArenaSize = 0;
+  _headerArenaLength = 0;
+  std::vector<messageRecord>().swap(_message);
   std::vector<uint32_t>().swap(_msgNum);
-  std::vector<std::string>().swap(_msgID);
-  std::vector<std::string>().swap(_contentLanguage);
-  std::vector<std::string>().swap(_acceptLanguage);
   std::vector<std::string>().swap(_folders);
   std::vector<std::string>().swap(_flag);
-  std::vector<int>().swap(_attachmentCount);
-  std::vector<std::vector<messageBodyData>>().swap(_messageDataInfo);
-  std::vector<int>().swap(_totalAttachFileSize);
-  std::vector<int>().swap(_downloadedByte);
-  std::vector<int>().swap(_messageDataCount);
-  std::vector<std::string>().swap(_errorMsg);
-  std::vector<bool>().swap(_error);
+  std::vector<uint32_t>().swap(_changedUID);
+  std::vector<std::string>().swap(_changedFlags);
+  std::vector<uint32_t>().swap(_vanishedUID);
   _searchCount = 0;
 }
 
+messageRecord::messageRecord()
+{
+}
+
+messageRecord::~messageRecord()
+{
+  empty();
+}
+
+void messageRecord::empty()
+{
+  std::string().swap(_errorMsg);
+  std::vector<messageBodyData>().swap(_messageDataInfo);
+}
+
 messageBodyData::messageBodyData()
 {
 }
@@ -4460,10 +6366,21 @@ void SMTPData::setLogin(const String &host, uint16_t port, const String &loginEm
   _loginPassword = loginPassword.c_str();
 
   _rootCA.clear();
+  _rootCALength = 0;
   if (strlen(rootCA) > 0)
     _rootCA.push_back((char *)rootCA);
 }
 
+void SMTPData::setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const uint8_t *rootCA, size_t rootCALength)
+{
+  setLogin(host, port, loginEmail, loginPassword);
+
+  _rootCA.clear();
+  _rootCALength = rootCALength;
+  if (rootCALength > 0)
+    _rootCA.push_back((const char *)rootCA);
+}
+
 void SMTPData::setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword)
 {
 
@@ -4484,6 +6401,26 @@ void SMTPData::setSTARTTLS(bool starttls)
   _starttls = starttls;
 }
 
+void SMTPData::setSessionCache(bool enable)
+{
+  _net->setSessionCache(enable);
+}
+
+bool SMTPData::setMaxFragmentLength(uint16_t length)
+{
+  return _net->setMaxFragmentLength(length);
+}
+
+void SMTPData::setConnectIdleCallback(ConnectIdleCallback cb)
+{
+  _net->setIdleCallback(cb);
+}
+
+void SMTPData::setCipherProfile(int profile)
+{
+  _net->setCipherProfile(profile);
+}
+
 void SMTPData::setDebug(bool debug)
 {
   _debug = debug;
@@ -4588,6 +6525,11 @@ bool SMTPData::htmlFormat()
 {
   return _htmlFormat;
 }
+
+void SMTPData::setMessageEncoding(uint8_t encoding)
+{
+  _messageEncoding = encoding;
+}
 void SMTPData::addCC(const String &email)
 {
   _cc.push_back(email.c_str());
@@ -4839,6 +6781,49 @@ void ReadStatus::empty()
   std::string().swap(_status);
 }
 
+AttachmentChunk::AttachmentChunk()
+{
+}
+
+AttachmentChunk::~AttachmentChunk()
+{
+}
+
+int AttachmentChunk::mailIndex()
+{
+  return _mailIndex;
+}
+
+int AttachmentChunk::attachmentIndex()
+{
+  return _attachmentIndex;
+}
+
+const uint8_t *AttachmentChunk::data()
+{
+  return _data;
+}
+
+size_t AttachmentChunk::length()
+{
+  return _length;
+}
+
+size_t AttachmentChunk::offset()
+{
+  return _offset;
+}
+
+size_t AttachmentChunk::totalSize()
+{
+  return _totalSize;
+}
+
+bool AttachmentChunk::isFinal()
+{
+  return _final;
+}
+
 SendStatus::SendStatus()
 {
 }
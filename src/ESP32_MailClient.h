@@ -44,12 +44,14 @@
 #include <FS.h>
 #include <SPIFFS.h>
 #include "RFC2047.h"
+#include "CharsetConverter.h"
 #include "ESP32MailHTTPClient.h"
 #include "ESP32TimeHelper.h"
 
 #define FORMAT_SPIFFS_IF_FAILED true
 
 static RFC2047 RFC2047Decoder;
+static CharsetConverter CharsetDecoder;
 
 using namespace std;
 
@@ -69,18 +71,34 @@ using namespace std;
 #define IMAP_STATUS_LOGIN_FAILED 3
 #define IMAP_STATUS_BAD_COMMAND 4
 #define IMAP_STATUS_PARSE_FLAG_FAILED 5
+#define IMAP_STATUS_NO_MESSAGE_UID 6
+#define IMAP_STATUS_ATTACHMENT_WRITE_FAILED 7
 
 #define MAIL_CLIENT_STATUS_WIFI_CONNECT_FAIL 100
 
 #define MAX_EMAIL_SEARCH_LIMIT 1000
+#define DOWNLOAD_CHECKPOINT_INTERVAL 16384
+#define BDAT_CHUNK_SIZE 8192
+#define HEADER_ARENA_BLOCK_SIZE 1024
+#define MAX_HEADER_FIELD 12
+
+#define IMAP_CAP_CHECKED 0x01
+#define IMAP_CAP_CONDSTORE 0x02
+#define IMAP_CAP_QRESYNC 0x04
+#define IMAP_CAP_ESEARCH 0x08
+#define IMAP_CAP_PARTIAL 0x10
+#define IMAP_CAP_CONTEXT 0x20
 
 static const unsigned char base64_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char qp_hex_table[17] = "0123456789ABCDEF";
 
+class ESP32_MailClient;
 class IMAPData;
 class SMTPData;
 class attachmentData;
 class SendStatus;
 class messageBodyData;
+class messageRecord;
 class DownloadProgress;
 class MessageData;
 
@@ -90,6 +108,42 @@ struct MailClientStorageType
   static const uint8_t SD = 1;
 };
 
+struct MailClientHeaderField
+{
+  static const uint8_t MSG_ID = 0;
+  static const uint8_t FROM = 1;
+  static const uint8_t FROM_CHARSET = 2;
+  static const uint8_t TO = 3;
+  static const uint8_t TO_CHARSET = 4;
+  static const uint8_t CC = 5;
+  static const uint8_t CC_CHARSET = 6;
+  static const uint8_t SUBJECT = 7;
+  static const uint8_t SUBJECT_CHARSET = 8;
+  static const uint8_t DATE = 9;
+  static const uint8_t ACCEPT_LANG = 10;
+  static const uint8_t CONT_LANG = 11;
+};
+
+struct qpDecoderState
+{
+  uint8_t state = 0;
+  char hex = 0;
+};
+
+struct qpEncoderState
+{
+  size_t lineLength = 0;
+  char whitespace = 0;
+  bool cr = false;
+};
+
+struct headerArenaSlice
+{
+  size_t offset = 0;
+  size_t length = 0;
+  bool encoded = false;
+};
+
 static const char ESP32_MAIL_STR_1[] PROGMEM = "Content-Type: multipart/mixed; boundary=\"";
 static const char ESP32_MAIL_STR_2[] PROGMEM = "{BOUNDARY}";
 static const char ESP32_MAIL_STR_3[] PROGMEM = "Mime-Version: 1.0\r\n";
@@ -348,6 +402,73 @@ static const char ESP32_MAIL_STR_254[] PROGMEM = "INFO: add FLAG";
 static const char ESP32_MAIL_STR_255[] PROGMEM = "INFO: remove FLAG";
 static const char ESP32_MAIL_STR_256[] PROGMEM = "could not parse flag";
 static const char ESP32_MAIL_STR_257[] PROGMEM = "BAD";
+static const char ESP32_MAIL_STR_258[] PROGMEM = " FLAGS.SILENT (";
+static const char ESP32_MAIL_STR_259[] PROGMEM = " +FLAGS.SILENT (";
+static const char ESP32_MAIL_STR_260[] PROGMEM = " -FLAGS.SILENT (";
+static const char ESP32_MAIL_STR_261[] PROGMEM = "no message UID";
+static const char ESP32_MAIL_STR_262[] PROGMEM = ":";
+static const char ESP32_MAIL_STR_263[] PROGMEM = ",";
+static const char ESP32_MAIL_STR_264[] PROGMEM = "$ CAPABILITY";
+static const char ESP32_MAIL_STR_265[] PROGMEM = " CONDSTORE";
+static const char ESP32_MAIL_STR_266[] PROGMEM = " QRESYNC";
+static const char ESP32_MAIL_STR_267[] PROGMEM = "$ ENABLE QRESYNC";
+static const char ESP32_MAIL_STR_268[] PROGMEM = " (CONDSTORE)";
+static const char ESP32_MAIL_STR_269[] PROGMEM = " [UIDVALIDITY ";
+static const char ESP32_MAIL_STR_270[] PROGMEM = " [HIGHESTMODSEQ ";
+static const char ESP32_MAIL_STR_271[] PROGMEM = " (UID FLAGS) (CHANGEDSINCE ";
+static const char ESP32_MAIL_STR_272[] PROGMEM = " VANISHED";
+static const char ESP32_MAIL_STR_273[] PROGMEM = "* VANISHED ";
+static const char ESP32_MAIL_STR_274[] PROGMEM = "FLAGS (";
+static const char ESP32_MAIL_STR_275[] PROGMEM = "(EARLIER) ";
+static const char ESP32_MAIL_STR_276[] PROGMEM = "$ UID SEARCH UID ";
+static const char ESP32_MAIL_STR_277[] PROGMEM = "INFO: send imap command CAPABILITY";
+static const char ESP32_MAIL_STR_278[] PROGMEM = "INFO: send imap command ENABLE";
+static const char ESP32_MAIL_STR_279[] PROGMEM = "INFO: incremental sync";
+static const char ESP32_MAIL_STR_280[] PROGMEM = "INFO: fetch changed flags";
+static const char ESP32_MAIL_STR_281[] PROGMEM = "Incremental sync, new messages: ";
+static const char ESP32_MAIL_STR_282[] PROGMEM = "Incremental sync, changed messages: ";
+static const char ESP32_MAIL_STR_283[] PROGMEM = "Incremental sync, vanished messages: ";
+static const char ESP32_MAIL_STR_284[] PROGMEM = "Sync state not found or UIDVALIDITY changed, full sync";
+static const char ESP32_MAIL_STR_287[] PROGMEM = "No new message since UID ";
+static const char ESP32_MAIL_STR_288[] PROGMEM = "New messages since UID ";
+static const char ESP32_MAIL_STR_289[] PROGMEM = " ESEARCH";
+static const char ESP32_MAIL_STR_290[] PROGMEM = " PARTIAL";
+static const char ESP32_MAIL_STR_291[] PROGMEM = " CONTEXT=SEARCH";
+static const char ESP32_MAIL_STR_292[] PROGMEM = " RETURN (COUNT ALL)";
+static const char ESP32_MAIL_STR_293[] PROGMEM = " RETURN (COUNT MAX)";
+static const char ESP32_MAIL_STR_294[] PROGMEM = " RETURN (COUNT MIN)";
+static const char ESP32_MAIL_STR_295[] PROGMEM = " RETURN (COUNT PARTIAL ";
+static const char ESP32_MAIL_STR_296[] PROGMEM = "-1:-";
+static const char ESP32_MAIL_STR_297[] PROGMEM = "1:";
+static const char ESP32_MAIL_STR_298[] PROGMEM = "* ESEARCH ";
+static const char ESP32_MAIL_STR_299[] PROGMEM = " COUNT ";
+static const char ESP32_MAIL_STR_300[] PROGMEM = " ALL ";
+static const char ESP32_MAIL_STR_301[] PROGMEM = " MAX ";
+static const char ESP32_MAIL_STR_302[] PROGMEM = " MIN ";
+static const char ESP32_MAIL_STR_303[] PROGMEM = " PARTIAL (";
+static const char ESP32_MAIL_STR_304[] PROGMEM = "]<";
+static const char ESP32_MAIL_STR_307[] PROGMEM = "r+";
+static const char ESP32_MAIL_STR_308[] PROGMEM = "Resume download ";
+static const char ESP32_MAIL_STR_309[] PROGMEM = " from byte ";
+static const char ESP32_MAIL_STR_310[] PROGMEM = "Attachment buffer is too small";
+static const char ESP32_MAIL_STR_311[] PROGMEM = "quoted-printable";
+static const char ESP32_MAIL_STR_312[] PROGMEM = "Content-transfer-encoding: quoted-printable\r\n";
+static const char ESP32_MAIL_STR_313[] PROGMEM = "Content-transfer-encoding: 8bit\r\n";
+static const char ESP32_MAIL_STR_314[] PROGMEM = "Content-type: text/plain; charset=\"UTF-8\"\r\n";
+static const char ESP32_MAIL_STR_315[] PROGMEM = " BODY=8BITMIME";
+static const char ESP32_MAIL_STR_316[] PROGMEM = "8BITMIME";
+static const char ESP32_MAIL_STR_317[] PROGMEM = "BINARYMIME";
+static const char ESP32_MAIL_STR_318[] PROGMEM = "CHUNKING";
+static const char ESP32_MAIL_STR_319[] PROGMEM = " BODY=BINARYMIME";
+static const char ESP32_MAIL_STR_320[] PROGMEM = "Content-transfer-encoding: binary\r\n";
+static const char ESP32_MAIL_STR_321[] PROGMEM = "BDAT ";
+static const char ESP32_MAIL_STR_322[] PROGMEM = " LAST";
+static const char ESP32_MAIL_STR_323[] PROGMEM = "esp32mail";
+static const char ESP32_MAIL_STR_324[] PROGMEM = "NOOP";
+static const char ESP32_MAIL_STR_325[] PROGMEM = "$ NOOP";
+static const char ESP32_MAIL_STR_326[] PROGMEM = ".chk";
+static const char ESP32_MAIL_STR_328[] PROGMEM = "attachment data write failed";
+static const char ESP32_MAIL_STR_329[] PROGMEM = ".tmp";
 
 __attribute__((used)) static bool compFunc(uint32_t i, uint32_t j)
 {
@@ -384,8 +505,32 @@ public:
   bool _success = false;
 };
 
+class AttachmentChunk
+{
+public:
+  AttachmentChunk();
+  ~AttachmentChunk();
+  int mailIndex();
+  int attachmentIndex();
+  const uint8_t *data();
+  size_t length();
+  size_t offset();
+  size_t totalSize();
+  bool isFinal();
+  friend ESP32_MailClient;
+
+  int _mailIndex = 0;
+  int _attachmentIndex = 0;
+  const uint8_t *_data = NULL;
+  size_t _length = 0;
+  size_t _offset = 0;
+  size_t _totalSize = 0;
+  bool _final = false;
+};
+
 typedef void (*readStatusCallback)(ReadStatus);
 typedef void (*sendStatusCallback)(SendStatus);
+typedef void (*attachmentDataCallback)(AttachmentChunk);
 
 
 
@@ -465,6 +610,108 @@ public:
   */
   bool removeFlag(IMAPData &imapData, int msgUID, const String &flags);
 
+  /*
+  
+    Set the argument to the Flags for multiple messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param msgUIDs - The list of message UIDs, will be sent as UID sequence set e.g. 1:50,72,90:95.
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool setFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flags);
+
+  /*
+  
+    Add the argument to the Flags for multiple messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param msgUIDs - The list of message UIDs, will be sent as UID sequence set e.g. 1:50,72,90:95.
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool addFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flags);
+
+  /*
+  
+    Remove the argument from the Flags for multiple messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param msgUIDs - The list of message UIDs, will be sent as UID sequence set e.g. 1:50,72,90:95.
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool removeFlag(IMAPData &imapData, const std::vector<uint32_t> &msgUIDs, const String &flags);
+
+  /*
+  
+    Set the argument to the Flags for the range of messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param fromUID - The first message UID of the range.
+
+    @param toUID - The last message UID of the range, 0 for the last message in folder (*).
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool setFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flags);
+
+  /*
+  
+    Add the argument to the Flags for the range of messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param fromUID - The first message UID of the range.
+
+    @param toUID - The last message UID of the range, 0 for the last message in folder (*).
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool addFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flags);
+
+  /*
+  
+    Remove the argument from the Flags for the range of messages in one command.
+  
+    @param imapData - IMAP Data object to hold data and instances.
+
+    @param fromUID - The first message UID of the range.
+
+    @param toUID - The last message UID of the range, 0 for the last message in folder (*).
+
+    @param flags - The flag list.
+
+
+    @return Boolean type status indicates the success of operation.
+  
+  */
+  bool removeFlag(IMAPData &imapData, uint32_t fromUID, uint32_t toUID, const String &flags);
+
   /*
   
     Get the Email sending error details.
@@ -506,6 +753,114 @@ public:
   */
   bool sdBegin(void);
 
+  /*
+
+    Save the cached TLS sessions to NVS.
+
+    @return Boolean type status indicates the success of operation.
+
+    Call this before deep sleep and loadTLSSessionCache after wake up, the next sendMail or readMail
+    can then resume the session (abbreviated handshake) instead of performing the full handshake.
+    Requires mbedTLS 2.19 or later, otherwise false is returned and only the RAM cache is used.
+
+    The saved sessions include their master secrets, NVS stores them as plain text unless NVS encryption is enabled.
+
+  */
+  bool saveTLSSessionCache();
+
+  /*
+
+    Load the TLS sessions saved by saveTLSSessionCache from NVS.
+
+    @return Boolean type status indicates the success of operation.
+
+  */
+  bool loadTLSSessionCache();
+
+  /*
+
+    Remove all cached TLS sessions from RAM.
+
+  */
+  void clearTLSSessionCache();
+
+  /*
+
+    Free the parsed root CA certificates that are not used by any connection.
+
+    The parsed chains are kept for the next connection, call this to return their heap when no more mail will be sent or read.
+
+  */
+  void clearCACertCache();
+
+  /*
+
+    Resolve the server host name and keep its address for the next SMTP and IMAP connections.
+
+    @param host - The server host name e.g. smtp.gmail.com.
+
+    @return Boolean type status indicates the success of operation.
+
+    Call this while WiFi is already connected, so the later connection skips the DNS lookup.
+
+  */
+  bool preResolveHost(const char *host);
+
+  /*
+
+    Set how long the resolved server address is kept.
+
+    @param ttl - The time in milliseconds (default 300000), 0 to disable the DNS cache.
+
+    The cached address is dropped when the connection to it failed.
+
+  */
+  void setDNSCacheTTL(unsigned long ttl);
+
+  /*
+
+    Remove all cached server addresses.
+
+  */
+  void clearDNSCache();
+
+  /*
+
+    Get the ciphersuite and the handshake time of the last TLS connection to the server.
+
+    @param host - The server host name.
+
+    @param port - The server port.
+
+    @param record - The ssl_handshake_record32 struct to receive the ciphersuite ID, the resumption status,
+    the handshake time and the total connect time in milliseconds and the number of connections.
+
+    @return Boolean type status indicates the record was found.
+
+  */
+  bool getHandshakeRecord(const char *host, uint16_t port, ssl_handshake_record32 &record);
+
+  /*
+
+    Keep the authenticated SMTP and IMAP connections open for the next sendMail and readMail.
+
+    @param maxSize - The maximum number of idle connections, 0 (default) to disable the pool.
+
+    @param idleTimeout - The time in milliseconds to keep the idle connection (default 60000).
+
+    The connection is reused by the next call to the same host, port and login, even from another SMTPData or IMAPData,
+    after it answered NOOP. Each idle TLS connection keeps its record buffers, about 40 KB of heap with the default mbedTLS config.
+
+  */
+  void setConnectionPool(size_t maxSize, unsigned long idleTimeout = ESP32_MAIL_POOL_IDLE_TIMEOUT);
+
+  /*
+
+    Close all idle pooled connections.
+
+  */
+  void clearConnectionPool();
+
   struct IMAP_COMMAND_TYPE;
   struct IMAP_HEADER_TYPE;
 
@@ -526,17 +881,45 @@ private:
   std::string imapErrorReasonStr();
   void ESP32MailDebugError();
   void ESP32MailDebugInfo(PGM_P info);
-  void set_message_header(string &header, std::string &message, bool htmlFormat);
-  void set_attachment_header(uint8_t index, std::string &header, attachmentData &attach);
+  void set_message_header(string &header, std::string &message, bool htmlFormat, uint8_t encoding);
+  void set_attachment_header(uint8_t index, std::string &header, attachmentData &attach, bool binary);
   void clientReadAll(WiFiClient *client);
   double base64DecodeSize(std::string lastBase64String, int length);
   unsigned char *base64_decode_char(const unsigned char *src, size_t len, size_t *out_len);
+  bool base64_decode_buf(const unsigned char *src, size_t len, unsigned char *out, size_t *out_len);
   std::string base64_encode_string(const unsigned char *src, size_t len);
-  void send_base64_encode_mime_data(WiFiClient *client, const unsigned char *src, size_t len);
-  void send_base64_encode_mime_file(WiFiClient *client, File file);
-  int waitSMTPResponse(SMTPData &smtpData);
+  void send_base64_encode_mime_data(SMTPData &smtpData, const unsigned char *src, size_t len);
+  void send_base64_encode_mime_file(SMTPData &smtpData, File file);
+  void send_binary_mime_file(SMTPData &smtpData, File file);
+  void send_qp_encode_data(SMTPData &smtpData, qpEncoderState &qp, const char *src, size_t len, bool final);
+  bool hasLongLine(const std::string &text, size_t limit);
+  void smtpSendData(SMTPData &smtpData, const char *data);
+  void smtpSendData(SMTPData &smtpData, const uint8_t *data, size_t len);
+  int sendBDATChunk(SMTPData &smtpData, const uint8_t *data, size_t len, bool last);
+  size_t qpEncodeChar(qpEncoderState &qp, char c, char *out);
+  size_t qpEncodeFlush(qpEncoderState &qp, char *out);
+  size_t qpEncodeEmit(qpEncoderState &qp, unsigned char c, bool encode, char *out);
+  int waitSMTPResponse(SMTPData &smtpData, bool ehlo = false);
   bool waitIMAPResponse(IMAPData &imapData, uint8_t imapCommandType = 0, int maxChar = 0, int mailIndex = -1, int messageDataIndex = -1, std ::string part = "");
-  bool _setFlag(IMAPData &imapData, int msgUID, const String &flags, uint8_t action);
+  bool _setFlag(IMAPData &imapData, const std::string &uidSet, const String &flags, uint8_t action, bool silent);
+  void parseUIDSet(const std::string &uidSet, std::vector<uint32_t> &uids);
+  void parseSearchSet(IMAPData &imapData, const std::string &set);
+  void addSearchResult(IMAPData &imapData, uint32_t msgNum, size_t &ringIndex);
+  std::string getAttachmentFilePath(IMAPData &imapData, int mailIndex, int messageDataIndex);
+  bool loadDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex);
+  void saveDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex, size_t offset, size_t size, size_t encodedSize);
+  void removeDownloadCheckpoint(IMAPData &imapData, int mailIndex, int messageDataIndex);
+  bool attachmentSinkSet(IMAPData &imapData);
+  size_t qpDecodeChar(qpDecoderState &qp, char c, char *out);
+  void setHeaderField(IMAPData &imapData, int mailIndex, uint8_t field, const char *value, size_t length, bool append);
+  bool writeAttachmentSink(IMAPData &imapData, int mailIndex, int messageDataIndex, const uint8_t *data, size_t length, size_t offset, bool final);
+  bool writeStateFile(IMAPData &imapData, const std::string &path, const std::string &content);
+  bool syncStorageBegin(IMAPData &imapData, bool &mounted);
+  void syncStorageEnd(IMAPData &imapData, bool mounted);
+  bool loadSyncState(IMAPData &imapData);
+  bool saveSyncState(IMAPData &imapData);
+  std::string getUIDSequenceSet(const std::vector<uint32_t> &uids);
+  std::string getUIDRange(uint32_t fromUID, uint32_t toUID);
   bool getIMAPResponse(IMAPData &imapData);
   void createDirs(std::string dirs);
   bool smtpClientAvailable(SMTPData &smtpData, bool available);
@@ -572,6 +955,30 @@ protected:
   std::string _downloadError = "";
   bool _sdFileOpenWrite = false;
   bool _error = false;
+  size_t _resumeOffset = 0;
+  size_t _resumeSize = 0;
+  size_t _encodedSize = 0;
+};
+
+class messageRecord
+{
+public:
+  messageRecord();
+  ~messageRecord();
+  void empty();
+
+  friend ESP32_MailClient;
+  friend IMAPData;
+
+protected:
+  headerArenaSlice _header[MAX_HEADER_FIELD];
+  int _attachmentCount = 0;
+  int _totalAttachFileSize = 0;
+  int _downloadedByte = 0;
+  int _messageDataCount = 0;
+  bool _error = false;
+  std::string _errorMsg = "";
+  std::vector<messageBodyData> _messageDataInfo = std::vector<messageBodyData>();
 };
 
 class attachmentData
@@ -622,12 +1029,27 @@ public:
   void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const char *rootCA);
   void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword);
 
+  /*
+
+    Set the server login credentials with the DER encoded root CA certificates
+
+    @param rootCA - One or more concatenated DER encoded certificates, should stay valid while connecting.
+    @param rootCALength - The length of rootCA in byte.
+
+    DER certificates skip the base64 decoding of PEM. The parsed CA chain is cached and shared
+    by all connections that use the same certificate data.
+
+    */
+  void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const uint8_t *rootCA, size_t rootCALength);
+
   /*
     
     Set STARTTLS mode to enable STARTTLS protocol
 
      @param starttls - bool flag that enables STARTTLS mode
 
+     The mode is used on any port, keep it disabled for the implicit TLS port e.g. 465 or 993.
+
   */
   void setSTARTTLS(bool starttls);
 
@@ -640,6 +1062,56 @@ public:
   */
   void setDebug(bool debug);
 
+  /*
+
+    Enable or disable the TLS session cache (default enabled)
+
+    @param enable - bool flag to resume the cached session of this server instead of the full TLS handshake
+
+  */
+  void setSessionCache(bool enable);
+
+  /*
+
+    Set the TLS maximum fragment length to request from the server (RFC 6066)
+
+    @param length - 512, 1024, 2048 or 4096 byte, 0 (default) to disable the negotiation.
+
+    @return Boolean type status indicates the length is supported.
+
+    The smaller record lets mbedTLS built with variable buffer length (dynamic buffer) allocate the smaller
+    record buffers, so more sessions can be opened at the same time. The server that does not support
+    the extension still sends the full size (16 KB) records.
+
+  */
+  bool setMaxFragmentLength(uint16_t length);
+
+  /*
+
+    Set the function to call while waiting for the server connection
+
+    @param cb - The callback function that accepts no parameter, NULL to disable.
+
+    The DNS lookup, TCP connect and TLS handshake do not block, the callback is called between the
+    connection steps (about every 10 ms) until the connection is established or the handshake timed out.
+
+  */
+  void setConnectIdleCallback(ConnectIdleCallback cb);
+
+  /*
+
+    Set the TLS ciphersuite and curve profile
+
+    @param profile - SSL_CIPHER_PROFILE_DEFAULT (mbedTLS defaults), SSL_CIPHER_PROFILE_ECDHE (prefer ECDHE-ECDSA
+    and ECDHE-RSA with X25519/P-256, fall back to RSA key exchange) or SSL_CIPHER_PROFILE_ECDHE_ONLY 
+    (ECDHE only, the key exchange and the EC certificate keys are limited to X25519, P-256 and P-384).
+
+    The ECDHE-ECDSA handshake verifies the small EC certificate chain, it is much faster than the RSA key exchange
+    with the large certificates. Use ESP32_MailClient::getHandshakeRecord to compare the handshake time.
+
+  */
+  void setCipherProfile(int profile);
+
   /*
 
     Set the mailbox folder to search or fetch.
@@ -658,6 +1130,23 @@ public:
   */
   void setMessageBufferSize(size_t size);
 
+  /*
+  
+    Set the byte range of text/html message to fetch.
+  
+    @param offset - The offset in byte of message body part (transfer encoded data) to start fetching.
+    @param length - The length in byte to fetch, 0 to disable the range fetch.
+
+    Use this function to page through the large message body e.g. setMessageRange(0, 1024), setMessageRange(1024, 1024) and so on.
+    The length should not greater than message buffer size (setMessageBufferSize).
+    For base64 encoded message, the offset should be the multiple of encoded line length.
+
+    When the range was not set and text/html message was not saved (saveHTMLMessage, saveTextMessage), 
+    only the data that fits the message buffer size will be fetched.
+    
+  */
+  void setMessageRange(size_t offset, size_t length);
+
   /*
   
     Set the maximum attachment file size to be downloaded.
@@ -846,6 +1335,223 @@ public:
   */
   void setDownloadReport(bool report);
 
+  /*
+    
+    Enable/disable resumable attachment download.
+    
+    @param resume - Boolean flag to enable/disable resumable attachment download.
+
+    The download progress of attachment will be saved to the checkpoint file ({ATTACHMENT_FILE}.chk) 
+    every 16 kB of decoded data and when the connection was lost.
+    The next readMail of the same message UID and UIDVALIDITY will resume the download from the last checkpoint 
+    instead of download from the beginning. The checkpoint file will be removed when download completed.
+
+    Message should be fetched by UID (setFetchUID or UID search).
+
+  */
+  void setResumeDownload(bool resume);
+
+  /*
+    
+    Assign callback function that receive the decoded attachment data.
+    
+    @param attachmentCallback - The function that accept attachmentDataCallback as parameter.
+
+    The decoded attachment data will be passed to the callback function as AttachmentChunk 
+    instead of saving to SD card or SPIFFS file.
+    The last chunk of each attachment has zero length and AttachmentChunk.isFinal() returns true.
+
+    The data pointer of AttachmentChunk is valid only inside the callback function.
+
+    Call stopAttachmentDownload inside the callback function when the data can't be processed.
+
+  */
+  void setAttachmentCallback(attachmentDataCallback attachmentCallback);
+
+  /*
+    
+    Stop the current attachment download from the attachment callback function.
+
+    The connection will be closed, readMail returns false and the download error of the attachment will be set.
+
+  */
+  void stopAttachmentDownload();
+
+  /*
+    
+    Assign Stream that receive the decoded attachment data.
+    
+    @param stream - The pointer to Stream object e.g. WiFiClient, HardwareSerial.
+
+    The decoded attachment data will be written to the stream instead of saving to SD card or SPIFFS file.
+    The download will be stopped when the stream does not accept all data.
+
+  */
+  void setAttachmentStream(Stream *stream);
+
+  /*
+    
+    Assign user buffer that receive the decoded attachment data.
+    
+    @param buf - The pointer to user buffer.
+    @param size - The size of user buffer.
+
+    The decoded attachment data will be copied to the buffer instead of saving to SD card or SPIFFS file.
+    Each attachment will be copied from the beginning of buffer, the download will be stopped 
+    and the download error will be set when the data exceeds the buffer size.
+
+    Use getAttachmentBufferLength to get the number of bytes that copied to the buffer.
+
+  */
+  void setAttachmentBuffer(uint8_t *buf, size_t size);
+
+  /*
+    
+    Get the number of bytes of the last attachment that copied to the user buffer.
+    
+    @return Number of bytes that copied to the user buffer.
+
+  */
+  size_t getAttachmentBufferLength();
+
+  /*
+    
+    Enable/disable incremental mailbox synchronization.
+    
+    @param sync - Boolean flag to enable/disable incremental synchronization.
+    @param stateFile - The file path in SD card or SPIFFS (set by setFileStorageType) to store the sync state.
+
+    The UIDVALIDITY, UIDNEXT and HIGHESTMODSEQ of the selected folder are saved to the state file after each successful readMail.
+    On the next readMail, only messages that arrived since the last sync are fetched (search criteria will be omitted),
+    and if server supports CONDSTORE/QRESYNC, the messages which flags changed or were expunged since last sync 
+    can be read through getChangedCount, getChangedUID, getChangedFlags, getVanishedCount and getVanishedUID.
+
+    Full search will be processed if the state file does not exist, the folder was changed or UIDVALIDITY was changed.
+
+    This function will be omitted by setFetchUID.
+
+  */
+  void setIncrementalSync(bool sync, const String &stateFile);
+
+  /*
+    
+    Enable/disable new message only mode.
+    
+    @param newOnly - Boolean flag to enable/disable new message only mode.
+    @param lastNextUID - The value from getLastNextUID after the last readMail, 
+    empty String to use the value from the last readMail of this IMAPData object.
+    @param lastUIDValidity - The UIDVALIDITY from getUIDValidity that was seen in the last readMail.
+
+    The UIDNEXT of selected folder will be compared with the last value, if it was not changed, 
+    readMail will logout immediately without search and fetch. 
+    If it was changed, only the messages which UID is equal or greater than the last value will be fetched 
+    without search (search criteria will be omitted).
+
+    When the new messages are more than the search limit, the oldest ones will be fetched 
+    and the rest will be fetched in the next readMail.
+
+    Normal search will be processed if the last value is unknown or UIDVALIDITY was changed.
+
+    This function will be omitted by setFetchUID and setIncrementalSync.
+
+  */
+  void setNewMessageOnly(bool newOnly, const String &lastNextUID, const String &lastUIDValidity = "");
+
+  /*
+    
+    Determine the last incremental sync was full synchronization 
+    (state file not found, folder or UIDVALIDITY changed) and all locally cached messages should be discarded.
+    
+  */
+  bool syncReset();
+
+  /*
+    
+    Get the number of messages which flags changed since last incremental sync.
+
+    @return Number of changed messages.
+  
+  */
+  size_t getChangedCount();
+
+  /*
+    
+    Get the UID of changed message for selected index.
+    
+    @param index - Index of changed message.
+
+    @return Message UID.
+  
+  */
+  uint32_t getChangedUID(size_t index);
+
+  /*
+    
+    Get the current flags of changed message for selected index.
+    
+    @param index - Index of changed message.
+
+    @return Flags String e.g. \Seen \Flagged.
+  
+  */
+  String getChangedFlags(size_t index);
+
+  /*
+    
+    Get the number of messages which expunged since last incremental sync (QRESYNC server only).
+
+    @return Number of vanished messages.
+  
+  */
+  size_t getVanishedCount();
+
+  /*
+    
+    Get the UID of vanished message for selected index.
+    
+    @param index - Index of vanished message.
+
+    @return Message UID.
+  
+  */
+  uint32_t getVanishedUID(size_t index);
+
+  /*
+    
+    Get the UIDVALIDITY of selected mailbox folder.
+
+    @return UIDVALIDITY String.
+  
+  */
+  String getUIDValidity();
+
+  /*
+    
+    Get the predicted next UID (UIDNEXT) of selected mailbox folder.
+
+    @return UIDNEXT String.
+  
+  */
+  String getNextUID();
+
+  /*
+    
+    Get the UID which new message only mode will continue from in the next readMail.
+
+    @return UID String, equal to UIDNEXT when all new messages were fetched.
+  
+  */
+  String getLastNextUID();
+
+  /*
+    
+    Get the HIGHESTMODSEQ of selected mailbox folder (CONDSTORE server only).
+
+    @return HIGHESTMODSEQ String.
+  
+  */
+  String getHighestModSeq();
+
   /*
     
     Determine only message header is return when search.
@@ -1121,7 +1827,7 @@ public:
     
     @param download - Boolean flag to enable/disable message download.
 
-    @param decoded - Boolean flag to enable/disable html message decoding (support utf8 and base64 encoding).
+    @param decoded - Boolean flag to enable/disable html message decoding (support utf8, base64 and quoted-printable encoding).
   
   */
   void saveHTMLMessage(bool download, bool decoded);
@@ -1132,11 +1838,24 @@ public:
     
     @param download - Boolean flag to enable/disable message download.
 
-    @param decoded - Boolean flag to enable/disable plain text message decoding (support utf8 and base64 encoding).
+    @param decoded - Boolean flag to enable/disable plain text message decoding (support utf8, base64 and quoted-printable encoding).
   
   */
   void saveTextMessage(bool download, bool decoded);
 
+  /*
+    
+    Enable/disable the message body conversion to UTF-8.
+    
+    @param convert - Boolean flag to enable/disable the conversion of html and plain text message to UTF-8.
+
+    The message in ISO-8859-x, Windows-125x and TIS-620 charsets will be converted to UTF-8 while it is being fetched.
+    The message that saved with decoded flag will be converted too.
+    The encoded words in headers are always converted to UTF-8.
+
+  */
+  void setUTF8Conversion(bool convert);
+
   /*
     
     Determine the mailbox folder count.
@@ -1293,6 +2012,9 @@ public:
   friend ESP32_MailClient;
 
 private:
+  //The returned pointer is valid until the next getHeaderField or header parsing, the arena can be moved when it grows
+  const char *getHeaderField(uint16_t messageIndex, uint8_t field);
+  bool headerArenaReserve(size_t length);
   String getMessage(uint16_t messageIndex, bool htmlFormat);
   
 
@@ -1319,41 +2041,59 @@ private:
   bool _saveTextMsg = false;
   bool _saveDecodedHTML = false;
   bool _saveDecodedText = false;
+  bool _utf8Conversion = false;
   bool _downloadReport = false;
   bool _headerSaved = false;
+  bool _resumeDownload = false;
+  bool _incrementalSync = false;
+  bool _newMessageOnly = false;
+  bool _syncReset = false;
+  bool _capabilityChecked = false;
+  bool _condstore = false;
+  bool _qresync = false;
+  bool _esearch = false;
+  bool _partialSearch = false;
+  bool _contextSearch = false;
+
+  std::string _syncFile = "";
+  std::string _syncFolder = "";
+  std::string _syncUIDValidity = "";
+  std::string _syncNextUID = "";
+  std::string _syncModSeq = "";
+  std::string _uidValidity = "";
+  std::string _highestModSeq = "";
+  std::string _lastNextUID = "";
+  std::string _lastUIDValidity = "";
 
   size_t _message_buffer_size = 200;
+  size_t _messageOffset = 0;
+  size_t _messageLength = 0;
   size_t _attacement_max_size = 1024 * 1024;
   uint16_t _emailNumMax = 20;
   int _searchCount;
   bool _starttls = false;
   bool _debug = false;
   readStatusCallback _readCallback = NULL;
-
-  std::vector<std::string> _date = std::vector<std::string>();
-  std::vector<std::string> _subject = std::vector<std::string>();
-  std::vector<std::string> _subject_charset = std::vector<std::string>();
-  std::vector<std::string> _from = std::vector<std::string>();
-  std::vector<std::string> _from_charset = std::vector<std::string>();
-  std::vector<std::string> _to = std::vector<std::string>();
-  std::vector<std::string> _to_charset = std::vector<std::string>();
-  std::vector<std::string> _cc = std::vector<std::string>();
-  std::vector<std::string> _cc_charset = std::vector<std::string>();
+  attachmentDataCallback _attachmentCallback = NULL;
+  Stream *_attachmentStream = nullptr;
+  uint8_t *_attachmentBuffer = nullptr;
+  size_t _attachmentBufferSize = 0;
+  size_t _attachmentBufferLength = 0;
+  bool _attachmentAbort = false;
+
+  char *_headerArena = nullptr;
+  size_t _headerArenaSize = 0;
+  size_t _headerArenaLength = 0;
+  std::vector<messageRecord> _message = std::vector<messageRecord>();
   std::vector<uint32_t> _msgNum = std::vector<uint32_t>();
-  std::vector<std::string> _msgID = std::vector<std::string>();
-  std::vector<std::string> _contentLanguage = std::vector<std::string>();
-  std::vector<std::string> _acceptLanguage = std::vector<std::string>();
+  std::vector<uint32_t> _changedUID = std::vector<uint32_t>();
+  std::vector<std::string> _changedFlags = std::vector<std::string>();
+  std::vector<uint32_t> _vanishedUID = std::vector<uint32_t>();
 
   std::vector<std::string> _folders = std::vector<std::string>();
   std::vector<std::string> _flag = std::vector<std::string>();
-  std::vector<int> _attachmentCount = std::vector<int>();
-  std::vector<std::vector<messageBodyData>> _messageDataInfo = std::vector<std::vector<messageBodyData>>();
-  std::vector<int> _totalAttachFileSize = std::vector<int>();
-  std::vector<int> _downloadedByte = std::vector<int>();
-  std::vector<int> _messageDataCount = std::vector<int>();
-  std::vector<std::string> _errorMsg = std::vector<std::string>();
-  std::vector<bool> _error = std::vector<bool>();
   std::vector<const char *> _rootCA = std::vector<const char *>();
+  size_t _rootCALength = 0;
   
 
   std::unique_ptr<ESP32MailHTTPClient> _net = std::unique_ptr<ESP32MailHTTPClient>(new ESP32MailHTTPClient());
@@ -1381,12 +2121,27 @@ public:
   void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const char *rootCA);
   void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword);
 
+  /*
+
+    Set the server login credentials with the DER encoded root CA certificates
+
+    @param rootCA - One or more concatenated DER encoded certificates, should stay valid while connecting.
+    @param rootCALength - The length of rootCA in byte.
+
+    DER certificates skip the base64 decoding of PEM. The parsed CA chain is cached and shared
+    by all connections that use the same certificate data.
+
+    */
+  void setLogin(const String &host, uint16_t port, const String &loginEmail, const String &loginPassword, const uint8_t *rootCA, size_t rootCALength);
+
   /*
     
     Set STARTTLS mode to enable STARTTLS protocol
 
      @param starttls - bool flag that enables STARTTLS mode
 
+     The mode is used on any port, keep it disabled for the implicit TLS port e.g. 465 or 993.
+
   */
   void setSTARTTLS(bool starttls);
   
@@ -1398,6 +2153,56 @@ public:
 
   */
   void setDebug(bool debug);
+
+  /*
+
+    Enable or disable the TLS session cache (default enabled)
+
+    @param enable - bool flag to resume the cached session of this server instead of the full TLS handshake
+
+  */
+  void setSessionCache(bool enable);
+
+  /*
+
+    Set the TLS maximum fragment length to request from the server (RFC 6066)
+
+    @param length - 512, 1024, 2048 or 4096 byte, 0 (default) to disable the negotiation.
+
+    @return Boolean type status indicates the length is supported.
+
+    The smaller record lets mbedTLS built with variable buffer length (dynamic buffer) allocate the smaller
+    record buffers, so more sessions can be opened at the same time. The server that does not support
+    the extension still sends the full size (16 KB) records.
+
+  */
+  bool setMaxFragmentLength(uint16_t length);
+
+  /*
+
+    Set the function to call while waiting for the server connection
+
+    @param cb - The callback function that accepts no parameter, NULL to disable.
+
+    The DNS lookup, TCP connect and TLS handshake do not block, the callback is called between the
+    connection steps (about every 10 ms) until the connection is established or the handshake timed out.
+
+  */
+  void setConnectIdleCallback(ConnectIdleCallback cb);
+
+  /*
+
+    Set the TLS ciphersuite and curve profile
+
+    @param profile - SSL_CIPHER_PROFILE_DEFAULT (mbedTLS defaults), SSL_CIPHER_PROFILE_ECDHE (prefer ECDHE-ECDSA
+    and ECDHE-RSA with X25519/P-256, fall back to RSA key exchange) or SSL_CIPHER_PROFILE_ECDHE_ONLY 
+    (ECDHE only, the key exchange and the EC certificate keys are limited to X25519, P-256 and P-384).
+
+    The ECDHE-ECDSA handshake verifies the small EC certificate chain, it is much faster than the RSA key exchange
+    with the large certificates. Use ESP32_MailClient::getHandshakeRecord to compare the handshake time.
+
+  */
+  void setCipherProfile(int profile);
   /*
     
     Set Sender info
@@ -1553,6 +2358,24 @@ public:
   */
   bool htmlFormat();
 
+  /*
+
+    Set the content transfer encoding of the message body
+
+    @param encoding - The body encoding, ENC7BIT (default), ENCQUOTEDPRINTABLE, ENC8BIT or ENCBINARY.
+
+    ENC7BIT sends the message as is and is only safe for US-ASCII text with lines shorter than 998 characters.
+    ENCQUOTEDPRINTABLE encodes the message while it is sent, it suits mostly ASCII text with some UTF-8 characters.
+    ENC8BIT sends the UTF-8 message as is when the server advertises 8BITMIME in its EHLO response,
+    otherwise or when any line is longer than 998 octets, the message falls back to quoted-printable.
+    ENCBINARY also sends the attachments without base64 encoding, it requires the server to advertise
+    BINARYMIME and CHUNKING, otherwise it falls back to ENC8BIT.
+
+    When the server advertises CHUNKING, the message is always sent with BDAT in BDAT_CHUNK_SIZE chunks instead of DATA.
+
+  */
+  void setMessageEncoding(uint8_t encoding);
+
   /*
 
     Add Carbon Copy (CC) Email
@@ -1858,6 +2681,15 @@ protected:
   string _subject = "";
   string _message = "";
   bool _htmlFormat = false;
+  uint8_t _messageEncoding = ENC7BIT;
+  bool _8bitMIME = false;
+  bool _binaryMIME = false;
+  bool _chunking = false;
+  bool _bdat = false;
+  bool _chunkError = false;
+  uint8_t *_chunkBuf = nullptr;
+  size_t _chunkLength = 0;
+  bool _lineStart = true;
   bool _starttls = false;
   bool _debug = false;
   sendStatusCallback _sendCallback = NULL;
@@ -1869,6 +2701,7 @@ protected:
   attachmentData _attach;
   SendStatus _cbData;
   std::vector<const char *> _rootCA = std::vector<const char *>();
+  size_t _rootCALength = 0;
   std::unique_ptr<ESP32MailHTTPClient> _net = std::unique_ptr<ESP32MailHTTPClient>(new ESP32MailHTTPClient());
 
 };
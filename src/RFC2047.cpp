@@ -8,231 +8,161 @@
 RFC2047::RFC2047(){}
 
 
-void RFC2047::rfc2047Decode(char *d, const char *s, size_t dlen){
-
-  const char *p, *q;
-  size_t n;
-  int found_encoded = 0;
+/*
+  Decode the encoded words in s to d in a single pass, d can be the same buffer as s (in place decoding)
+  as the decoded text is never longer than its encoded word.
+  Whitespace between adjacent encoded words is ignored.
+  The text of the supported charsets is converted to UTF-8 when d is not s, as the UTF-8 text can be longer.
+  Return the number of bytes written to d, not including the terminal nul.
+*/
+size_t RFC2047::rfc2047Decode(char *d, const char *s, size_t dlen){
+
+  size_t n = 0;
+  bool lastEncoded = false;
+  rfc2047Word word;
+
+  if (!d || dlen == 0)
+    return 0;
 
   dlen--; /* save room for the terminal nul */
 
-  while (*s && dlen > 0)
+  while (s && *s && n < dlen)
   {
-    if ((p = strstr (s, "=?")) == NULL ||
-	(q = strchr (p + 2, '?')) == NULL ||
-	(q = strchr (q + 1, '?')) == NULL ||
-	(q = strstr (q + 1, "?=")) == NULL)
+    if (s[0] == '=' && s[1] == '?' && rfc2047ParseWord(s, word))
     {
-      /* no encoded words */
-      if (d != s)
-	strfcpy (d, s, dlen + 1);
-      return;
+      n += rfc2047DecodeWord(d + n, word, dlen - n, d != s);
+      s = word.end;
+      lastEncoded = true;
+      continue;
     }
 
-    if (p != s)
+    if (lastEncoded && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n'))
     {
-      n = (size_t) (p - s);
+      const char *p = s;
+      while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+
       /* ignore spaces between encoded words */
-      if (!found_encoded || strspn (s, " \t\r\n") != n)
+      if (p[0] == '=' && p[1] == '?' && rfc2047ParseWord(p, word))
       {
-	if (n > dlen)
-	  n = dlen;
-	if (d != s)
-	  memcpy (d, s, n);
-	d += n;
-	dlen -= n;
+        s = p;
+        continue;
       }
     }
 
-    rfc2047DecodeWord (d, p, dlen);
-    found_encoded = 1;
-    s = q + 2;
-    n = strlen (d);
-    dlen -= n;
-    d += n;
+    lastEncoded = false;
+    d[n++] = *s++;
   }
-  *d = 0;
 
+  d[n] = 0;
+  return n;
 }
 
-void RFC2047::rfc2047DecodeWord(char *d, const char *s, size_t dlen){
-  
-  char *p = safe_strdup (s);
-  char *pp = p;
-  char *pd = d;
-  size_t len = dlen;
-  int enc = 0, filter = 0, count = 0, c1, c2, c3, c4;
+bool RFC2047::rfc2047ParseWord(const char *s, rfc2047Word &word){
 
-  while ((pp = strtok (pp, "?")) != NULL)
-  {
-    count++;
-    switch (count)
-    {
-      case 2:
-	if (strcasecmp (pp, Charset) != 0)
-	{
-	  filter = 1;
-	}
-	break;
-      case 3:
-	if (toupper (*pp) == 'Q')
-	  enc = ENCQUOTEDPRINTABLE;
-	else if (toupper (*pp) == 'B')
-	  enc = ENCBASE64;
-	else
-	  return;
-	break;
-      case 4:
-	if (enc == ENCQUOTEDPRINTABLE)
-	{
-	  while (*pp && len > 0)
-	  {
-	    if (*pp == '_')
-	    {
-	      *pd++ = ' ';
-	      len--;
-	    }
-	    else if (*pp == '=')
-	    {
-	      *pd++ = (hexval(pp[1]) << 4) | hexval(pp[2]);
-	      len--;
-	      pp += 2;
-	    }
-	    else
-	    {
-	      *pd++ = *pp;
-	      len--;
-	    }
-	    pp++;
-	  }
-	  *pd = 0;
-	}
-	else if (enc == ENCBASE64)
-	{
-	  while (*pp && len > 0)
-	  {
-	    c1 = base64val(pp[0]);
-	    c2 = base64val(pp[1]);
-	    *pd++ = (c1 << 2) | ((c2 >> 4) & 0x3);
-	    if (--len == 0) break;
-	    
-	    if (pp[2] == '=') break;
-
-	    c3 = base64val(pp[2]);
-	    *pd++ = ((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf);
-	    if (--len == 0)
-	      break;
-
-	    if (pp[3] == '=')
-	      break;
-
-	    c4 = base64val(pp[3]);
-	    *pd++ = ((c3 & 0x3) << 6) | c4;
-	    if (--len == 0)
-	      break;
-
-	    pp += 4;
-	  }
-	  *pd = 0;
-	}
-	break;
-    }
-    pp = 0;
-  }
-  safe_free (&p);
-  if (filter)
-  {
+  /* =?charset?encoding?encoded-text?= */
+  const char *p = s + 2;
 
-      pd = d;
-      while (*pd)
-      {
-	if (!IsPrint (*pd))
-	  *pd = '?';
-	pd++;
-      }
-  }
-  return;
-}
+  word.charset = p;
+  while (*p && *p != '?' && *p != ' ' && *p != '\t')
+    p++;
+  if (*p != '?' || p == word.charset)
+    return false;
+  word.charsetLen = p - word.charset;
 
+  /* strip the RFC 2231 language suffix */
+  for (size_t i = 0; i < word.charsetLen; i++)
+    if (word.charset[i] == '*')
+      word.charsetLen = i;
 
-void *RFC2047::safe_calloc (size_t nmemb, size_t size)
-{
-  void *p;
+  p++;
+  if (toupper(*p) == 'Q')
+    word.enc = ENCQUOTEDPRINTABLE;
+  else if (toupper(*p) == 'B')
+    word.enc = ENCBASE64;
+  else
+    return false;
 
-  if (!nmemb || !size)
-    return NULL;
-  if (!(p = calloc (nmemb, size)))
-  {
-    //out of memory
-    return NULL;
-  }
-  return p;
-}
+  if (p[1] != '?')
+    return false;
+  p += 2;
 
-void *RFC2047::safe_malloc (unsigned int siz)
-{
-  void *p;
+  word.text = p;
+  while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && !(p[0] == '?' && p[1] == '='))
+    p++;
+  if (p[0] != '?' || p[1] != '=')
+    return false;
 
-  if (siz == 0)
-    return 0;
-  if ((p = (void *) malloc (siz)) == 0)
-  {
-    //out of memory
-    return NULL;
-  }
-  return (p);
+  word.textLen = p - word.text;
+  word.end = p + 2;
+  return true;
 }
 
-void RFC2047::safe_realloc (void **p, size_t siz)
-{
-  void *r;
+size_t RFC2047::rfc2047DecodeWord(char *d, const rfc2047Word &word, size_t dlen, bool convert){
+
+  /* the charset must be checked before writing, d may overlap the encoded word */
+  int charset = _converter.getCharset(word.charset, word.charsetLen);
+  const char *pp = word.text;
+  const char *pe = word.text + word.textLen;
+  char *pd = d;
+  size_t len = dlen;
+  int c1, c2, c3, c4;
 
-  if (siz == 0)
+  if (word.enc == ENCQUOTEDPRINTABLE)
   {
-    if (*p)
+    while (pp < pe && len > 0)
     {
-      free (*p);
-      *p = NULL;
+      if (*pp == '_')
+        *pd++ = ' ';
+      else if (*pp == '=' && pe - pp > 2 && hexval(pp[1]) >= 0 && hexval(pp[2]) >= 0)
+      {
+        *pd++ = (hexval(pp[1]) << 4) | hexval(pp[2]);
+        pp += 2;
+      }
+      else
+        *pd++ = *pp;
+      len--;
+      pp++;
     }
-    return;
-  }
-
-  if (*p)
-    r = (void *) realloc (*p, siz);
-  else
-  {
-    r = (void *) malloc (siz);
   }
-
-  if (!r)
+  else if (word.enc == ENCBASE64)
   {
-    //out of memory
-    return;
+    while (pe - pp >= 2 && len > 0)
+    {
+      c1 = base64val(pp[0]);
+      c2 = base64val(pp[1]);
+      if (c1 < 0 || c2 < 0)
+        break;
+      *pd++ = (c1 << 2) | ((c2 >> 4) & 0x3);
+      if (--len == 0)
+        break;
+
+      if (pe - pp < 3 || (c3 = base64val(pp[2])) < 0)
+        break;
+      *pd++ = ((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf);
+      if (--len == 0)
+        break;
+
+      if (pe - pp < 4 || (c4 = base64val(pp[3])) < 0)
+        break;
+      *pd++ = ((c3 & 0x3) << 6) | c4;
+      len--;
+
+      pp += 4;
+    }
   }
 
-  *p = r;
-}
+  if (charset > CHARSET_UTF8 && convert)
+    return _converter.toUTF8InPlace(d, pd - d, dlen, charset);
 
-void RFC2047::safe_free (void *ptr)
-{ 
-  void **p = (void **)ptr;
-  if (*p)
-  { 
-    free (*p);
-    *p = 0;
+  if (charset != CHARSET_UTF8)
+  {
+    for (char *pf = d; pf < pd; pf++)
+      if (!IsPrint(*pf))
+        *pf = '?';
   }
-}
-
-char *RFC2047::safe_strdup (const char *s)
-{
-  char *p;
-  size_t l;
 
-  if (!s || !*s) return 0;
-  l = strlen (s) + 1;
-  p = (char *)safe_malloc (l);
-  memcpy (p, s, l);
-  return (p);
+  return pd - d;
 }
 
 #endif //ESP32
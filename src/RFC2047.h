@@ -5,6 +5,7 @@
 #ifdef ESP32
 
 #include <Arduino.h>
+#include "CharsetConverter.h"
 
 
 #define strfcpy(A,B,C) strncpy(A,B,C), *(A+(C)-1)=0
@@ -44,23 +45,30 @@ __attribute__((used)) static int Index_64[128] = {
 #define IsPrint(c) (isprint((unsigned char)(c)) || \
 	((unsigned char)(c) >= 0xa0))
 
-#define hexval(c) Index_hex[(unsigned int)(c)]
-#define base64val(c) Index_64[(unsigned int)(c)]
+#define hexval(c) (((unsigned char)(c)) < 128 ? Index_hex[(unsigned int)(c)] : -1)
+#define base64val(c) (((unsigned char)(c)) < 128 ? Index_64[(unsigned int)(c)] : -1)
+
+struct rfc2047Word
+{
+  const char *charset;
+  size_t charsetLen;
+  int enc;
+  const char *text;
+  size_t textLen;
+  const char *end;
+};
 
 class RFC2047{
 
     public:
     RFC2047();
-    void rfc2047Decode(char *d, const char *s, size_t dlen);
+    size_t rfc2047Decode(char *d, const char *s, size_t dlen);
 
 
     private:
-    void rfc2047DecodeWord(char *d, const char *s, size_t dlen);
-    void *safe_calloc (size_t nmemb, size_t size);
-    void *safe_malloc (unsigned int siz);
-    void safe_realloc (void **p, size_t siz);
-    void safe_free (void *ptr);
-    char *safe_strdup (const char *s);
+    bool rfc2047ParseWord(const char *s, rfc2047Word &word);
+    size_t rfc2047DecodeWord(char *d, const rfc2047Word &word, size_t dlen, bool convert);
+    CharsetConverter _converter;
 
 
 };
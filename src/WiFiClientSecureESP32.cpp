@@ -136,6 +136,7 @@ void WiFiClientSecureESP32::stop()
         _connected = false;
         _peek = -1;
     }
+    _spanLen = 0;
     stop_ssl_socket(sslclient, _CA_cert, _cert, _private_key);
 }
 
@@ -204,6 +205,39 @@ int WiFiClientSecureESP32::connect(const char *host, uint16_t port, const char *
     return 1;
 }
 
+int WiFiClientSecureESP32::connectAsync(const char *host, uint16_t port)
+{
+    if(_timeout > 0){
+        sslclient->handshake_timeout = _timeout;
+    }
+    int ret;
+    if (_pskIdent && _psKey)
+        ret = start_ssl_client_async(sslclient, host, port, _timeout, NULL, NULL, NULL, _pskIdent, _psKey);
+    else
+        ret = start_ssl_client_async(sslclient, host, port, _timeout, _CA_cert, _cert, _private_key, NULL, NULL);
+    if (ret < 0) {
+        _lastError = ret;
+        log_e("start_ssl_client_async: %d", ret);
+        stop();
+        return -1;
+    }
+    _connected = ret == 1;
+    return ret;
+}
+
+int WiFiClientSecureESP32::connectPoll()
+{
+    int ret = poll_ssl_client(sslclient);
+    if (ret < 0) {
+        _lastError = ret;
+        log_e("poll_ssl_client: %d", ret);
+        stop();
+        return -1;
+    }
+    _connected = ret == 1;
+    return ret;
+}
+
 int WiFiClientSecureESP32::peek(){
     if(_peek >= 0){
         return _peek;
@@ -242,27 +276,37 @@ size_t WiFiClientSecureESP32::write(const uint8_t *buf, size_t size)
 
 int WiFiClientSecureESP32::read(uint8_t *buf, size_t size)
 {
-    int peeked = 0;
-    int avail = available();
-    if ((!buf && size) || avail <= 0) {
+    if (!buf && size) {
         return -1;
     }
     if(!size){
+        return available() > 0 ? 0 : -1;
+    }
+    int res = readAvailable(buf, size);
+    return res > 0 ? res : -1;
+}
+
+//Read as much decrypted data as received, up to size, in one call without the available() round trip
+int WiFiClientSecureESP32::readAvailable(uint8_t *buf, size_t size)
+{
+    int peeked = 0;
+    if (!buf || !size) {
         return 0;
     }
     if(_peek >= 0){
         buf[0] = _peek;
         _peek = -1;
         size--;
-        avail--;
-        if(!size || !avail){
+        if(!size){
             return 1;
         }
         buf++;
         peeked = 1;
     }
-    
-    int res = get_ssl_receive(sslclient, buf, size);
+    if (!_connected) {
+        return peeked;
+    }
+    int res = ssl_read_available(sslclient, buf, size);
     if (res < 0) {
         stop();
         return peeked?peeked:res;
@@ -270,17 +314,55 @@ int WiFiClientSecureESP32::read(uint8_t *buf, size_t size)
     return res + peeked;
 }
 
+//Nonzero when the read will return data, it does not read or decrypt the record
+int WiFiClientSecureESP32::readable()
+{
+    int peeked = (_peek >= 0);
+    if (!_connected) {
+        return peeked;
+    }
+    return ssl_readable(sslclient) + peeked;
+}
+
+//Decrypted data of the current record read in place, release the consumed bytes before the next read
+//return the length, 0 when nothing was received or the error
+int WiFiClientSecureESP32::receiveSpan(const uint8_t *&data)
+{
+    data = NULL;
+    if (!_connected || _peek >= 0) {
+        return 0;
+    }
+    int res = ssl_receive_span(sslclient, &data);
+    if (res < 0 && res != MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE) {
+        stop();
+    }
+    _spanLen = res > 0 ? res : 0;
+    return res;
+}
+
+void WiFiClientSecureESP32::releaseSpan(size_t len)
+{
+    ssl_receive_release(sslclient, len);
+    _spanLen = len < _spanLen ? _spanLen - len : 0;
+}
+
 int WiFiClientSecureESP32::available()
 {
     int peeked = (_peek >= 0);
     if (!_connected) {
         return peeked;
     }
-    int res = data_to_read(sslclient);
+    //the buffered decrypted bytes are counted without reading the socket, the span handed out is not available again
+    int res = (int)mbedtls_ssl_get_bytes_avail(&sslclient->ssl_ctx) - (int)_spanLen;
+    if (res > 0) {
+        return res + peeked;
+    }
+    res = data_to_read(sslclient);
     if (res < 0) {
         stop();
         return peeked?peeked:res;
     }
+    res = res > (int)_spanLen ? res - _spanLen : 0;
     return res+peeked;
 }
 
@@ -295,6 +377,13 @@ uint8_t WiFiClientSecureESP32::connected()
 void WiFiClientSecureESP32::setCACert (const char *rootCA)
 {
     _CA_cert = rootCA;
+    sslclient->ca_cert_len = 0;
+}
+
+void WiFiClientSecureESP32::setCACertDER(const uint8_t *rootCA, size_t len)
+{
+    _CA_cert = (const char *)rootCA;
+    sslclient->ca_cert_len = len;
 }
 
 void WiFiClientSecureESP32::setCertificate (const char *client_ca)
@@ -392,6 +481,54 @@ void WiFiClientSecureESP32::setDebugCB(DebugMsgCallback cb)
     sslclient->_debugCallback = std::move(cb);
 }
 
+void WiFiClientSecureESP32::setSessionCache(bool enable)
+{
+    sslclient->session_cache = enable;
+}
+
+bool WiFiClientSecureESP32::sessionResumed()
+{
+    return sslclient->session_resumed;
+}
+
+bool WiFiClientSecureESP32::setMaxFragmentLength(uint16_t length)
+{
+    sslclient->max_frag_len = ssl_max_frag_len_code(length);
+    return length == 0 || sslclient->max_frag_len != MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+}
+
+void WiFiClientSecureESP32::setSTARTTLSProtocol(int protocol)
+{
+    sslclient->starttls_proto = protocol;
+}
+
+uint8_t WiFiClientSecureESP32::starttlsCapabilities()
+{
+    return sslclient->starttls_caps;
+}
+
+void WiFiClientSecureESP32::setCipherProfile(int profile)
+{
+    sslclient->cipher_profile = profile;
+}
+
+const char *WiFiClientSecureESP32::ciphersuite()
+{
+    if (!_connected)
+        return NULL;
+    return mbedtls_ssl_get_ciphersuite(&sslclient->ssl_ctx);
+}
+
+unsigned long WiFiClientSecureESP32::handshakeTime()
+{
+    return sslclient->handshake_time;
+}
+
+void WiFiClientSecureESP32::setIdleCallback(ConnectIdleCallback cb)
+{
+    sslclient->_idleCallback = cb;
+}
+
 #endif //ESP32
 
 #endif //WiFiClientSecureESP32_CPP
\ No newline at end of file
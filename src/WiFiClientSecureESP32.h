@@ -64,6 +64,7 @@ protected:
     int _lastError = 0;
 	int _peek = -1;
     int _timeout = 0;
+    size_t _spanLen = 0; // span bytes not released to mbedTLS
     const char *_CA_cert;
     const char *_cert;
     const char *_private_key;
@@ -85,18 +86,25 @@ public:
     int connect(const char *host, uint16_t port, const char *rootCABuff, const char *cli_cert, const char *cli_key);
     int connect(IPAddress ip, uint16_t port, const char *pskIdent, const char *psKey);
     int connect(const char *host, uint16_t port, const char *pskIdent, const char *psKey);
+    int connectAsync(const char *host, uint16_t port);
+    int connectPoll();
 	int peek();
     size_t write(uint8_t data);
     size_t write(const uint8_t *buf, size_t size);
     int available();
     int read();
     int read(uint8_t *buf, size_t size);
+    int readAvailable(uint8_t *buf, size_t size);
+    int readable();
+    int receiveSpan(const uint8_t *&data);
+    void releaseSpan(size_t len);
     void flush() {}
     void stop();
     uint8_t connected();
     int lastError(char *buf, const size_t size);
     void setPreSharedKey(const char *pskIdent, const char *psKey); // psKey in Hex
     void setCACert(const char *rootCA);
+    void setCACertDER(const uint8_t *rootCA, size_t len);
     void setCertificate(const char *client_ca);
     void setPrivateKey (const char *private_key);
     bool loadCACert(Stream& stream, size_t size);
@@ -105,7 +113,16 @@ public:
     bool verify(const char* fingerprint, const char* domain_name);
     void setHandshakeTimeout(unsigned long handshake_timeout);
     void setSTARTTLS(bool starttls);
+    void setSTARTTLSProtocol(int protocol);
+    uint8_t starttlsCapabilities();
+    void setCipherProfile(int profile);
+    const char *ciphersuite();
+    unsigned long handshakeTime();
     void setDebugCB(DebugMsgCallback cb);
+    void setSessionCache(bool enable);
+    bool setMaxFragmentLength(uint16_t length);
+    bool sessionResumed();
+    void setIdleCallback(ConnectIdleCallback cb);
 
     operator bool()
     {
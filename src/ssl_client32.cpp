@@ -42,15 +42,114 @@
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/netdb.h>
+#include <lwip/dns.h>
 #include <mbedtls/sha256.h>
 #include <mbedtls/oid.h>
 #include <algorithm>
 #include <string>
 #include "ssl_client32.h"
 #include "WiFi.h"
+#include <Preferences.h>
 
 const char *pers32 = "esp32-tls";
 
+//Sessions of the recent servers, kept for abbreviated handshake (session ID or session ticket)
+static ssl_session_cache_entry32 ssl_session_cache[SSL_SESSION_CACHE_SIZE];
+static unsigned long ssl_session_cache_stamp = 0;
+
+//Parsed CA chains shared by all connections, an unused chain stays parsed until its slot is needed
+static ssl_ca_cache_entry32 ssl_ca_cache[SSL_CA_CACHE_SIZE];
+static unsigned long ssl_ca_cache_stamp = 0;
+
+//Pending host name lookups, the lwIP callback may arrive after the connection was given up
+static ssl_dns_request32 ssl_dns_requests[SSL_DNS_REQUEST_SIZE];
+
+//Negotiated ciphersuite and handshake time of the recent hosts
+static ssl_handshake_record32 ssl_handshake_records[SSL_HANDSHAKE_RECORD_SIZE];
+static unsigned long ssl_handshake_record_stamp = 0;
+
+//The session, CA, DNS and handshake record caches are shared by the connections of all tasks
+static SemaphoreHandle_t ssl_cache_mutex = xSemaphoreCreateMutex();
+
+//ECDSA signatures and ECDHE with X25519/P-256 are much cheaper than verifying the large RSA chains,
+//the AES-GCM and SHA-256 work runs on the hardware accelerators
+static const int ssl_ciphersuites_ecdhe[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    //fallback for the servers without ECDHE, the suites not compiled into mbedTLS are skipped in the client hello
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_256_CBC_SHA,
+    0};
+
+static const int ssl_ciphersuites_ecdhe_only[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    0};
+
+#if defined(MBEDTLS_ECP_C)
+static const mbedtls_ecp_group_id ssl_curves_ecdhe[] = {
+#if defined(MBEDTLS_ECP_DP_CURVE25519_ENABLED)
+    MBEDTLS_ECP_DP_CURVE25519,
+#endif
+#if defined(MBEDTLS_ECP_DP_SECP256R1_ENABLED)
+    MBEDTLS_ECP_DP_SECP256R1,
+#endif
+#if defined(MBEDTLS_ECP_DP_SECP384R1_ENABLED)
+    MBEDTLS_ECP_DP_SECP384R1,
+#endif
+    MBEDTLS_ECP_DP_NONE};
+
+//The curve list also limits the EC keys of server certificate, the fallback profile prefers
+//the curves above and still accepts all compiled curves e.g. P-521 certificate
+static mbedtls_ecp_group_id ssl_curves_ecdhe_all[MBEDTLS_ECP_DP_MAX + 1];
+
+static const mbedtls_ecp_group_id *ssl_curves_ecdhe_fallback()
+{
+    const mbedtls_ecp_group_id *id = NULL;
+    size_t n = 0;
+    size_t preferred = 0;
+    size_t i = 0;
+
+    if (ssl_curves_ecdhe_all[0] != MBEDTLS_ECP_DP_NONE)
+        return ssl_curves_ecdhe_all;
+
+    for (id = ssl_curves_ecdhe; *id != MBEDTLS_ECP_DP_NONE; id++)
+        ssl_curves_ecdhe_all[n++] = *id;
+    preferred = n;
+
+    for (id = mbedtls_ecp_grp_id_list(); *id != MBEDTLS_ECP_DP_NONE && n < MBEDTLS_ECP_DP_MAX; id++)
+    {
+        for (i = 0; i < preferred; i++)
+            if (ssl_curves_ecdhe_all[i] == *id)
+                break;
+        if (i == preferred)
+            ssl_curves_ecdhe_all[n++] = *id;
+    }
+
+    ssl_curves_ecdhe_all[n] = MBEDTLS_ECP_DP_NONE;
+    return ssl_curves_ecdhe_all;
+}
+#endif
+
+//Resolved addresses of the recent hosts, SMTP and IMAP often share the same server
+static ssl_dns_cache_entry32 ssl_dns_cache[SSL_DNS_CACHE_SIZE];
+static unsigned long ssl_dns_cache_ttl = SSL_DNS_CACHE_TTL;
+
 static int handle_error(int err)
 {
     if (err == -30848)
@@ -66,69 +165,648 @@ static int handle_error(int err)
     return err;
 }
 
+//Get the parsed CA chain entry, the fields of the chain held by the caller don't change
+static const ssl_ca_cache_entry32 *ssl_ca_cache_entry(const mbedtls_x509_crt *crt)
+{
+    for (int i = 0; i < SSL_CA_CACHE_SIZE; i++)
+    {
+        if (&ssl_ca_cache[i].crt == crt)
+            return &ssl_ca_cache[i];
+    }
+    return NULL;
+}
+
+//Build the session cache key of the connection, false when the host is too long to cache
+static bool ssl_session_cache_key(sslclient_context32 *ssl_client, ssl_session_cache_key32 *key)
+{
+    const ssl_ca_cache_entry32 *ca = ssl_ca_cache_entry(ssl_client->ca_chain);
+
+    if (strlen(ssl_client->host) >= SSL_SESSION_CACHE_HOST_LEN)
+        return false;
+
+    //zero filled, the keys are compared as memory
+    memset(key, 0, sizeof(ssl_session_cache_key32));
+    strcpy(key->host, ssl_client->host);
+    key->port = ssl_client->port;
+    key->authmode = ca ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE;
+    if (ca)
+    {
+        key->ca_buf = (uintptr_t)ca->buf;
+        key->ca_len = ca->len;
+        key->ca_hash = ca->hash;
+    }
+    return true;
+}
+
+static ssl_session_cache_entry32 *ssl_session_cache_find(const ssl_session_cache_key32 *key)
+{
+    for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+    {
+        if (ssl_session_cache[i].valid && memcmp(&ssl_session_cache[i].key, key, sizeof(ssl_session_cache_key32)) == 0)
+            return &ssl_session_cache[i];
+    }
+    return NULL;
+}
+
+static void ssl_session_cache_remove(ssl_session_cache_entry32 *entry)
+{
+    if (!entry || !entry->valid)
+        return;
+    mbedtls_ssl_session_free(&entry->session);
+    entry->valid = false;
+}
+
+//Get the entry for host, the least recently used entry will be reused when the cache is full
+static ssl_session_cache_entry32 *ssl_session_cache_slot(const ssl_session_cache_key32 *key)
+{
+    ssl_session_cache_entry32 *entry = ssl_session_cache_find(key);
+
+    if (entry)
+        return entry;
+
+    entry = &ssl_session_cache[0];
+    for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+    {
+        if (!ssl_session_cache[i].valid)
+            return &ssl_session_cache[i];
+        if (ssl_session_cache[i].last_used < entry->last_used)
+            entry = &ssl_session_cache[i];
+    }
+    return entry;
+}
+
+static void ssl_session_cache_store(sslclient_context32 *ssl_client)
+{
+    ssl_session_cache_key32 key;
+
+    if (!ssl_session_cache_key(ssl_client, &key))
+        return;
+
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    ssl_session_cache_entry32 *entry = ssl_session_cache_slot(&key);
+    ssl_session_cache_remove(entry);
+
+    mbedtls_ssl_session_init(&entry->session);
+    if (mbedtls_ssl_get_session(&ssl_client->ssl_ctx, &entry->session) != 0)
+    {
+        mbedtls_ssl_session_free(&entry->session);
+        xSemaphoreGive(ssl_cache_mutex);
+        return;
+    }
+
+    memcpy(&entry->key, &key, sizeof(ssl_session_cache_key32));
+    entry->last_used = ++ssl_session_cache_stamp;
+    entry->valid = true;
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
+//Record the ciphersuite and timing of the finished handshake, the least recently used record will be reused when full
+static void ssl_handshake_record_store(sslclient_context32 *ssl_client, const char *host, uint16_t port)
+{
+    ssl_handshake_record32 *record = NULL;
+    const char *suite = NULL;
+
+    if (strlen(host) >= SSL_HANDSHAKE_RECORD_HOST_LEN)
+        return;
+
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_HANDSHAKE_RECORD_SIZE; i++)
+    {
+        if (ssl_handshake_records[i].valid && ssl_handshake_records[i].port == port && strcmp(ssl_handshake_records[i].host, host) == 0)
+        {
+            record = &ssl_handshake_records[i];
+            break;
+        }
+    }
+
+    if (!record)
+    {
+        record = &ssl_handshake_records[0];
+        for (int i = 0; i < SSL_HANDSHAKE_RECORD_SIZE; i++)
+        {
+            if (!ssl_handshake_records[i].valid)
+            {
+                record = &ssl_handshake_records[i];
+                break;
+            }
+            if (ssl_handshake_records[i].last_used < record->last_used)
+                record = &ssl_handshake_records[i];
+        }
+        memset(record, 0, sizeof(ssl_handshake_record32));
+        strcpy(record->host, host);
+        record->port = port;
+    }
+
+    suite = mbedtls_ssl_get_ciphersuite(&ssl_client->ssl_ctx);
+    record->ciphersuite = suite ? mbedtls_ssl_get_ciphersuite_id(suite) : 0;
+    record->resumed = ssl_client->session_resumed;
+    record->handshake_time = ssl_client->handshake_time;
+    record->connect_time = millis() - ssl_client->connect_start;
+    record->count++;
+    record->last_used = ++ssl_handshake_record_stamp;
+    record->valid = true;
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
+void ssl_sha256(const unsigned char *buf, size_t len, unsigned char *digest)
+{
+    mbedtls_sha256_context sha256_ctx;
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts(&sha256_ctx, false);
+    mbedtls_sha256_update(&sha256_ctx, buf, len);
+    mbedtls_sha256_finish(&sha256_ctx, digest);
+    mbedtls_sha256_free(&sha256_ctx);
+}
+
+//FNV-1a, detects the changed content of the same CA buffer
+static uint32_t ssl_ca_cache_hash(const unsigned char *buf, size_t len)
+{
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= buf[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+//Parse the concatenated DER certificates
+static int ssl_ca_parse_der(mbedtls_x509_crt *crt, const unsigned char *buf, size_t len)
+{
+    size_t offset = 0;
+    size_t certLen = 0;
+    size_t hdrLen = 0;
+    int ret = 0;
+
+    while (offset + 2 <= len)
+    {
+        //SEQUENCE tag with short or long form length
+        if (buf[offset] != 0x30)
+            return MBEDTLS_ERR_X509_INVALID_FORMAT;
+
+        hdrLen = 2;
+        certLen = buf[offset + 1];
+        if (certLen & 0x80)
+        {
+            hdrLen += certLen & 0x7f;
+            if (hdrLen > 6 || offset + hdrLen > len)
+                return MBEDTLS_ERR_X509_INVALID_FORMAT;
+            certLen = 0;
+            for (size_t i = offset + 2; i < offset + hdrLen; i++)
+                certLen = (certLen << 8) | buf[i];
+        }
+
+        if (offset + hdrLen + certLen > len)
+            return MBEDTLS_ERR_X509_INVALID_FORMAT;
+
+        ret = mbedtls_x509_crt_parse_der(crt, buf + offset, hdrLen + certLen);
+        if (ret != 0)
+            return ret;
+
+        offset += hdrLen + certLen;
+    }
+
+    return 0;
+}
+
+mbedtls_x509_crt *ssl_ca_cache_acquire(const unsigned char *buf, size_t len, int *err)
+{
+    ssl_ca_cache_entry32 *entry = NULL;
+    uint32_t hash = 0;
+    int ret = 0;
+
+    //zero length is the null terminated PEM string, the terminator is required by mbedtls_x509_crt_parse
+    if (len == 0)
+        len = strlen((const char *)buf) + 1;
+
+    hash = ssl_ca_cache_hash(buf, len);
+
+    //the chain is parsed under the lock, no other task can take or free the chosen slot meanwhile
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_CA_CACHE_SIZE; i++)
+    {
+        if (ssl_ca_cache[i].valid && ssl_ca_cache[i].buf == buf && ssl_ca_cache[i].len == len && ssl_ca_cache[i].hash == hash)
+        {
+            ssl_ca_cache[i].refcount++;
+            ssl_ca_cache[i].last_used = ++ssl_ca_cache_stamp;
+            xSemaphoreGive(ssl_cache_mutex);
+            return &ssl_ca_cache[i].crt;
+        }
+    }
+
+    for (int i = 0; i < SSL_CA_CACHE_SIZE; i++)
+    {
+        if (!ssl_ca_cache[i].valid)
+        {
+            entry = &ssl_ca_cache[i];
+            break;
+        }
+        if (ssl_ca_cache[i].refcount == 0 && (!entry || ssl_ca_cache[i].last_used < entry->last_used))
+            entry = &ssl_ca_cache[i];
+    }
+
+    //all chains are in use
+    if (!entry)
+    {
+        xSemaphoreGive(ssl_cache_mutex);
+        *err = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        return NULL;
+    }
+
+    if (entry->valid)
+    {
+        mbedtls_x509_crt_free(&entry->crt);
+        entry->valid = false;
+    }
+
+    mbedtls_x509_crt_init(&entry->crt);
+
+    if (buf[len - 1] == '\0' && strstr((const char *)buf, "-----BEGIN ") != NULL)
+        ret = mbedtls_x509_crt_parse(&entry->crt, buf, len);
+    else
+        ret = ssl_ca_parse_der(&entry->crt, buf, len);
+
+    if (ret < 0)
+    {
+        mbedtls_x509_crt_free(&entry->crt);
+        xSemaphoreGive(ssl_cache_mutex);
+        *err = ret;
+        return NULL;
+    }
+
+    entry->buf = buf;
+    entry->len = len;
+    entry->hash = hash;
+    entry->refcount = 1;
+    entry->last_used = ++ssl_ca_cache_stamp;
+    entry->valid = true;
+
+    xSemaphoreGive(ssl_cache_mutex);
+
+    return &entry->crt;
+}
+
+void ssl_ca_cache_release(mbedtls_x509_crt *crt)
+{
+    if (!crt)
+        return;
+
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_CA_CACHE_SIZE; i++)
+    {
+        if (ssl_ca_cache[i].valid && &ssl_ca_cache[i].crt == crt && ssl_ca_cache[i].refcount > 0)
+        {
+            ssl_ca_cache[i].refcount--;
+            break;
+        }
+    }
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
+void ssl_ca_cache_clear()
+{
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_CA_CACHE_SIZE; i++)
+    {
+        if (ssl_ca_cache[i].valid && ssl_ca_cache[i].refcount == 0)
+        {
+            mbedtls_x509_crt_free(&ssl_ca_cache[i].crt);
+            ssl_ca_cache[i].valid = false;
+        }
+    }
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
 void ssl_init(sslclient_context32 *ssl_client)
 {
     mbedtls_ssl_init(&ssl_client->ssl_ctx);
     mbedtls_ssl_config_init(&ssl_client->ssl_conf);
     mbedtls_ctr_drbg_init(&ssl_client->drbg_ctx);
     mbedtls_net_init(&ssl_client->server_fd);
+    ssl_client->session_cache = false;
+    ssl_client->session_resumed = false;
+    ssl_client->ca_chain = NULL;
+    ssl_client->ca_cert_len = 0;
+    ssl_client->max_frag_len = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+    ssl_client->state = SSL_CLIENT_STATE_IDLE;
+    ssl_client->last_error = 0;
+    ssl_client->dns_slot = -1;
+    ssl_client->cached_id_len = 0;
+    ssl_client->_idleCallback = NULL;
+    ssl_client->starttls_proto = SSL_STARTTLS_SMTP;
+    ssl_client->starttls_step = SSL_STARTTLS_STEP_DONE;
+    ssl_client->starttls_caps = 0;
+    ssl_client->starttls_len = 0;
+    ssl_client->cipher_profile = SSL_CIPHER_PROFILE_DEFAULT;
+    ssl_client->handshake_start = 0;
+    ssl_client->handshake_time = 0;
 }
 
-int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t port, int timeout, const char *rootCABuff, const char *cli_cert, const char *cli_key, const char *pskIdent, const char *psKey)
+//Map the fragment length in byte to the RFC 6066 code, 0 or the unsupported length disables the negotiation
+unsigned char ssl_max_frag_len_code(uint16_t length)
 {
-    char buf[512];
-    int ret, flags;
-    int enable = 1;
+    switch (length)
+    {
+    case 512:
+        return MBEDTLS_SSL_MAX_FRAG_LEN_512;
+    case 1024:
+        return MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+    case 2048:
+        return MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+    case 4096:
+        return MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+    default:
+        return MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+    }
+}
 
-    if (ssl_client->_debugCallback)
-        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_2, ssl_client);
+//Get the cached address of host, the expired entry will be dropped
+static uint32_t ssl_dns_cache_find(const char *host)
+{
+    uint32_t addr = 0;
 
-    log_v("Free internal heap before TLS %u", ESP.getFreeHeap());
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
 
-    log_v("Starting socket");
-    ssl_client->socket = -1;
+    for (int i = 0; i < SSL_DNS_CACHE_SIZE; i++)
+    {
+        if (ssl_dns_cache[i].valid && strcmp(ssl_dns_cache[i].host, host) == 0)
+        {
+            if (millis() - ssl_dns_cache[i].stamp < ssl_dns_cache_ttl)
+            {
+                addr = ssl_dns_cache[i].addr;
+                break;
+            }
+            ssl_dns_cache[i].valid = false;
+        }
+    }
 
-    ssl_client->socket = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (ssl_client->socket < 0)
+    xSemaphoreGive(ssl_cache_mutex);
+
+    return addr;
+}
+
+//Store the address of host, the oldest entry will be reused when the cache is full
+static void ssl_dns_cache_store(const char *host, uint32_t addr)
+{
+    if (ssl_dns_cache_ttl == 0 || strlen(host) >= SSL_DNS_CACHE_HOST_LEN)
+        return;
+
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    ssl_dns_cache_entry32 *entry = &ssl_dns_cache[0];
+    for (int i = 0; i < SSL_DNS_CACHE_SIZE; i++)
     {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_3, ssl_client);
-        log_e("ERROR opening socket");
-        return ssl_client->socket;
+        if (ssl_dns_cache[i].valid && strcmp(ssl_dns_cache[i].host, host) == 0)
+        {
+            entry = &ssl_dns_cache[i];
+            break;
+        }
+        if (!ssl_dns_cache[i].valid)
+            entry = &ssl_dns_cache[i];
+        else if (entry->valid && ssl_dns_cache[i].stamp < entry->stamp)
+            entry = &ssl_dns_cache[i];
     }
 
+    strcpy(entry->host, host);
+    entry->addr = addr;
+    entry->stamp = millis();
+    entry->valid = true;
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
+//Resolve host and keep its address for the next connections, blocking
+bool ssl_dns_cache_resolve(const char *host)
+{
     IPAddress srv((uint32_t)0);
+
+    if (ssl_dns_cache_find(host))
+        return true;
+
     if (!WiFiGenericClass::hostByName(host, srv))
+        return false;
+
+    ssl_dns_cache_store(host, srv);
+    return true;
+}
+
+void ssl_dns_cache_invalidate(const char *host)
+{
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_DNS_CACHE_SIZE; i++)
     {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_4, ssl_client);
+        if (host == NULL || strcmp(ssl_dns_cache[i].host, host) == 0)
+            ssl_dns_cache[i].valid = false;
+    }
+
+    xSemaphoreGive(ssl_cache_mutex);
+}
+
+bool ssl_handshake_record_get(const char *host, uint16_t port, ssl_handshake_record32 *record)
+{
+    bool res = false;
+
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_HANDSHAKE_RECORD_SIZE; i++)
+    {
+        if (ssl_handshake_records[i].valid && ssl_handshake_records[i].port == port && strcmp(ssl_handshake_records[i].host, host) == 0)
+        {
+            memcpy(record, &ssl_handshake_records[i], sizeof(ssl_handshake_record32));
+            res = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(ssl_cache_mutex);
+
+    return res;
+}
+
+void ssl_dns_cache_set_ttl(unsigned long ttl)
+{
+    ssl_dns_cache_ttl = ttl;
+    if (ttl == 0)
+        ssl_dns_cache_invalidate(NULL);
+}
+
+static void ssl_dns_found(const char *name, const ip_addr_t *ipaddr, void *callback_arg)
+{
+    ssl_dns_request32 *req = (ssl_dns_request32 *)callback_arg;
+
+    if (ipaddr && ipaddr->u_addr.ip4.addr)
+    {
+        req->addr = ipaddr->u_addr.ip4.addr;
+        req->state = SSL_DNS_REQUEST_DONE;
+    }
+    else
+        req->state = SSL_DNS_REQUEST_FAILED;
+
+    //nobody waits for this result
+    if (req->abandoned)
+        req->state = SSL_DNS_REQUEST_FREE;
+}
+
+static void ssl_client_dns_abandon(sslclient_context32 *ssl_client)
+{
+    if (ssl_client->dns_slot < 0)
+        return;
+
+    ssl_dns_request32 *req = &ssl_dns_requests[ssl_client->dns_slot];
+    req->abandoned = true;
+    if (req->state != SSL_DNS_REQUEST_PENDING)
+        req->state = SSL_DNS_REQUEST_FREE;
+    ssl_client->dns_slot = -1;
+}
+
+//Resolve the host without blocking, return 1 when resolved, 0 when pending and -1 on error
+static int ssl_client_dns(sslclient_context32 *ssl_client)
+{
+    ip_addr_t addr;
+    err_t err;
+    ssl_dns_request32 *req = NULL;
+
+    if (ssl_client->dns_slot < 0)
+    {
+        ssl_client->ip = ssl_dns_cache_find(ssl_client->host);
+        if (ssl_client->ip)
+            return 1;
+
+        for (int i = 0; i < SSL_DNS_REQUEST_SIZE; i++)
+        {
+            if (ssl_dns_requests[i].state == SSL_DNS_REQUEST_FREE)
+            {
+                ssl_client->dns_slot = i;
+                break;
+            }
+        }
+
+        //all slots wait for the abandoned lookups, resolve in blocking mode
+        if (ssl_client->dns_slot < 0)
+        {
+            IPAddress srv((uint32_t)0);
+            if (!WiFiGenericClass::hostByName(ssl_client->host, srv))
+                return -1;
+            ssl_client->ip = srv;
+            ssl_dns_cache_store(ssl_client->host, ssl_client->ip);
+            return 1;
+        }
+
+        req = &ssl_dns_requests[ssl_client->dns_slot];
+        req->abandoned = false;
+        req->addr = 0;
+        req->state = SSL_DNS_REQUEST_PENDING;
+
+        memset(&addr, 0, sizeof(addr));
+        err = dns_gethostbyname(ssl_client->host, &addr, ssl_dns_found, req);
+
+        if (err == ERR_INPROGRESS)
+            return 0;
+
+        req->state = SSL_DNS_REQUEST_FREE;
+        ssl_client->dns_slot = -1;
+
+        //cached or the host is the IP address string
+        if (err == ERR_OK && addr.u_addr.ip4.addr)
+        {
+            ssl_client->ip = addr.u_addr.ip4.addr;
+            ssl_dns_cache_store(ssl_client->host, ssl_client->ip);
+            return 1;
+        }
         return -1;
     }
 
+    req = &ssl_dns_requests[ssl_client->dns_slot];
+
+    if (req->state == SSL_DNS_REQUEST_PENDING)
+        return 0;
+
+    ssl_client->ip = req->addr;
+    err = req->state == SSL_DNS_REQUEST_DONE ? ERR_OK : ERR_INPROGRESS;
+    req->state = SSL_DNS_REQUEST_FREE;
+    ssl_client->dns_slot = -1;
+
+    if (err != ERR_OK)
+        return -1;
+
+    ssl_dns_cache_store(ssl_client->host, ssl_client->ip);
+    return 1;
+}
+
+//Open the socket and start the non-blocking connect, return 1 when connected, 0 when pending and -1 on error
+static int ssl_client_connect(sslclient_context32 *ssl_client)
+{
     struct sockaddr_in serv_addr;
+
+    log_v("Starting socket");
+
+    ssl_client->socket = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (ssl_client->socket < 0)
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_3, ssl_client);
+        log_e("ERROR opening socket");
+        return -1;
+    }
+
+    fcntl(ssl_client->socket, F_SETFL, fcntl(ssl_client->socket, F_GETFL, 0) | O_NONBLOCK);
+
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = srv;
-    serv_addr.sin_port = htons(port);
+    serv_addr.sin_addr.s_addr = ssl_client->ip;
+    serv_addr.sin_port = htons(ssl_client->port);
 
     if (ssl_client->_debugCallback)
         ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_5, ssl_client);
 
     if (lwip_connect(ssl_client->socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == 0)
-    {
-        if (timeout <= 0)
-        {
-            timeout = 30000;
-        }
-        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-        lwip_setsockopt(ssl_client->socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
-        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+        return 1;
+
+    if (errno == EINPROGRESS)
+        return 0;
+
+    if (ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_7, ssl_client);
+    log_e("Connect to Server failed!");
+    return -1;
+}
+
+static int ssl_client_connect_poll(sslclient_context32 *ssl_client)
+{
+    fd_set writeset;
+    fd_set errset;
+    struct timeval tv;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    FD_ZERO(&writeset);
+    FD_SET(ssl_client->socket, &writeset);
+    FD_ZERO(&errset);
+    FD_SET(ssl_client->socket, &errset);
 
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_6, ssl_client);
-    }
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    err = lwip_select(ssl_client->socket + 1, NULL, &writeset, &errset, &tv);
+    if (err == 0)
+        return 0;
+
+    if (err > 0)
+        lwip_getsockopt(ssl_client->socket, SOL_SOCKET, SO_ERROR, &err, &len);
     else
+        err = -1;
+
+    if (err != 0)
     {
         if (ssl_client->_debugCallback)
             ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_7, ssl_client);
@@ -136,20 +814,23 @@ int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t
         return -1;
     }
 
-    fcntl(ssl_client->socket, F_SETFL, fcntl(ssl_client->socket, F_GETFL, 0) | O_NONBLOCK);
-
-    if (ssl_client->starttls && (port == 25 || port == 587 || port == 143))
-    {
-
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_8, ssl_client);
+    return 1;
+}
 
-        if ((ret = starttlsHandshake(ssl_client, port)) != 0)
-        {
-            log_e("STARTTLS failed!");
-            return -1;
-        }
-    }
+//Seed the RNG, load the certificates and set up the SSL context
+static int ssl_client_setup(sslclient_context32 *ssl_client)
+{
+    char buf[512];
+    int ret;
+    const char *host = ssl_client->host;
+    uint32_t port = ssl_client->port;
+    const char *rootCABuff = ssl_client->rootCABuff;
+    const char *cli_cert = ssl_client->cli_cert;
+    const char *cli_key = ssl_client->cli_key;
+    const char *pskIdent = ssl_client->pskIdent;
+    const char *psKey = ssl_client->psKey;
+    ssl_session_cache_entry32 *cached = NULL;
+    ssl_session_cache_key32 key;
 
     if (ssl_client->_debugCallback)
         ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_9, ssl_client);
@@ -198,6 +879,38 @@ int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t
         return handle_error(ret);
     }
 
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    //the smaller records let mbedTLS built with MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH shrink its record buffers,
+    //the server that does not support the extension keeps sending the full size records
+    if (ssl_client->max_frag_len != MBEDTLS_SSL_MAX_FRAG_LEN_NONE)
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_42, ssl_client);
+
+        if ((ret = mbedtls_ssl_conf_max_frag_len(&ssl_client->ssl_conf, ssl_client->max_frag_len)) != 0)
+            return handle_error(ret);
+    }
+#endif
+
+    //the PSK suites are not in the profiles, keep the defaults for PSK
+    if (ssl_client->cipher_profile != SSL_CIPHER_PROFILE_DEFAULT && pskIdent == NULL)
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_54, ssl_client);
+
+        if (ssl_client->cipher_profile == SSL_CIPHER_PROFILE_ECDHE_ONLY)
+            mbedtls_ssl_conf_ciphersuites(&ssl_client->ssl_conf, ssl_ciphersuites_ecdhe_only);
+        else
+            mbedtls_ssl_conf_ciphersuites(&ssl_client->ssl_conf, ssl_ciphersuites_ecdhe);
+
+#if defined(MBEDTLS_ECP_C)
+        if (ssl_client->cipher_profile == SSL_CIPHER_PROFILE_ECDHE_ONLY)
+            mbedtls_ssl_conf_curves(&ssl_client->ssl_conf, ssl_curves_ecdhe);
+        else
+            mbedtls_ssl_conf_curves(&ssl_client->ssl_conf, ssl_curves_ecdhe_fallback());
+#endif
+    }
+
     // MBEDTLS_SSL_VERIFY_REQUIRED if a CA certificate is defined on Arduino IDE and
     // MBEDTLS_SSL_VERIFY_NONE if not.
 
@@ -206,12 +919,11 @@ int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t
         if (ssl_client->_debugCallback)
             ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_11, ssl_client);
         log_v("Loading CA cert");
-        mbedtls_x509_crt_init(&ssl_client->ca_cert);
         mbedtls_ssl_conf_authmode(&ssl_client->ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-        ret = mbedtls_x509_crt_parse(&ssl_client->ca_cert, (const unsigned char *)rootCABuff, strlen(rootCABuff) + 1);
-        mbedtls_ssl_conf_ca_chain(&ssl_client->ssl_conf, &ssl_client->ca_cert, NULL);
+        ssl_ca_cache_release(ssl_client->ca_chain);
+        ssl_client->ca_chain = ssl_ca_cache_acquire((const unsigned char *)rootCABuff, ssl_client->ca_cert_len, &ret);
         //mbedtls_ssl_conf_verify(&ssl_client->ssl_ctx, my_verify, NULL );
-        if (ret < 0)
+        if (ssl_client->ca_chain == NULL)
         {
             if (ssl_client->_debugCallback)
             {
@@ -225,6 +937,7 @@ int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t
             }
             return handle_error(ret);
         }
+        mbedtls_ssl_conf_ca_chain(&ssl_client->ssl_conf, ssl_client->ca_chain, NULL);
     }
     else if (pskIdent != NULL && psKey != NULL)
     {
@@ -336,122 +1049,535 @@ int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t
     if (ssl_client->_debugCallback)
         ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_17, ssl_client);
 
-    log_v("Setting hostname for TLS session...");
+    log_v("Setting hostname for TLS session...");
+
+    // Hostname set here should match CN in server certificate
+    if ((ret = mbedtls_ssl_set_hostname(&ssl_client->ssl_ctx, host)) != 0)
+    {
+        if (ssl_client->_debugCallback)
+        {
+            char *error_buf = new char[100];
+            memset(buf, 0, 512);
+            strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
+            mbedtls_strerror(ret, error_buf, 100);
+            strcat(buf, error_buf);
+            ssl_client->_debugCallback(buf);
+            delete[] error_buf;
+        }
+        return handle_error(ret);
+    }
+
+    mbedtls_ssl_conf_rng(&ssl_client->ssl_conf, mbedtls_ctr_drbg_random, &ssl_client->drbg_ctx);
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&ssl_client->ssl_conf, ssl_client->session_cache ? MBEDTLS_SSL_SESSION_TICKETS_ENABLED : MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+#endif
+
+    if ((ret = mbedtls_ssl_setup(&ssl_client->ssl_ctx, &ssl_client->ssl_conf)) != 0)
+    {
+        if (ssl_client->_debugCallback)
+        {
+            char *error_buf = new char[100];
+            memset(buf, 0, 512);
+            strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
+            mbedtls_strerror(ret, error_buf, 100);
+            strcat(buf, error_buf);
+            ssl_client->_debugCallback(buf);
+            delete[] error_buf;
+        }
+
+        return handle_error(ret);
+    }
+
+    mbedtls_ssl_set_bio(&ssl_client->ssl_ctx, &ssl_client->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+    //the cached session is copied into the context under the lock, another task may replace the entry afterward
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    //the session made without verification or with another CA is never resumed, its verify result was not checked against this CA
+    if (ssl_client->session_cache && ssl_session_cache_key(ssl_client, &key))
+        cached = ssl_session_cache_find(&key);
+
+    //offer the cached session ID or ticket, the server falls back to the full handshake if it does not accept it
+    if (cached && mbedtls_ssl_set_session(&ssl_client->ssl_ctx, &cached->session) == 0)
+    {
+        ssl_client->cached_id_len = cached->session.id_len;
+        memcpy(ssl_client->cached_id, cached->session.id, ssl_client->cached_id_len);
+    }
+
+    xSemaphoreGive(ssl_cache_mutex);
+
+    if (ssl_client->cached_id_len > 0 && ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_39, ssl_client);
+
+    return 0;
+}
+
+//Verify the peer and update the session cache after the handshake
+static int ssl_client_finish(sslclient_context32 *ssl_client)
+{
+    char buf[512];
+    int ret, flags;
+    const char *host = ssl_client->host;
+    uint32_t port = ssl_client->port;
+    const char *rootCABuff = ssl_client->rootCABuff;
+    const char *cli_cert = ssl_client->cli_cert;
+    const char *cli_key = ssl_client->cli_key;
+
+    if (cli_cert != NULL && cli_key != NULL)
+    {
+        log_d("Protocol is %s Ciphersuite is %s", mbedtls_ssl_get_version(&ssl_client->ssl_ctx), mbedtls_ssl_get_ciphersuite(&ssl_client->ssl_ctx));
+        if ((ret = mbedtls_ssl_get_record_expansion(&ssl_client->ssl_ctx)) >= 0)
+        {
+
+            log_d("Record expansion is %d", ret);
+        }
+        else
+        {
+            log_w("Record expansion is unknown (compression)");
+        }
+    }
+
+    if (ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_19, ssl_client);
+
+    log_v("Verifying peer X.509 certificate...");
+
+    if ((flags = mbedtls_ssl_get_verify_result(&ssl_client->ssl_ctx)) != 0)
+    {
+        bzero(buf, sizeof(buf));
+        mbedtls_x509_crt_verify_info(buf, sizeof(buf), "  ! ", flags);
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_20, ssl_client);
+        log_e("Failed to verify peer certificate! verification info: %s", buf);
+        ssl_session_cache_clear(host, port);
+        stop_ssl_socket(ssl_client, rootCABuff, cli_cert, cli_key); //It's not safe continue.
+        return handle_error(MBEDTLS_ERR_X509_CERT_VERIFY_FAILED);
+    }
+    else
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_21, ssl_client);
+        log_v("Certificate verified.");
+    }
+
+    if (ssl_client->session_cache)
+    {
+        //the server echoes the offered session ID when it accepts the session
+        const mbedtls_ssl_session *session = ssl_client->ssl_ctx.session;
+        if (ssl_client->cached_id_len > 0 && session && session->id_len == ssl_client->cached_id_len && memcmp(session->id, ssl_client->cached_id, ssl_client->cached_id_len) == 0)
+        {
+            ssl_client->session_resumed = true;
+            if (ssl_client->_debugCallback)
+                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_40, ssl_client);
+        }
+        ssl_session_cache_store(ssl_client);
+    }
+
+    ssl_handshake_record_store(ssl_client, host, port);
+
+    if (cli_cert != NULL)
+    {
+        mbedtls_x509_crt_free(&ssl_client->client_cert);
+    }
+
+    if (cli_key != NULL)
+    {
+        mbedtls_pk_free(&ssl_client->client_key);
+    }
+
+    log_v("Free internal heap after TLS %u", ESP.getFreeHeap());
+
+    return 0;
+}
+
+
+//Read the available bytes without blocking, return 1 when a complete line is in starttls_line, 0 when waiting for data and -1 on error
+static int starttls_read_line(sslclient_context32 *ssl_client)
+{
+    char c;
+    int ret;
+
+    while (true)
+    {
+        //one byte at a time, the bytes after the upgrade reply belong to TLS
+        ret = lwip_recv(ssl_client->socket, &c, 1, MSG_DONTWAIT);
+
+        if (ret == 0)
+            return -1;
+
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (ssl_client->_debugCallback)
+                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_28, ssl_client);
+            return -1;
+        }
+
+        if (c == '\r')
+            continue;
+
+        if (c == '\n')
+        {
+            ssl_client->starttls_line[ssl_client->starttls_len] = 0;
+            ssl_client->starttls_len = 0;
+            if (ssl_client->_debugCallback)
+                ssl_client->_debugCallback(ssl_client->starttls_line);
+            return 1;
+        }
+
+        //the long line is truncated, only its beginning is parsed
+        if (ssl_client->starttls_len < SSL_STARTTLS_LINE_LEN - 1)
+            ssl_client->starttls_line[ssl_client->starttls_len++] = c;
+    }
+}
+
+static int starttls_send(sslclient_context32 *ssl_client, const char *cmd, PGM_P info)
+{
+    if (ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(info, ssl_client);
+
+    if (lwip_write(ssl_client->socket, cmd, strlen(cmd)) != (int)strlen(cmd))
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_36, ssl_client);
+        return -1;
+    }
+    return 0;
+}
+
+static void starttls_parse_caps(sslclient_context32 *ssl_client, const char *p)
+{
+    if (strncasecmp(p, ESP32_SSL_CLIENT_STR_47, strlen(ESP32_SSL_CLIENT_STR_47)) == 0)
+        ssl_client->starttls_caps |= SSL_STARTTLS_CAP_STARTTLS;
+    else if (strncasecmp(p, ESP32_SSL_CLIENT_STR_48, strlen(ESP32_SSL_CLIENT_STR_48)) == 0)
+        ssl_client->starttls_caps |= SSL_STARTTLS_CAP_8BITMIME;
+    else if (strncasecmp(p, ESP32_SSL_CLIENT_STR_49, strlen(ESP32_SSL_CLIENT_STR_49)) == 0)
+        ssl_client->starttls_caps |= SSL_STARTTLS_CAP_BINARYMIME;
+    else if (strncasecmp(p, ESP32_SSL_CLIENT_STR_50, strlen(ESP32_SSL_CLIENT_STR_50)) == 0)
+        ssl_client->starttls_caps |= SSL_STARTTLS_CAP_CHUNKING;
+    else if (strncasecmp(p, ESP32_SSL_CLIENT_STR_51, strlen(ESP32_SSL_CLIENT_STR_51)) == 0)
+        ssl_client->starttls_caps |= SSL_STARTTLS_CAP_PIPELINING;
+}
+
+//SMTP, RFC 3207, the reply lines are "250-..." except the last one "250 ..."
+static int starttls_poll_smtp(sslclient_context32 *ssl_client)
+{
+    char cmd[32];
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    const char *line = ssl_client->starttls_line;
+    int ret;
+
+    while ((ret = starttls_read_line(ssl_client)) == 1)
+    {
+        if (ssl_client->starttls_step == SSL_STARTTLS_STEP_EHLO && strlen(line) > 4)
+            starttls_parse_caps(ssl_client, line + 4);
+
+        if (strlen(line) > 3 && line[3] == '-')
+            continue;
+
+        ret = atoi(line);
+
+        if (ssl_client->starttls_step == SSL_STARTTLS_STEP_GREETING)
+        {
+            if (ret != 220)
+                break;
+
+            //no host name is known here, the address literal is the valid EHLO argument (RFC 5321)
+            memset(&local, 0, sizeof(local));
+            lwip_getsockname(ssl_client->socket, (struct sockaddr *)&local, &len);
+            uint32_t addr = ntohl(local.sin_addr.s_addr);
+            sprintf(cmd, ESP32_SSL_CLIENT_STR_29, (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+
+            ssl_client->starttls_caps = 0;
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_EHLO;
+            if (starttls_send(ssl_client, cmd, ESP32_SSL_CLIENT_STR_30) != 0)
+                return -1;
+        }
+        else if (ssl_client->starttls_step == SSL_STARTTLS_STEP_EHLO)
+        {
+            if (ret != 250)
+                break;
+
+            if (!(ssl_client->starttls_caps & SSL_STARTTLS_CAP_STARTTLS))
+            {
+                if (ssl_client->_debugCallback)
+                    ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_46, ssl_client);
+                return -1;
+            }
+
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_UPGRADE;
+            if (starttls_send(ssl_client, ESP32_SSL_CLIENT_STR_34, ESP32_SSL_CLIENT_STR_35) != 0)
+                return -1;
+        }
+        else
+        {
+            if (ret != 220)
+                break;
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_DONE;
+            return 1;
+        }
+    }
+
+    if (ret == 0)
+        return 0;
+
+    if (ret > 0 && ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_45, ssl_client);
+    return -1;
+}
+
+//IMAP, RFC 2595, the untagged lines are skipped until the tagged reply
+static int starttls_poll_imap(sslclient_context32 *ssl_client)
+{
+    const char *line = ssl_client->starttls_line;
+    const char *p;
+    int ret;
+
+    while ((ret = starttls_read_line(ssl_client)) == 1)
+    {
+        if (ssl_client->starttls_step == SSL_STARTTLS_STEP_GREETING)
+        {
+            if (strncasecmp(line, ESP32_SSL_CLIENT_STR_52, strlen(ESP32_SSL_CLIENT_STR_52)) != 0)
+                break;
+
+            //the greeting may carry the capability response code
+            ssl_client->starttls_caps = 0;
+            p = strchr(line, ' ');
+            while (p)
+            {
+                starttls_parse_caps(ssl_client, p + 1);
+                p = strchr(p + 1, ' ');
+            }
+
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_UPGRADE;
+            if (starttls_send(ssl_client, ESP32_SSL_CLIENT_STR_44, ESP32_SSL_CLIENT_STR_35) != 0)
+                return -1;
+        }
+        else
+        {
+            if (line[0] == '*')
+                continue;
+
+            if (strncasecmp(line, ESP32_SSL_CLIENT_STR_53, strlen(ESP32_SSL_CLIENT_STR_53)) != 0)
+                break;
+
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_DONE;
+            return 1;
+        }
+    }
+
+    if (ret == 0)
+        return 0;
+
+    if (ret > 0 && ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_45, ssl_client);
+    return -1;
+}
+
+static int ssl_client_fail(sslclient_context32 *ssl_client, int err)
+{
+    ssl_client_dns_abandon(ssl_client);
+    ssl_client->state = SSL_CLIENT_STATE_FAILED;
+    ssl_client->last_error = err;
+    return err;
+}
+
+int start_ssl_client_async(sslclient_context32 *ssl_client, const char *host, uint32_t port, int timeout, const char *rootCABuff, const char *cli_cert, const char *cli_key, const char *pskIdent, const char *psKey)
+{
+    if (ssl_client->_debugCallback)
+        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_2, ssl_client);
+
+    log_v("Free internal heap before TLS %u", ESP.getFreeHeap());
+
+    ssl_client_dns_abandon(ssl_client);
+    ssl_client->socket = -1;
+    ssl_client->session_resumed = false;
+    ssl_client->cached_id_len = 0;
+
+    if (strlen(host) >= SSL_CLIENT_HOST_LEN)
+    {
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_4, ssl_client);
+        return ssl_client_fail(ssl_client, -1);
+    }
+
+    strcpy(ssl_client->host, host);
+    ssl_client->port = port;
+    ssl_client->timeout = timeout <= 0 ? 30000 : timeout;
+    ssl_client->rootCABuff = rootCABuff;
+    ssl_client->cli_cert = cli_cert;
+    ssl_client->cli_key = cli_key;
+    ssl_client->pskIdent = pskIdent;
+    ssl_client->psKey = psKey;
+    ssl_client->connect_start = millis();
+    ssl_client->state = SSL_CLIENT_STATE_DNS;
+
+    return poll_ssl_client(ssl_client);
+}
+
+int poll_ssl_client(sslclient_context32 *ssl_client)
+{
+    char buf[512];
+    int ret = 0;
+    int enable = 1;
+
+    if (ssl_client->state == SSL_CLIENT_STATE_CONNECTED)
+        return 1;
+
+    if (ssl_client->state == SSL_CLIENT_STATE_FAILED)
+        return ssl_client->last_error;
+
+    if (ssl_client->state == SSL_CLIENT_STATE_IDLE)
+        return -1;
 
-    // Hostname set here should match CN in server certificate
-    if ((ret = mbedtls_ssl_set_hostname(&ssl_client->ssl_ctx, host)) != 0)
+    //one deadline for DNS, TCP connect, STARTTLS and TLS handshake
+    if (millis() - ssl_client->connect_start > ssl_client->handshake_timeout)
     {
         if (ssl_client->_debugCallback)
-        {
-            char *error_buf = new char[100];
-            memset(buf, 0, 512);
-            strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
-            mbedtls_strerror(ret, error_buf, 100);
-            strcat(buf, error_buf);
-            ssl_client->_debugCallback(buf);
-            delete[] error_buf;
-        }
-        return handle_error(ret);
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_43, ssl_client);
+        log_e("Connection timed out");
+        if (ssl_client->state == SSL_CLIENT_STATE_HANDSHAKE)
+            ssl_session_cache_clear(ssl_client->host, ssl_client->port);
+        else if (ssl_client->state == SSL_CLIENT_STATE_CONNECT)
+            ssl_dns_cache_invalidate(ssl_client->host);
+        return ssl_client_fail(ssl_client, -1);
     }
 
-    mbedtls_ssl_conf_rng(&ssl_client->ssl_conf, mbedtls_ctr_drbg_random, &ssl_client->drbg_ctx);
-
-    if ((ret = mbedtls_ssl_setup(&ssl_client->ssl_ctx, &ssl_client->ssl_conf)) != 0)
+    if (ssl_client->state == SSL_CLIENT_STATE_DNS)
     {
-        if (ssl_client->_debugCallback)
+        ret = ssl_client_dns(ssl_client);
+        if (ret == 0)
+            return 0;
+        if (ret < 0)
         {
-            char *error_buf = new char[100];
-            memset(buf, 0, 512);
-            strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
-            mbedtls_strerror(ret, error_buf, 100);
-            strcat(buf, error_buf);
-            ssl_client->_debugCallback(buf);
-            delete[] error_buf;
+            if (ssl_client->_debugCallback)
+                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_4, ssl_client);
+            return ssl_client_fail(ssl_client, -1);
         }
 
-        return handle_error(ret);
+        ret = ssl_client_connect(ssl_client);
+        if (ret < 0)
+        {
+            ssl_dns_cache_invalidate(ssl_client->host);
+            return ssl_client_fail(ssl_client, -1);
+        }
+        ssl_client->state = SSL_CLIENT_STATE_CONNECT;
+    }
+    else if (ssl_client->state == SSL_CLIENT_STATE_CONNECT)
+    {
+        ret = ssl_client_connect_poll(ssl_client);
+        if (ret < 0)
+        {
+            //the server may have moved, look it up again next time
+            ssl_dns_cache_invalidate(ssl_client->host);
+            return ssl_client_fail(ssl_client, -1);
+        }
     }
 
-    mbedtls_ssl_set_bio(&ssl_client->ssl_ctx, &ssl_client->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+    if (ssl_client->state == SSL_CLIENT_STATE_CONNECT)
+    {
+        if (ret == 0)
+            return 0;
 
-    if (ssl_client->_debugCallback)
-        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_18, ssl_client);
+        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_RCVTIMEO, &ssl_client->timeout, sizeof(ssl_client->timeout));
+        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_SNDTIMEO, &ssl_client->timeout, sizeof(ssl_client->timeout));
+        lwip_setsockopt(ssl_client->socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        lwip_setsockopt(ssl_client->socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
 
-    log_v("Performing the SSL/TLS handshake...");
-    unsigned long handshake_start_time = millis();
-    while ((ret = mbedtls_ssl_handshake(&ssl_client->ssl_ctx)) != 0)
-    {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        if (ssl_client->_debugCallback)
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_6, ssl_client);
+
+        ssl_client->state = SSL_CLIENT_STATE_STARTTLS;
+        ssl_client->starttls_step = SSL_STARTTLS_STEP_DONE;
+        ssl_client->starttls_len = 0;
+
+        //the caller selects STARTTLS or implicit TLS, the port number is not checked
+        if (ssl_client->starttls)
         {
             if (ssl_client->_debugCallback)
-            {
-                char *error_buf = new char[100];
-                memset(buf, 0, 512);
-                strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
-                mbedtls_strerror(ret, error_buf, 100);
-                strcat(buf, error_buf);
-                ssl_client->_debugCallback(buf);
-                delete[] error_buf;
-            }
-            return handle_error(ret);
+                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_8, ssl_client);
+            ssl_client->starttls_step = SSL_STARTTLS_STEP_GREETING;
         }
-        if ((millis() - handshake_start_time) > ssl_client->handshake_timeout)
-            return -1;
-        vTaskDelay(10 / portTICK_PERIOD_MS);
     }
 
-    if (cli_cert != NULL && cli_key != NULL)
+    if (ssl_client->state == SSL_CLIENT_STATE_STARTTLS)
     {
-        log_d("Protocol is %s Ciphersuite is %s", mbedtls_ssl_get_version(&ssl_client->ssl_ctx), mbedtls_ssl_get_ciphersuite(&ssl_client->ssl_ctx));
-        if ((ret = mbedtls_ssl_get_record_expansion(&ssl_client->ssl_ctx)) >= 0)
+        if (ssl_client->starttls_step != SSL_STARTTLS_STEP_DONE)
         {
+            if (ssl_client->starttls_proto == SSL_STARTTLS_IMAP)
+                ret = starttls_poll_imap(ssl_client);
+            else
+                ret = starttls_poll_smtp(ssl_client);
 
-            log_d("Record expansion is %d", ret);
-        }
-        else
-        {
-            log_w("Record expansion is unknown (compression)");
+            if (ret == 0)
+                return 0;
+            if (ret < 0)
+            {
+                log_e("STARTTLS failed!");
+                return ssl_client_fail(ssl_client, -1);
+            }
         }
-    }
-
-    if (ssl_client->_debugCallback)
-        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_19, ssl_client);
 
-    log_v("Verifying peer X.509 certificate...");
+        if ((ret = ssl_client_setup(ssl_client)) != 0)
+            return ssl_client_fail(ssl_client, ret);
 
-    if ((flags = mbedtls_ssl_get_verify_result(&ssl_client->ssl_ctx)) != 0)
-    {
-        bzero(buf, sizeof(buf));
-        mbedtls_x509_crt_verify_info(buf, sizeof(buf), "  ! ", flags);
         if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_20, ssl_client);
-        log_e("Failed to verify peer certificate! verification info: %s", buf);
-        stop_ssl_socket(ssl_client, rootCABuff, cli_cert, cli_key); //It's not safe continue.
-        return handle_error(ret);
+            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_18, ssl_client);
+
+        log_v("Performing the SSL/TLS handshake...");
+        ssl_client->state = SSL_CLIENT_STATE_HANDSHAKE;
+        ssl_client->handshake_start = millis();
     }
-    else
+
+    //one handshake step per poll, the socket is non-blocking
+    ret = mbedtls_ssl_handshake(&ssl_client->ssl_ctx);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+        return 0;
+
+    if (ret != 0)
     {
         if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_21, ssl_client);
-        log_v("Certificate verified.");
+        {
+            char *error_buf = new char[100];
+            memset(buf, 0, 512);
+            strcpy_P(buf, ESP32_SSL_CLIENT_STR_1);
+            mbedtls_strerror(ret, error_buf, 100);
+            strcat(buf, error_buf);
+            ssl_client->_debugCallback(buf);
+            delete[] error_buf;
+        }
+        ssl_session_cache_clear(ssl_client->host, ssl_client->port);
+        return ssl_client_fail(ssl_client, handle_error(ret));
     }
 
-    if (rootCABuff != NULL)
-    {
-        mbedtls_x509_crt_free(&ssl_client->ca_cert);
-    }
+    ssl_client->handshake_time = millis() - ssl_client->handshake_start;
 
-    if (cli_cert != NULL)
-    {
-        mbedtls_x509_crt_free(&ssl_client->client_cert);
-    }
+    if ((ret = ssl_client_finish(ssl_client)) != 0)
+        return ssl_client_fail(ssl_client, ret);
 
-    if (cli_key != NULL)
+    ssl_client->state = SSL_CLIENT_STATE_CONNECTED;
+    return 1;
+}
+
+int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t port, int timeout, const char *rootCABuff, const char *cli_cert, const char *cli_key, const char *pskIdent, const char *psKey)
+{
+    int ret = start_ssl_client_async(ssl_client, host, port, timeout, rootCABuff, cli_cert, cli_key, pskIdent, psKey);
+
+    while (ret == 0)
     {
-        mbedtls_pk_free(&ssl_client->client_key);
+        //let the application service its own work while waiting
+        if (ssl_client->_idleCallback)
+            ssl_client->_idleCallback();
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+        ret = poll_ssl_client(ssl_client);
     }
 
-    log_v("Free internal heap after TLS %u", ESP.getFreeHeap());
+    if (ret < 0)
+        return ret;
 
     return ssl_client->socket;
 }
@@ -472,6 +1598,13 @@ void stop_ssl_socket(sslclient_context32 *ssl_client, const char *rootCABuff, co
     mbedtls_ssl_config_free(&ssl_client->ssl_conf);
     mbedtls_ctr_drbg_free(&ssl_client->drbg_ctx);
     mbedtls_entropy_free(&ssl_client->entropy_ctx);
+
+    ssl_client_dns_abandon(ssl_client);
+    ssl_client->state = SSL_CLIENT_STATE_IDLE;
+
+    //the parsed CA chain stays in the cache for the next connection
+    ssl_ca_cache_release(ssl_client->ca_chain);
+    ssl_client->ca_chain = NULL;
 }
 
 int data_to_read(sslclient_context32 *ssl_client)
@@ -501,23 +1634,40 @@ int data_to_read(sslclient_context32 *ssl_client)
     return res;
 }
 
-int send_ssl_data(sslclient_context32 *ssl_client, const uint8_t *data, uint16_t len)
+int send_ssl_data(sslclient_context32 *ssl_client, const uint8_t *data, size_t len)
 {
 
     log_v("Writing HTTP request..."); //for low level debug
     int ret = -1;
+    size_t written = 0;
+    unsigned long lastProgress = millis();
 
-    while ((ret = mbedtls_ssl_write(&ssl_client->ssl_ctx, data, len)) <= 0)
+    //mbedtls_ssl_write writes at most one record (the maximum fragment length) per call
+    while (written < len)
     {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        ret = mbedtls_ssl_write(&ssl_client->ssl_ctx, data + written, len - written);
+        if (ret > 0)
+        {
+            written += ret;
+            lastProgress = millis();
+            continue;
+        }
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != 0)
         {
             return handle_error(ret);
         }
+
+        //the socket is non-blocking, the send buffer is full until the peer acknowledges
+        if (millis() - lastProgress > (unsigned long)ssl_client->timeout)
+        {
+            log_e("Write timed out");
+            return handle_error(MBEDTLS_ERR_SSL_TIMEOUT);
+        }
+        vTaskDelay(1);
     }
 
-    len = ret;
-    //log_v("%d bytes written", len);  //for low level debug
-    return ret;
+    //log_v("%d bytes written", written);  //for low level debug
+    return written;
 }
 
 int get_ssl_receive(sslclient_context32 *ssl_client, uint8_t *data, int length)
@@ -532,6 +1682,115 @@ int get_ssl_receive(sslclient_context32 *ssl_client, uint8_t *data, int length)
     return ret;
 }
 
+//Read the decrypted data of all buffered and received records, up to length, without waiting
+//return the bytes read, 0 when nothing was received or the error
+int ssl_read_available(sslclient_context32 *ssl_client, uint8_t *data, size_t length)
+{
+    size_t total = 0;
+    int ret = 0;
+
+    //each call returns the data of one record at most
+    while (total < length)
+    {
+        ret = mbedtls_ssl_read(&ssl_client->ssl_ctx, data + total, length - total);
+
+        if (ret > 0)
+        {
+            total += ret;
+            continue;
+        }
+
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            break;
+
+        //the error is reported again with the next call
+        if (total > 0)
+            break;
+
+        if (ret == 0)
+            return -1;
+
+        return handle_error(ret);
+    }
+
+    return total;
+}
+
+//Cheap readable hint, no record is read or decrypted
+//return the decrypted bytes buffered, 1 when the undecrypted data is waiting or 0
+int ssl_readable(sslclient_context32 *ssl_client)
+{
+    int pending = 0;
+    int avail = mbedtls_ssl_get_bytes_avail(&ssl_client->ssl_ctx);
+
+    if (avail > 0)
+        return avail;
+
+    if (mbedtls_ssl_check_pending(&ssl_client->ssl_ctx))
+        return 1;
+
+    if (lwip_ioctl(ssl_client->socket, FIONREAD, &pending) == 0 && pending > 0)
+        return 1;
+
+    return 0;
+}
+
+//Point data to the decrypted payload of the current record in the mbedTLS input buffer, no copy is made
+//return the payload length, 0 when nothing was received or the error
+//the payload stays valid until it is released or the next read
+int ssl_receive_span(sslclient_context32 *ssl_client, const uint8_t **data)
+{
+    *data = NULL;
+
+//the record fields are private since mbedTLS 3
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+    int ret;
+
+    if (mbedtls_ssl_get_bytes_avail(&ssl_client->ssl_ctx) == 0)
+    {
+        //read and decrypt the next record without consuming its payload
+        ret = mbedtls_ssl_read(&ssl_client->ssl_ctx, NULL, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+            return handle_error(ret);
+    }
+
+    size_t avail = mbedtls_ssl_get_bytes_avail(&ssl_client->ssl_ctx);
+    if (avail == 0)
+        return 0;
+
+    *data = ssl_client->ssl_ctx.in_offt;
+    return avail;
+#else
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+#endif
+}
+
+//Consume len bytes of the span, the same bookkeeping as mbedtls_ssl_read without the copy
+void ssl_receive_release(sslclient_context32 *ssl_client, size_t len)
+{
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+    mbedtls_ssl_context *ssl = &ssl_client->ssl_ctx;
+
+    if (ssl->in_offt == NULL)
+        return;
+
+    if (len > ssl->in_msglen)
+        len = ssl->in_msglen;
+
+    ssl->in_msglen -= len;
+
+    if (ssl->in_msglen == 0)
+    {
+        ssl->in_offt = NULL;
+#if MBEDTLS_VERSION_NUMBER >= 0x020A0000
+        ssl->keep_current_message = 0;
+#endif
+    }
+    else
+        ssl->in_offt += len;
+#endif
+}
+
 static bool parseHexNibble(char pb, uint8_t *res)
 {
     if (pb >= '0' && pb <= '9')
@@ -628,11 +1887,7 @@ bool verify_ssl_fingerprint(sslclient_context32 *ssl_client, const char *fp, con
 
     // Calculate certificate's SHA256 fingerprint
     uint8_t fingerprint_remote[32];
-    mbedtls_sha256_context sha256_ctx;
-    mbedtls_sha256_init(&sha256_ctx);
-    mbedtls_sha256_starts(&sha256_ctx, false);
-    mbedtls_sha256_update(&sha256_ctx, crt->raw.p, crt->raw.len);
-    mbedtls_sha256_finish(&sha256_ctx, fingerprint_remote);
+    ssl_sha256(crt->raw.p, crt->raw.len, fingerprint_remote);
 
     // Check if fingerprints match
     if (memcmp(fingerprint_local, fingerprint_remote, 32))
@@ -698,144 +1953,120 @@ bool verify_ssl_dn(sslclient_context32 *ssl_client, const char *domain_name)
     return false;
 }
 
-int starttlsHandshake(sslclient_context32 *ssl_client, int port)
+void ssl_session_cache_clear(const char *host, uint16_t port)
 {
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
 
-    int ret = 0;
-    size_t msgLen = 100;
-    size_t bufLen = 512;
-    char *buf = new char[bufLen];
-    char *hMsg = new char[msgLen];
-
-    fd_set readset;
-    fd_set writeset;
-    fd_set errset;
-
-    struct timeval tv;
-
-    FD_ZERO(&readset);
-    FD_SET(ssl_client->socket, &readset);
-    FD_ZERO(&writeset);
-    FD_SET(ssl_client->socket, &writeset);
-
-    FD_ZERO(&errset);
-    FD_SET(ssl_client->socket, &errset);
-
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-
-    ret = lwip_select(ssl_client->socket, &readset, &writeset, &errset, &tv);
-    if (ret < 0)
-    {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_27, ssl_client);
-
-        goto starttls_exit;
-    }
-
-    ret = read(ssl_client->socket, buf, bufLen);
-
-    if (ret < 0)
-    {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_28, ssl_client);
-        goto starttls_exit;
-    }
-    else
+    for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
     {
-        if (ssl_client->_debugCallback)
-            ssl_client->_debugCallback(buf);
+        if (host == NULL || (ssl_session_cache[i].key.port == port && strcmp(ssl_session_cache[i].key.host, host) == 0))
+            ssl_session_cache_remove(&ssl_session_cache[i]);
     }
 
-    if (port == 587 || port == 25)
-    {
+    xSemaphoreGive(ssl_cache_mutex);
+}
 
-        memset(hMsg, 0, msgLen);
-        strcpy_P(hMsg, ESP32_SSL_CLIENT_STR_29);
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_30, ssl_client);
-        ret = lwip_write(ssl_client->socket, hMsg, strlen(hMsg));
+//Session serialization (mbedtls_ssl_session_save/load) is available since mbedTLS 2.19
+bool ssl_session_cache_save(const char *name)
+{
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+    Preferences prefs;
+    char key[8];
+    size_t len = 0;
+    size_t hlen = sizeof(ssl_session_cache_key32);
+    unsigned char *blob = NULL;
+
+    if (!prefs.begin(name, false))
+        return false;
 
-        if (ret < 0)
-        {
-            if (ssl_client->_debugCallback)
-                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_31, ssl_client);
-            goto starttls_exit;
-        }
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
 
-        ret = lwip_select(ssl_client->socket, &readset, &writeset, &errset, &tv);
+    for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+    {
+        memset(key, 0, sizeof(key));
+        strcpy_P(key, ESP32_SSL_CLIENT_STR_41);
+        itoa(i, key + strlen(key), 10);
 
-        if (ret < 0)
+        if (!ssl_session_cache[i].valid)
         {
-            if (ssl_client->_debugCallback)
-                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_32, ssl_client);
-            goto starttls_exit;
+            prefs.remove(key);
+            continue;
         }
 
-        memset(buf, 0, bufLen);
-        ret = lwip_read(ssl_client->socket, buf, bufLen);
+        //blob: cache key, serialized session
+        mbedtls_ssl_session_save(&ssl_session_cache[i].session, NULL, 0, &len);
+        blob = new unsigned char[hlen + len];
+        memcpy(blob, &ssl_session_cache[i].key, hlen);
 
-        if (ret < 0)
-        {
-            if (ssl_client->_debugCallback)
-                ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_33, ssl_client);
-            goto starttls_exit;
-        }
+        if (mbedtls_ssl_session_save(&ssl_session_cache[i].session, blob + hlen, len, &len) == 0)
+            prefs.putBytes(key, blob, hlen + len);
         else
-        {
-            if (ssl_client->_debugCallback)
-                ssl_client->_debugCallback(buf);
-        }
+            prefs.remove(key);
+
+        delete[] blob;
     }
 
-    memset(hMsg, 0, msgLen);
-    strcpy_P(hMsg, ESP32_SSL_CLIENT_STR_34);
-    if (ssl_client->_debugCallback)
-        ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_35, ssl_client);
-    ret = lwip_write(ssl_client->socket, hMsg, strlen(hMsg));
+    xSemaphoreGive(ssl_cache_mutex);
 
-    if (ret < 0)
-    {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_36, ssl_client);
-        goto starttls_exit;
-    }
+    prefs.end();
+    return true;
+#else
+    return false;
+#endif
+}
 
-    ret = lwip_select(ssl_client->socket, &readset, &writeset, &errset, &tv);
+bool ssl_session_cache_load(const char *name)
+{
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+    Preferences prefs;
+    char key[8];
+    size_t len = 0;
+    size_t hlen = sizeof(ssl_session_cache_key32);
+    unsigned char *blob = NULL;
+    ssl_session_cache_entry32 *entry = NULL;
+
+    if (!prefs.begin(name, true))
+        return false;
 
-    if (ret < 0)
+    xSemaphoreTake(ssl_cache_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
     {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_37, ssl_client);
-        goto starttls_exit;
-    }
+        memset(key, 0, sizeof(key));
+        strcpy_P(key, ESP32_SSL_CLIENT_STR_41);
+        itoa(i, key + strlen(key), 10);
 
-    memset(buf, 0, bufLen);
-    ret = lwip_read(ssl_client->socket, buf, bufLen);
+        len = prefs.getBytesLength(key);
+        if (len <= hlen)
+            continue;
 
-    if (ret < 0)
-    {
-        if (ssl_client->_debugCallback)
-            ESP32SSLClientDebugInfo(ESP32_SSL_CLIENT_STR_38, ssl_client);
-        goto starttls_exit;
-    }
-    else
-    {
-        if (ssl_client->_debugCallback)
-            ssl_client->_debugCallback(buf);
-    }
+        blob = new unsigned char[len];
+        prefs.getBytes(key, blob, len);
 
-    delete[] buf;
-    delete[] hMsg;
+        entry = &ssl_session_cache[i];
+        ssl_session_cache_remove(entry);
+        mbedtls_ssl_session_init(&entry->session);
 
-    return 0;
+        if (mbedtls_ssl_session_load(&entry->session, blob + hlen, len - hlen) == 0)
+        {
+            memcpy(&entry->key, blob, hlen);
+            entry->key.host[SSL_SESSION_CACHE_HOST_LEN - 1] = 0;
+            entry->last_used = ++ssl_session_cache_stamp;
+            entry->valid = true;
+        }
+        else
+            mbedtls_ssl_session_free(&entry->session);
 
-starttls_exit:
+        delete[] blob;
+    }
 
-    delete[] buf;
-    delete[] hMsg;
+    xSemaphoreGive(ssl_cache_mutex);
 
-    return -1;
+    prefs.end();
+    return true;
+#else
+    return false;
+#endif
 }
 
 void ESP32SSLClientDebugInfo(PGM_P info, sslclient_context32 *ssl_client)
@@ -39,6 +39,52 @@
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
+#include "mbedtls/version.h"
+
+#define SSL_SESSION_CACHE_SIZE 4
+#define SSL_SESSION_CACHE_HOST_LEN 64
+#define SSL_HANDSHAKE_RECORD_SIZE 4
+#define SSL_HANDSHAKE_RECORD_HOST_LEN 64
+
+#define SSL_CIPHER_PROFILE_DEFAULT 0
+#define SSL_CIPHER_PROFILE_ECDHE 1
+#define SSL_CIPHER_PROFILE_ECDHE_ONLY 2
+#define SSL_CA_CACHE_SIZE 4
+#define SSL_CLIENT_HOST_LEN 256
+#define SSL_DNS_REQUEST_SIZE 4
+#define SSL_DNS_CACHE_SIZE 4
+#define SSL_DNS_CACHE_HOST_LEN 64
+#define SSL_DNS_CACHE_TTL 300000
+
+#define SSL_CLIENT_STATE_IDLE 0
+#define SSL_CLIENT_STATE_DNS 1
+#define SSL_CLIENT_STATE_CONNECT 2
+#define SSL_CLIENT_STATE_STARTTLS 3
+#define SSL_CLIENT_STATE_HANDSHAKE 4
+#define SSL_CLIENT_STATE_CONNECTED 5
+#define SSL_CLIENT_STATE_FAILED 6
+
+#define SSL_STARTTLS_SMTP 0
+#define SSL_STARTTLS_IMAP 1
+
+#define SSL_STARTTLS_STEP_GREETING 0
+#define SSL_STARTTLS_STEP_EHLO 1
+#define SSL_STARTTLS_STEP_UPGRADE 2
+#define SSL_STARTTLS_STEP_DONE 3
+
+#define SSL_STARTTLS_LINE_LEN 128
+
+//Capabilities advertised before the TLS upgrade (SMTP EHLO or IMAP greeting)
+#define SSL_STARTTLS_CAP_STARTTLS 0x01
+#define SSL_STARTTLS_CAP_8BITMIME 0x02
+#define SSL_STARTTLS_CAP_BINARYMIME 0x04
+#define SSL_STARTTLS_CAP_CHUNKING 0x08
+#define SSL_STARTTLS_CAP_PIPELINING 0x10
+
+#define SSL_DNS_REQUEST_FREE 0
+#define SSL_DNS_REQUEST_PENDING 1
+#define SSL_DNS_REQUEST_DONE 2
+#define SSL_DNS_REQUEST_FAILED 3
 
 static const char ESP32_SSL_CLIENT_STR_1[] PROGMEM = "ERROR: ";
 static const char ESP32_SSL_CLIENT_STR_2[] PROGMEM = "INFO: starting socket";
@@ -66,24 +112,43 @@ static const char ESP32_SSL_CLIENT_STR_23[] PROGMEM = "ERROR: fingerprint too sh
 static const char ESP32_SSL_CLIENT_STR_24[] PROGMEM = "ERROR: invalid hex sequence";
 static const char ESP32_SSL_CLIENT_STR_25[] PROGMEM = "ERROR: could not fetch peer certificate";
 static const char ESP32_SSL_CLIENT_STR_26[] PROGMEM = "ERROR: fingerprint doesn't match";
-static const char ESP32_SSL_CLIENT_STR_27[] PROGMEM = "ERROR: waiting incoming data failed!";
 static const char ESP32_SSL_CLIENT_STR_28[] PROGMEM = "ERROR: reading incoming data failed!";
-static const char ESP32_SSL_CLIENT_STR_29[] PROGMEM = "EHLO DUDE\r\n";
+static const char ESP32_SSL_CLIENT_STR_29[] PROGMEM = "EHLO [%u.%u.%u.%u]\r\n";
 static const char ESP32_SSL_CLIENT_STR_30[] PROGMEM = "INFO: send SMTP command extended HELO";
-static const char ESP32_SSL_CLIENT_STR_31[] PROGMEM = "ERROR: send SMTP command failed!";
-static const char ESP32_SSL_CLIENT_STR_32[] PROGMEM = "ERROR: waiting incoming data failed!";
-static const char ESP32_SSL_CLIENT_STR_33[] PROGMEM = "ERROR: reading incoming data failed!";
 static const char ESP32_SSL_CLIENT_STR_34[] PROGMEM = "STARTTLS\r\n";
 static const char ESP32_SSL_CLIENT_STR_35[] PROGMEM = "INFO: send STARTTLS protocol command";
 static const char ESP32_SSL_CLIENT_STR_36[] PROGMEM = "ERROR: send STARTTLS protocol command failed!";
-static const char ESP32_SSL_CLIENT_STR_37[] PROGMEM = "ERROR: waiting incoming data failed!";
-static const char ESP32_SSL_CLIENT_STR_38[] PROGMEM = "ERROR: reading incoming data failed!";
+static const char ESP32_SSL_CLIENT_STR_39[] PROGMEM = "INFO: resuming cached TLS session";
+static const char ESP32_SSL_CLIENT_STR_40[] PROGMEM = "INFO: TLS session resumed";
+static const char ESP32_SSL_CLIENT_STR_41[] PROGMEM = "tls";
+static const char ESP32_SSL_CLIENT_STR_42[] PROGMEM = "INFO: requesting maximum fragment length";
+static const char ESP32_SSL_CLIENT_STR_43[] PROGMEM = "ERROR: connection timed out";
+static const char ESP32_SSL_CLIENT_STR_44[] PROGMEM = "$ STARTTLS\r\n";
+static const char ESP32_SSL_CLIENT_STR_45[] PROGMEM = "ERROR: unexpected server response";
+static const char ESP32_SSL_CLIENT_STR_46[] PROGMEM = "ERROR: server does not support STARTTLS";
+static const char ESP32_SSL_CLIENT_STR_47[] PROGMEM = "STARTTLS";
+static const char ESP32_SSL_CLIENT_STR_48[] PROGMEM = "8BITMIME";
+static const char ESP32_SSL_CLIENT_STR_49[] PROGMEM = "BINARYMIME";
+static const char ESP32_SSL_CLIENT_STR_50[] PROGMEM = "CHUNKING";
+static const char ESP32_SSL_CLIENT_STR_51[] PROGMEM = "PIPELINING";
+static const char ESP32_SSL_CLIENT_STR_52[] PROGMEM = "* OK";
+static const char ESP32_SSL_CLIENT_STR_53[] PROGMEM = "$ OK";
+static const char ESP32_SSL_CLIENT_STR_54[] PROGMEM = "INFO: preferring ECDHE ciphersuites";
 
 typedef void (*DebugMsgCallback)(const char *msg);
+typedef void (*ConnectIdleCallback)(void);
 
 typedef struct sslclient_context32 {
     int socket;
     bool starttls;
+    int starttls_proto;
+    int starttls_step;
+    unsigned char starttls_caps;
+    char starttls_line[SSL_STARTTLS_LINE_LEN];
+    size_t starttls_len;
+    int cipher_profile;
+    unsigned long handshake_start;
+    unsigned long handshake_time;
     mbedtls_ssl_context ssl_ctx;
     mbedtls_ssl_config ssl_conf;
     mbedtls_net_context server_fd;
@@ -91,25 +156,117 @@ typedef struct sslclient_context32 {
     mbedtls_ctr_drbg_context drbg_ctx;
     mbedtls_entropy_context entropy_ctx;
 
-    mbedtls_x509_crt ca_cert;
+    mbedtls_x509_crt *ca_chain;
+    size_t ca_cert_len;
     mbedtls_x509_crt client_cert;
     mbedtls_pk_context client_key;
     DebugMsgCallback _debugCallback;
 
     unsigned long handshake_timeout;
+
+    bool session_cache;
+    bool session_resumed;
+
+    unsigned char max_frag_len;
+
+    int state;
+    int last_error;
+    unsigned long connect_start;
+    char host[SSL_CLIENT_HOST_LEN];
+    uint32_t port;
+    int timeout;
+    uint32_t ip;
+    int dns_slot;
+    const char *rootCABuff;
+    const char *cli_cert;
+    const char *cli_key;
+    const char *pskIdent;
+    const char *psKey;
+    unsigned char cached_id[32];
+    size_t cached_id_len;
+    ConnectIdleCallback _idleCallback;
 } sslclient_context32;
 
+//The session is resumed only with the same server, peer verification mode and CA chain
+typedef struct ssl_session_cache_key32 {
+    char host[SSL_SESSION_CACHE_HOST_LEN];
+    uint16_t port;
+    int authmode;
+    uintptr_t ca_buf;
+    size_t ca_len;
+    uint32_t ca_hash;
+} ssl_session_cache_key32;
+
+typedef struct ssl_session_cache_entry32 {
+    bool valid;
+    ssl_session_cache_key32 key;
+    unsigned long last_used;
+    mbedtls_ssl_session session;
+} ssl_session_cache_entry32;
+
+typedef struct ssl_dns_request32 {
+    volatile int state;
+    volatile bool abandoned;
+    volatile uint32_t addr;
+} ssl_dns_request32;
+
+typedef struct ssl_dns_cache_entry32 {
+    bool valid;
+    char host[SSL_DNS_CACHE_HOST_LEN];
+    uint32_t addr;
+    unsigned long stamp;
+} ssl_dns_cache_entry32;
+
+typedef struct ssl_handshake_record32 {
+    bool valid;
+    char host[SSL_HANDSHAKE_RECORD_HOST_LEN];
+    uint16_t port;
+    int ciphersuite;
+    bool resumed;
+    unsigned long handshake_time;
+    unsigned long connect_time;
+    unsigned long count;
+    unsigned long last_used;
+} ssl_handshake_record32;
+
+typedef struct ssl_ca_cache_entry32 {
+    bool valid;
+    const unsigned char *buf;
+    size_t len;
+    uint32_t hash;
+    int refcount;
+    unsigned long last_used;
+    mbedtls_x509_crt crt;
+} ssl_ca_cache_entry32;
+
 
 void ssl_init(sslclient_context32 *ssl_client);
 int start_ssl_client(sslclient_context32 *ssl_client, const char *host, uint32_t port, int timeout, const char *rootCABuff, const char *cli_cert, const char *cli_key, const char *pskIdent, const char *psKey);
+int start_ssl_client_async(sslclient_context32 *ssl_client, const char *host, uint32_t port, int timeout, const char *rootCABuff, const char *cli_cert, const char *cli_key, const char *pskIdent, const char *psKey);
+int poll_ssl_client(sslclient_context32 *ssl_client);
 void stop_ssl_socket(sslclient_context32 *ssl_client, const char *rootCABuff, const char *cli_cert, const char *cli_key);
 int data_to_read(sslclient_context32 *ssl_client);
-int send_ssl_data(sslclient_context32 *ssl_client, const uint8_t *data, uint16_t len);
+int send_ssl_data(sslclient_context32 *ssl_client, const uint8_t *data, size_t len);
 int get_ssl_receive(sslclient_context32 *ssl_client, uint8_t *data, int length);
+int ssl_read_available(sslclient_context32 *ssl_client, uint8_t *data, size_t length);
+int ssl_readable(sslclient_context32 *ssl_client);
+int ssl_receive_span(sslclient_context32 *ssl_client, const uint8_t **data);
+void ssl_receive_release(sslclient_context32 *ssl_client, size_t len);
 bool verify_ssl_fingerprint(sslclient_context32 *ssl_client, const char* fp, const char* domain_name);
 bool verify_ssl_dn(sslclient_context32 *ssl_client, const char* domain_name);
-int starttlsHandshake(sslclient_context32 *ssl_client, int port);
 void ESP32SSLClientDebugInfo(PGM_P info, sslclient_context32 *ssl_client);
+unsigned char ssl_max_frag_len_code(uint16_t length);
+void ssl_sha256(const unsigned char *buf, size_t len, unsigned char *digest);
+void ssl_session_cache_clear(const char *host, uint16_t port);
+bool ssl_session_cache_save(const char *name);
+bool ssl_session_cache_load(const char *name);
+mbedtls_x509_crt *ssl_ca_cache_acquire(const unsigned char *buf, size_t len, int *err);
+void ssl_ca_cache_release(mbedtls_x509_crt *crt);
+void ssl_ca_cache_clear();
+bool ssl_dns_cache_resolve(const char *host);
+void ssl_dns_cache_invalidate(const char *host);
+void ssl_dns_cache_set_ttl(unsigned long ttl);
+bool ssl_handshake_record_get(const char *host, uint16_t port, ssl_handshake_record32 *record);
 
 #endif //ESP32
 